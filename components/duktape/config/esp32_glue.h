@@ -8,4 +8,17 @@ duk_double_t esp32_duktape_get_now();
 
 duk_double_t esp32_duktape_random_double();
 
+/*
+ * Execution budget, passed as heap udata.
+ * Times are esp_timer_get_time() microseconds, deadline 0 = no limit.
+ */
+typedef struct
+{
+    long long deadline;
+    long long budget;
+    unsigned int overruns;
+} esp32_duktape_budget_t;
+
+duk_bool_t esp32_duktape_exec_timeout_check(void *udata);
+
 #endif
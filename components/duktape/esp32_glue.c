@@ -7,6 +7,7 @@
 #ifndef __JSTEST__
 #include "freertos/FreeRTOS.h"
 #include "driver/rtc_io.h"
+#include "esp_timer.h"
 #endif
 
 #include <duktape.h>
@@ -29,3 +30,25 @@ duk_double_t esp32_duktape_random_double()
 	return 42;
 	#endif
 }
+
+duk_bool_t esp32_duktape_exec_timeout_check(void *udata)
+{
+	#ifndef __JSTEST__
+	esp32_duktape_budget_t *b = (esp32_duktape_budget_t *)udata;
+	if (b == NULL || b->deadline == 0)
+	{
+		return 0;
+	}
+	long long now = esp_timer_get_time();
+	if (now < b->deadline)
+	{
+		return 0;
+	}
+	b->overruns++;
+	// throws a RangeError, the handler gets another budget to deal with it
+	b->deadline = now + b->budget;
+	return 1;
+	#else
+	return 0;
+	#endif
+}
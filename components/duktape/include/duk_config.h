@@ -2930,7 +2930,7 @@ typedef struct duk_hthread duk_context;
 #undef DUK_USE_BASE64_FASTPATH
 #define DUK_USE_BASE64_SUPPORT
 #define DUK_USE_BUFFEROBJECT_SUPPORT
-#undef DUK_USE_BYTECODE_DUMP_SUPPORT
+#define DUK_USE_BYTECODE_DUMP_SUPPORT
 #undef DUK_USE_CACHE_ACTIVATION
 #undef DUK_USE_CACHE_CATCHER
 #undef DUK_USE_CBOR_BUILTIN
@@ -3040,7 +3040,7 @@ typedef struct duk_hthread duk_context;
 #undef DUK_USE_EXEC_FUN_LOCAL
 #undef DUK_USE_EXEC_INDIRECT_BOUND_CHECK
 #define DUK_USE_EXEC_REGCONST_OPTIMIZE
-#undef DUK_USE_EXEC_TIMEOUT_CHECK
+#define DUK_USE_EXEC_TIMEOUT_CHECK esp32_duktape_exec_timeout_check
 #undef DUK_USE_EXPLICIT_NULL_INIT
 #undef DUK_USE_EXTSTR_FREE
 #undef DUK_USE_EXTSTR_INTERN_CHECK
@@ -3070,7 +3070,7 @@ typedef struct duk_hthread duk_context;
 #define DUK_USE_HSTRING_CLEN
 #undef DUK_USE_HSTRING_EXTDATA
 #undef DUK_USE_INJECT_HEAP_ALLOC_ERROR
-#undef DUK_USE_INTERRUPT_COUNTER
+#define DUK_USE_INTERRUPT_COUNTER
 #undef DUK_USE_INTERRUPT_DEBUG_FIXUP
 #define DUK_USE_JSON_BUILTIN
 #define DUK_USE_JSON_DEC_RECLIMIT 1000
@@ -3142,6 +3142,19 @@ duk_double_t esp32_duktape_get_now();
 
 duk_double_t esp32_duktape_random_double();
 
+/*
+ * Execution budget, passed as heap udata.
+ * Times are esp_timer_get_time() microseconds, deadline 0 = no limit.
+ */
+typedef struct
+{
+    long long deadline;
+    long long budget;
+    unsigned int overruns;
+} esp32_duktape_budget_t;
+
+duk_bool_t esp32_duktape_exec_timeout_check(void *udata);
+
 #endif
 
 /*
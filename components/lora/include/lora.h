@@ -14,8 +14,58 @@
 
 #define LORA_MSG_MAX_SIZE 255
 
+// lora_cad_done() results
+#define LORA_CAD_PENDING -1
+#define LORA_CAD_FREE 0
+#define LORA_CAD_BUSY 1
+
 typedef void (*lora_isr_t)(void *);
 
+struct lora_reg_t
+{
+  uint8_t reg;
+  uint8_t val;
+};
+
+struct lora_spi_stats_t
+{
+  // SPI transactions (register access and bursts)
+  unsigned int transactions;
+  // time to move a packet to / from the FIFO
+  unsigned int fifo_transfers;
+  unsigned long int fifo_last_us;
+  unsigned long int fifo_max_us;
+  // register reads / writes answered by the register shadow
+  unsigned int reads_saved;
+  unsigned int writes_saved;
+};
+
+struct lora_rx_stats_t
+{
+  // packets read by lora_receive_packet()
+  unsigned int packets;
+  // packets dropped for a payload CRC error / missing valid header
+  unsigned int crc_errors;
+  unsigned int header_errors;
+};
+
+struct lora_lbt_stats_t
+{
+  // channel activity detections run / found the channel busy
+  unsigned int cad_runs;
+  unsigned int busy;
+  // backoffs after a busy channel, packets given up after the last retry
+  unsigned int retries;
+  unsigned int dropped;
+};
+
+// frequency registers for one hopping channel, see lora_frf_table()
+struct lora_frf_t
+{
+  uint8_t reg[3];
+  long frequency;
+};
+
 void lora_config_dio(const int gpio_dio0, const int gpio_dio1, const int gpio_dio2);
 void lora_config(const int gpio_cs, const int gpio_rst, const int gpio_miso, const int gpio_mosi, const int gpio_sck);
 int lora_init(void);
@@ -38,6 +88,19 @@ void lora_set_sync_word(int sw);
 void lora_enable_crc(void);
 void lora_disable_crc(void);
 void lora_send_packet(uint8_t *buf, const int size);
+void lora_send_packet_start(const uint8_t *buf, const int size);
+int lora_send_packet_done(void);
+void lora_send_packet_abort(void);
+unsigned long lora_time_on_air_us(const int size);
+void lora_set_lbt(const int enable, const int retries, const int backoff_ms);
+int lora_lbt_enabled(void);
+void lora_get_lbt_stats(struct lora_lbt_stats_t *stats);
+void lora_cad_start(void);
+int lora_cad_done(void);
+void lora_cad_abort(void);
+int lora_cad(void);
+int lora_lbt_backoff_ms(const int attempt);
+int lora_send_packet_lbt(uint8_t *buf, const int size);
 int lora_receive_packet(uint8_t *buf, const int size);
 int lora_received(void);
 int lora_packet_rssi(void);
@@ -45,6 +108,10 @@ float lora_packet_snr(void);
 void lora_dump_registers(void);
 void lora_get_settings(int *bw, int *cr, int *sf);
 void lora_set_gain(uint8_t gain);
+void lora_get_spi_stats(struct lora_spi_stats_t *stats);
+void lora_get_rx_stats(struct lora_rx_stats_t *stats);
+void lora_config_begin(void);
+int lora_config_commit(void);
 
 void lora_disable_invert_iq();
 void lora_enable_invert_iq();
@@ -60,5 +127,7 @@ int lora_uninstall_irq_fhss();
 int lora_enable_irq_fhss(int enable);
 void lora_fhss_sethops(const int hops);
 int lora_fhss_handle(const double *fhtable, const int fhtable_size);
+void lora_frf_table(const double *freqs, struct lora_frf_t *table, const int num);
+int lora_fhss_handle_frf(const struct lora_frf_t *table, const int num);
 
 #endif
@@ -8,16 +8,25 @@
 
 #include <string.h>
 
+#ifndef LORA_SIM
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "driver/spi_master.h"
 #include "soc/gpio_struct.h"
 #include "driver/gpio.h"
+#else
+// host build against the SX127x simulator, see test/lora_sim.c
+#include "lora_sim.h"
+#endif
 
 #include "lora.h"
 
 //#define LORA_DEBUG 1
+// access the FIFO one register read/write per byte (to compare transfer times)
+//#define LORA_FIFO_BYTEWISE 1
 
 // Registers
 #define REG_FIFO 0x00
@@ -67,8 +76,9 @@
 #define MODE_TX 0x03
 #define MODE_RX_CONTINUOUS 0x05
 #define MODE_RX_SINGLE 0x06
-// fake state for internal usage
-#define MODE_RX_READ_BUF 0x07
+#define MODE_CAD 0x07
+// fake state for internal usage, not a REG_OP_MODE value
+#define STATE_RX_READ_BUF 0x08
 
 #define RF_IMAGECAL_IMAGECAL_MASK 0xBF
 #define RF_IMAGECAL_IMAGECAL_START 0x40
@@ -92,6 +102,26 @@
 
 #define TIMEOUT_RESET 100
 
+#define SPI_CLOCK_HZ 9000000
+// transactions in flight for lora_write_regs()
+#define SPI_QUEUE_SIZE 8
+// registers per lora_write_regs() call, runs on the LoRa task stack
+#define WRITE_REGS_MAX 8
+
+// listen before talk: backoff window doubles per retry up to (1 << LBT_BACKOFF_SHIFT_MAX) * backoff
+#define LBT_BACKOFF_SHIFT_MAX 4
+// CAD done has to arrive within this
+#define CAD_TIMEOUT_MS 1000
+
+// register shadow
+#define SHADOW_REGS 0x80
+#define SHADOW_VALID 0x01
+#define SHADOW_DIRTY 0x02
+// lora_shadow_write() results
+#define SHADOW_WRITE 0
+#define SHADOW_SKIP 1
+#define SHADOW_DEFER 2
+
 struct lora_config_t
 {
   int gpio_cs;
@@ -105,9 +135,26 @@ struct lora_config_t
 };
 
 static spi_device_handle_t __spi;
+// the receive task and the application both talk to the modem
+static SemaphoreHandle_t __spi_lock;
+static struct lora_spi_stats_t __spi_stats;
+static struct lora_rx_stats_t __rx_stats;
+// last value written to / read from the configuration registers
+static uint8_t __shadow[SHADOW_REGS];
+static uint8_t __shadow_state[SHADOW_REGS];
+// task collecting register writes between lora_config_begin() and lora_config_commit()
+static TaskHandle_t __batch_owner;
 static int __implicit;
 static long __frequency;
 static int _modem_state;
+// listen before talk, see lora_set_lbt()
+static struct
+{
+  int enabled;
+  int retries;
+  int backoff_ms;
+} __lbt;
+static struct lora_lbt_stats_t __lbt_stats;
 // gpio config
 static struct lora_config_t config;
 
@@ -141,6 +188,80 @@ void lora_config_dio(const int gpio_dio0, const int gpio_dio1, const int gpio_di
   config.gpio_dio2 = gpio_dio2;
 }
 
+/**
+ * Configuration registers that only change when written.
+ * Status registers, the FIFO and the op mode are never cached.
+ * @param reg Register index.
+ * @return 1 if the register is shadowed
+ */
+static int lora_shadowed(const int reg)
+{
+  switch (reg)
+  {
+  case REG_FRF_MSB:
+  case REG_FRF_MID:
+  case REG_FRF_LSB:
+  case REG_PA_CONFIG:
+  case REG_PA_RAMP:
+  case REG_LNA:
+  case REG_FIFO_TX_BASE_ADDR:
+  case REG_FIFO_RX_BASE_ADDR:
+  case REG_MODEM_CONFIG_1:
+  case REG_MODEM_CONFIG_2:
+  case REG_RX_TIMEOUT:
+  case REG_PREAMBLE_MSB:
+  case REG_PREAMBLE_LSB:
+  case REG_PAYLOAD_LENGTH:
+  case REG_HOP_PERIOD:
+  case REG_MODEM_CONFIG_3:
+  case REG_DETECTION_OPTIMIZE:
+  case REG_INVERT_IQ_1:
+  case REG_HIGH_BW_OPTIMIZE_1:
+  case REG_DETECTION_THRESHOLD:
+  case REG_SYNC_WORD:
+  case REG_HIGH_BW_OPTIMIZE_2:
+  case REG_DIO_MAPPING_1:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Forget the shadow (after reset or leaving LoRa mode). Call with __spi_lock held.
+ */
+static void lora_shadow_invalidate(void)
+{
+  memset(__shadow_state, 0, sizeof(__shadow_state));
+}
+
+/**
+ * Record a register write in the shadow. Call with __spi_lock held.
+ * @param reg Register index.
+ * @param val Value to write.
+ * @return SHADOW_WRITE if the value has to go to the modem, SHADOW_SKIP if the modem already has it,
+ *         SHADOW_DEFER if it is written by lora_config_commit()
+ */
+static int lora_shadow_write(const int reg, const uint8_t val)
+{
+  if (!lora_shadowed(reg))
+  {
+    return SHADOW_WRITE;
+  }
+  int same = (__shadow_state[reg] & SHADOW_VALID) && __shadow[reg] == val;
+  __shadow[reg] = val;
+  __shadow_state[reg] |= SHADOW_VALID;
+  if (__batch_owner != NULL && __batch_owner == xTaskGetCurrentTaskHandle())
+  {
+    if (!same)
+    {
+      __shadow_state[reg] |= SHADOW_DIRTY;
+    }
+    return SHADOW_DEFER;
+  }
+  return same ? SHADOW_SKIP : SHADOW_WRITE;
+}
+
 /**
  * Write a value to a register.
  * @param reg Register index.
@@ -148,18 +269,25 @@ void lora_config_dio(const int gpio_dio0, const int gpio_dio1, const int gpio_di
  */
 void lora_write_reg(int reg, int val)
 {
-  uint8_t out[2] = {0x80 | reg, val};
-  uint8_t in[2];
-
   spi_transaction_t t = {
-      .flags = 0,
-      .length = 8 * sizeof(out),
-      .tx_buffer = out,
-      .rx_buffer = in};
-
-  gpio_set_level(config.gpio_cs, 0);
-  spi_device_transmit(__spi, &t);
-  gpio_set_level(config.gpio_cs, 1);
+      .flags = SPI_TRANS_USE_TXDATA,
+      .addr = 0x80 | reg,
+      .length = 8,
+      .tx_data = {val}};
+
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  int res = lora_shadow_write(reg, val);
+  if (res == SHADOW_WRITE)
+  {
+    spi_device_polling_transmit(__spi, &t);
+    __spi_stats.transactions++;
+  }
+  else if (res == SHADOW_SKIP)
+  {
+    // deferred writes are sent by lora_config_commit()
+    __spi_stats.writes_saved++;
+  }
+  xSemaphoreGive(__spi_lock);
 }
 
 /**
@@ -169,19 +297,282 @@ void lora_write_reg(int reg, int val)
  */
 int lora_read_reg(int reg)
 {
-  uint8_t out[2] = {reg, 0xff};
-  uint8_t in[2];
+  spi_transaction_t t = {
+      .flags = SPI_TRANS_USE_RXDATA,
+      .addr = reg,
+      .length = 8,
+      .rxlength = 8};
+
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  if (lora_shadowed(reg) && (__shadow_state[reg] & SHADOW_VALID))
+  {
+    __spi_stats.reads_saved++;
+    xSemaphoreGive(__spi_lock);
+    return __shadow[reg];
+  }
+  spi_device_polling_transmit(__spi, &t);
+  __spi_stats.transactions++;
+  if (lora_shadowed(reg))
+  {
+    __shadow[reg] = t.rx_data[0];
+    __shadow_state[reg] |= SHADOW_VALID;
+  }
+  xSemaphoreGive(__spi_lock);
+  return t.rx_data[0];
+}
+
+/**
+ * Queue register writes back to back without waiting for each one. Call with __spi_lock held.
+ * @param regs Registers and values.
+ * @param num Number of registers.
+ */
+static void lora_queue_regs(const struct lora_reg_t *regs, const int num)
+{
+  spi_transaction_t t[SPI_QUEUE_SIZE];
+  spi_transaction_t *done;
+
+  for (int i = 0; i < num; i++)
+  {
+    // results come back in order, the oldest slot is free again
+    if (i >= SPI_QUEUE_SIZE)
+    {
+      spi_device_get_trans_result(__spi, &done, portMAX_DELAY);
+    }
+    spi_transaction_t *c = &t[i % SPI_QUEUE_SIZE];
+    memset(c, 0, sizeof(spi_transaction_t));
+    c->flags = SPI_TRANS_USE_TXDATA;
+    c->addr = 0x80 | regs[i].reg;
+    c->length = 8;
+    c->tx_data[0] = regs[i].val;
+    spi_device_queue_trans(__spi, c, portMAX_DELAY);
+  }
+  for (int i = num < SPI_QUEUE_SIZE ? num : SPI_QUEUE_SIZE; i > 0; i--)
+  {
+    spi_device_get_trans_result(__spi, &done, portMAX_DELAY);
+  }
+  __spi_stats.transactions += num;
+}
 
+/**
+ * Write a list of registers, only the ones that changed are queued.
+ * @param regs Registers and values.
+ * @param num Number of registers (max WRITE_REGS_MAX).
+ */
+static void lora_write_regs(const struct lora_reg_t *regs, const int num)
+{
+  struct lora_reg_t w[WRITE_REGS_MAX];
+  assert(num <= WRITE_REGS_MAX);
+  int n = 0;
+
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  for (int i = 0; i < num; i++)
+  {
+    int res = lora_shadow_write(regs[i].reg, regs[i].val);
+    if (res == SHADOW_WRITE)
+    {
+      w[n++] = regs[i];
+    }
+    else if (res == SHADOW_SKIP)
+    {
+      __spi_stats.writes_saved++;
+    }
+  }
+  lora_queue_regs(w, n);
+  xSemaphoreGive(__spi_lock);
+}
+
+/**
+ * Burst access, call with __spi_lock held.
+ */
+static void lora_burst_locked(const int reg, const uint8_t *tx, uint8_t *rx, const int len)
+{
   spi_transaction_t t = {
       .flags = 0,
-      .length = 8 * sizeof(out),
-      .tx_buffer = out,
-      .rx_buffer = in};
+      .addr = reg,
+      .length = 8 * len,
+      .rxlength = rx != NULL ? 8 * len : 0,
+      .tx_buffer = tx,
+      .rx_buffer = rx};
+
+  spi_device_polling_transmit(__spi, &t);
+  __spi_stats.transactions++;
+}
+
+/**
+ * Burst access starting at a register, the address increments (except for REG_FIFO).
+ * @param reg Register index, 0x80 set for writing.
+ * @param tx Data to write or NULL.
+ * @param rx Buffer for data read or NULL.
+ * @param len Number of bytes.
+ */
+static void lora_burst(const int reg, const uint8_t *tx, uint8_t *rx, const int len)
+{
+  if (len <= 0)
+  {
+    return;
+  }
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  lora_burst_locked(reg, tx, rx, len);
+  xSemaphoreGive(__spi_lock);
+}
+
+/**
+ * Write consecutive configuration registers as one burst, skipped if none of them changed.
+ * @param reg First register index.
+ * @param val Values.
+ * @param len Number of registers.
+ */
+static void lora_write_burst(const int reg, const uint8_t *val, const int len)
+{
+  int write = 0;
+  int defer = 0;
+
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  for (int i = 0; i < len; i++)
+  {
+    int res = lora_shadow_write(reg + i, val[i]);
+    if (res == SHADOW_WRITE)
+    {
+      write = 1;
+    }
+    else if (res == SHADOW_DEFER)
+    {
+      defer = 1;
+    }
+  }
+  if (write)
+  {
+    lora_burst_locked(0x80 | reg, val, NULL, len);
+  }
+  else if (!defer)
+  {
+    __spi_stats.writes_saved++;
+  }
+  xSemaphoreGive(__spi_lock);
+}
 
-  gpio_set_level(config.gpio_cs, 0);
-  spi_device_transmit(__spi, &t);
-  gpio_set_level(config.gpio_cs, 1);
-  return in[1];
+/**
+ * Start collecting configuration changes from the calling task.
+ * Writes to configuration registers only update the shadow until lora_config_commit().
+ */
+void lora_config_begin(void)
+{
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  __batch_owner = xTaskGetCurrentTaskHandle();
+  xSemaphoreGive(__spi_lock);
+}
+
+/**
+ * Write all configuration registers changed since lora_config_begin() as one batch.
+ * @return number of registers written
+ */
+int lora_config_commit(void)
+{
+  struct lora_reg_t w[SHADOW_REGS];
+  int n = 0;
+
+  int written = 0;
+
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  __batch_owner = NULL;
+  // ascending order, the frequency is applied when FRF_LSB is written
+  for (int reg = 0; reg < SHADOW_REGS; reg++)
+  {
+    if ((__shadow_state[reg] & SHADOW_DIRTY) == 0)
+    {
+      continue;
+    }
+    int len = 1;
+    while (reg + len < SHADOW_REGS && (__shadow_state[reg + len] & SHADOW_DIRTY))
+    {
+      len++;
+    }
+    for (int i = 0; i < len; i++)
+    {
+      __shadow_state[reg + i] &= ~SHADOW_DIRTY;
+    }
+    // consecutive registers go out as one burst, single ones are queued
+    if (len > 1)
+    {
+      lora_burst_locked(0x80 | reg, &__shadow[reg], NULL, len);
+    }
+    else
+    {
+      w[n].reg = reg;
+      w[n].val = __shadow[reg];
+      n++;
+    }
+    written += len;
+    reg += len - 1;
+  }
+  lora_queue_regs(w, n);
+  xSemaphoreGive(__spi_lock);
+  return written;
+}
+
+static void lora_fifo_stats(const int64_t start)
+{
+  unsigned long int us = esp_timer_get_time() - start;
+  __spi_stats.fifo_transfers++;
+  __spi_stats.fifo_last_us = us;
+  if (us > __spi_stats.fifo_max_us)
+  {
+    __spi_stats.fifo_max_us = us;
+  }
+}
+
+/**
+ * Write to the FIFO at the current FIFO address.
+ * @param buf Data.
+ * @param len Number of bytes.
+ */
+static void lora_write_fifo(const uint8_t *buf, const int len)
+{
+  int64_t start = esp_timer_get_time();
+#ifdef LORA_FIFO_BYTEWISE
+  for (int i = 0; i < len; i++)
+    lora_write_reg(REG_FIFO, buf[i]);
+#else
+  lora_burst(0x80 | REG_FIFO, buf, NULL, len);
+#endif
+  lora_fifo_stats(start);
+}
+
+/**
+ * Read from the FIFO at the current FIFO address.
+ * @param buf Buffer.
+ * @param len Number of bytes.
+ */
+static void lora_read_fifo(uint8_t *buf, const int len)
+{
+  int64_t start = esp_timer_get_time();
+#ifdef LORA_FIFO_BYTEWISE
+  for (int i = 0; i < len; i++)
+    buf[i] = lora_read_reg(REG_FIFO);
+#else
+  lora_burst(REG_FIFO, NULL, buf, len);
+#endif
+  lora_fifo_stats(start);
+}
+
+/**
+ * Get SPI statistics.
+ * @param stats Statistics.
+ */
+void lora_get_spi_stats(struct lora_spi_stats_t *stats)
+{
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  memcpy(stats, &__spi_stats, sizeof(struct lora_spi_stats_t));
+  xSemaphoreGive(__spi_lock);
+}
+
+/**
+ * Get receive statistics.
+ * @param stats Statistics.
+ */
+void lora_get_rx_stats(struct lora_rx_stats_t *stats)
+{
+  memcpy(stats, &__rx_stats, sizeof(struct lora_rx_stats_t));
 }
 
 /**
@@ -189,6 +580,9 @@ int lora_read_reg(int reg)
  */
 void lora_reset(void)
 {
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  lora_shadow_invalidate();
+  xSemaphoreGive(__spi_lock);
   gpio_set_level(config.gpio_rst, 0);
   vTaskDelay(pdMS_TO_TICKS(1));
   gpio_set_level(config.gpio_rst, 1);
@@ -280,6 +674,24 @@ static unsigned int freq_regs(const double freq)
   return ff + add;
 }
 
+/**
+ * Precompute the frequency registers, e.g. for lora_fhss_handle_frf().
+ * @param freqs Frequencies in Mhz.
+ * @param table Register values, num entries.
+ * @param num Number of frequencies.
+ */
+void lora_frf_table(const double *freqs, struct lora_frf_t *table, const int num)
+{
+  for (int i = 0; i < num; i++)
+  {
+    unsigned long frf = freq_regs(freqs[i]);
+    table[i].reg[0] = frf >> 16;
+    table[i].reg[1] = frf >> 8;
+    table[i].reg[2] = frf >> 0;
+    table[i].frequency = freqs[i];
+  }
+}
+
 /**
  * Set carrier frequency.
  * @param frequency Frequency in Mhz (e.g. 902.3)
@@ -291,9 +703,9 @@ void lora_set_frequency(const double frequency)
   unsigned long frf = freq_regs(frequency);
   //printf("0x%.2x 0x%.2x 0x%.2x\n", (uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)(frf >> 0));
 
-  lora_write_reg(REG_FRF_MSB, (uint8_t)(frf >> 16));
-  lora_write_reg(REG_FRF_MID, (uint8_t)(frf >> 8));
-  lora_write_reg(REG_FRF_LSB, (uint8_t)(frf >> 0));
+  // MSB, MID, LSB are consecutive registers
+  uint8_t regs[3] = {(uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)(frf >> 0)};
+  lora_write_burst(REG_FRF_MSB, regs, sizeof(regs));
 }
 
 /**
@@ -307,18 +719,12 @@ void lora_set_spreading_factor(int sf)
   else if (sf > 12)
     sf = 12;
 
-  if (sf == 6)
-  {
-    lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc5);
-    lora_write_reg(REG_DETECTION_THRESHOLD, 0x0c);
-  }
-  else
-  {
-    lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc3);
-    lora_write_reg(REG_DETECTION_THRESHOLD, 0x0a);
-  }
-
-  lora_write_reg(REG_MODEM_CONFIG_2, (lora_read_reg(REG_MODEM_CONFIG_2) & 0x0f) | ((sf << 4) & 0xf0));
+  struct lora_reg_t regs[3] = {
+      {REG_DETECTION_OPTIMIZE, sf == 6 ? 0xc5 : 0xc3},
+      {REG_DETECTION_THRESHOLD, sf == 6 ? 0x0c : 0x0a},
+      {REG_MODEM_CONFIG_2, (lora_read_reg(REG_MODEM_CONFIG_2) & 0x0f) | ((sf << 4) & 0xf0)},
+  };
+  lora_write_regs(regs, 3);
 }
 
 /**
@@ -386,8 +792,8 @@ void lora_set_coding_rate(int denominator)
  */
 void lora_set_preamble_length(const long length)
 {
-  lora_write_reg(REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
-  lora_write_reg(REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
+  uint8_t regs[2] = {(uint8_t)(length >> 8), (uint8_t)(length >> 0)};
+  lora_write_burst(REG_PREAMBLE_MSB, regs, sizeof(regs));
 }
 
 /**
@@ -429,6 +835,11 @@ void lora_calibrate(void)
   lora_write_reg(REG_INVERT_IQ_2, (lora_read_reg(REG_INVERT_IQ_2) & RF_IMAGECAL_IMAGECAL_MASK) | RF_IMAGECAL_IMAGECAL_START);
   while ((lora_read_reg(REG_INVERT_IQ_2) & RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING)
     ;
+
+  // the registers above were accessed in FSK mode
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  lora_shadow_invalidate();
+  xSemaphoreGive(__spi_lock);
 }
 
 /**
@@ -462,25 +873,30 @@ int lora_init(void)
   // Configure CPU hardware to communicate with the radio chip
   gpio_pad_select_gpio(config.gpio_rst);
   gpio_set_direction(config.gpio_rst, GPIO_MODE_OUTPUT);
-  gpio_pad_select_gpio(config.gpio_cs);
-  gpio_set_direction(config.gpio_cs, GPIO_MODE_OUTPUT);
 
+  __spi_lock = xSemaphoreCreateMutex();
+  memset(&__spi_stats, 0, sizeof(__spi_stats));
+  memset(&__rx_stats, 0, sizeof(__rx_stats));
+
+  // DMA for FIFO bursts longer than 64 bytes
   spi_bus_config_t bus = {
       .miso_io_num = config.gpio_miso,
       .mosi_io_num = config.gpio_mosi,
       .sclk_io_num = config.gpio_sck,
       .quadwp_io_num = -1,
       .quadhd_io_num = -1,
-      .max_transfer_sz = 0};
+      .max_transfer_sz = LORA_MSG_MAX_SIZE + 1};
 
-  ret = spi_bus_initialize(VSPI_HOST, &bus, 0);
+  ret = spi_bus_initialize(VSPI_HOST, &bus, 2);
   assert(ret == ESP_OK);
 
+  // CS is driven by the SPI hardware, the register address is the address phase
   spi_device_interface_config_t dev = {
-      .clock_speed_hz = 9000000,
+      .clock_speed_hz = SPI_CLOCK_HZ,
       .mode = 0,
-      .spics_io_num = -1,
-      .queue_size = 1,
+      .address_bits = 8,
+      .spics_io_num = config.gpio_cs,
+      .queue_size = SPI_QUEUE_SIZE,
       .flags = 0,
       .pre_cb = NULL};
   ret = spi_bus_add_device(VSPI_HOST, &dev, &__spi);
@@ -513,41 +929,291 @@ int lora_init(void)
 
   // Default configuration.
   lora_sleep();
-  lora_write_reg(REG_FIFO_RX_BASE_ADDR, 0);
-  lora_write_reg(REG_FIFO_TX_BASE_ADDR, 0);
-  // set LNA boost
-  lora_write_reg(REG_LNA, lora_read_reg(REG_LNA) | 0x03);
-  // AGC auto
-  lora_write_reg(REG_MODEM_CONFIG_3, 0x04);
-  lora_set_tx_power(2);
+
+  // fill the shadow with one burst (REG_FRF_MSB to REG_DIO_MAPPING_1)
+  uint8_t cfg[REG_DIO_MAPPING_1 - REG_FRF_MSB + 1];
+  lora_burst(REG_FRF_MSB, NULL, cfg, sizeof(cfg));
+  xSemaphoreTake(__spi_lock, portMAX_DELAY);
+  for (int reg = REG_FRF_MSB; reg <= REG_DIO_MAPPING_1; reg++)
+  {
+    if (lora_shadowed(reg))
+    {
+      __shadow[reg] = cfg[reg - REG_FRF_MSB];
+      __shadow_state[reg] = SHADOW_VALID;
+    }
+  }
+  xSemaphoreGive(__spi_lock);
+
+  struct lora_reg_t regs[5] = {
+      {REG_FIFO_RX_BASE_ADDR, 0},
+      {REG_FIFO_TX_BASE_ADDR, 0},
+      // set LNA boost
+      {REG_LNA, lora_read_reg(REG_LNA) | 0x03},
+      // AGC auto
+      {REG_MODEM_CONFIG_3, 0x04},
+      // tx power 2
+      {REG_PA_CONFIG, PA_BOOST},
+  };
+  lora_write_regs(regs, 5);
 
   return version == 0x12;
 }
 
 /**
- * Send a packet.
+ * Start sending a packet and return, DIO0 signals TX done.
+ * Call lora_send_packet_done() when DIO0 fires.
  * @param buf Data to be sent
  * @param size Size of data.
  */
-void lora_send_packet(uint8_t *buf, const int size)
+void lora_send_packet_start(const uint8_t *buf, const int size)
 {
   // Transfer data to radio.
   lora_idle();
   _modem_state = MODE_TX;
   lora_write_reg(REG_FIFO_ADDR_PTR, 0);
+  lora_write_fifo(buf, size);
+
+  // DIO0 = TxDone, start transmission
+  struct lora_reg_t regs[3] = {
+      {REG_DIO_MAPPING_1, (lora_read_reg(REG_DIO_MAPPING_1) & 0x3f) | 0x40},
+      {REG_PAYLOAD_LENGTH, size},
+      {REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX},
+  };
+  lora_write_regs(regs, 3);
+}
 
-  for (int i = 0; i < size; i++)
-    lora_write_reg(REG_FIFO, *buf++);
+/**
+ * Check if the packet started with lora_send_packet_start() was sent.
+ * Clears TX done and maps DIO0 back to RxDone.
+ * @return 1 if the packet was sent
+ */
+int lora_send_packet_done(void)
+{
+  if ((lora_read_reg(REG_IRQ_FLAGS) & IRQ_TX_DONE_MASK) == 0)
+  {
+    return 0;
+  }
+  struct lora_reg_t regs[2] = {
+      {REG_IRQ_FLAGS, IRQ_TX_DONE_MASK},
+      {REG_DIO_MAPPING_1, lora_read_reg(REG_DIO_MAPPING_1) & 0x3f},
+  };
+  lora_write_regs(regs, 2);
+  _modem_state = MODE_STDBY;
+  return 1;
+}
 
-  lora_write_reg(REG_PAYLOAD_LENGTH, size);
+/**
+ * Stop a packet started with lora_send_packet_start() (e.g. TX done did not arrive in time).
+ * The modem goes to standby, TX done is cleared and DIO0 is mapped back to RxDone.
+ */
+void lora_send_packet_abort(void)
+{
+  lora_idle();
+  struct lora_reg_t regs[2] = {
+      {REG_IRQ_FLAGS, IRQ_TX_DONE_MASK},
+      {REG_DIO_MAPPING_1, lora_read_reg(REG_DIO_MAPPING_1) & 0x3f},
+  };
+  lora_write_regs(regs, 2);
+}
 
-  // Start transmission and wait for conclusion.
-  lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
-  while ((lora_read_reg(REG_IRQ_FLAGS) & IRQ_TX_DONE_MASK) == 0)
+/**
+ * Send a packet and wait until it was sent.
+ * @param buf Data to be sent
+ * @param size Size of data.
+ */
+void lora_send_packet(uint8_t *buf, const int size)
+{
+  lora_send_packet_start(buf, size);
+  while (!lora_send_packet_done())
     vTaskDelay(2);
+}
 
-  lora_write_reg(REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+/**
+ * Time on air of a packet with the current modem settings (see SX1276 datasheet 4.1.1.7).
+ * @param size Payload size in bytes.
+ * @return time on air in microseconds
+ */
+unsigned long lora_time_on_air_us(const int size)
+{
+  static const unsigned long bw_hz[10] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+  int cfg1 = lora_read_reg(REG_MODEM_CONFIG_1);
+  int cfg2 = lora_read_reg(REG_MODEM_CONFIG_2);
+  int cfg3 = lora_read_reg(REG_MODEM_CONFIG_3);
+  int preamble = (lora_read_reg(REG_PREAMBLE_MSB) << 8) | lora_read_reg(REG_PREAMBLE_LSB);
+
+  int bw = (cfg1 >> 4) > 9 ? 9 : (cfg1 >> 4);
+  int cr = (cfg1 >> 1) & 0x07;
+  int ih = cfg1 & 0x01;
+  int sf = cfg2 >> 4;
+  int crc = (cfg2 >> 2) & 0x01;
+  int de = (cfg3 >> 3) & 0x01;
+
+  double tsym = (double)(1 << sf) / bw_hz[bw];
+  double tpreamble = (preamble + 4.25) * tsym;
+  int num = 8 * size - 4 * sf + 28 + 16 * crc - 20 * ih;
+  int den = 4 * (sf - 2 * de);
+  int symbols = 8;
+  if (num > 0)
+  {
+    symbols += ((num + den - 1) / den) * (cr + 4);
+  }
+  return (tpreamble + symbols * tsym) * 1e6 + 0.5;
+}
+
+/**
+ * Configure listen before talk (see lora_send_packet_lbt()).
+ * @param enable Run channel activity detection before sending.
+ * @param retries Retries after the channel was found busy.
+ * @param backoff_ms Backoff before the first retry, the random window doubles with each retry.
+ */
+void lora_set_lbt(const int enable, const int retries, const int backoff_ms)
+{
+  __lbt.enabled = enable;
+  __lbt.retries = retries;
+  __lbt.backoff_ms = backoff_ms > 0 ? backoff_ms : 1;
+}
+
+/**
+ * @return 1 if listen before talk is enabled
+ */
+int lora_lbt_enabled(void)
+{
+  return __lbt.enabled;
+}
+
+/**
+ * Get listen before talk statistics.
+ * @param stats Statistics.
+ */
+void lora_get_lbt_stats(struct lora_lbt_stats_t *stats)
+{
+  memcpy(stats, &__lbt_stats, sizeof(struct lora_lbt_stats_t));
+}
+
+/**
+ * Start channel activity detection and return, DIO0 signals CAD done.
+ * Call lora_cad_done() when DIO0 fires.
+ */
+void lora_cad_start(void)
+{
+  lora_idle();
+  _modem_state = MODE_CAD;
+  // DIO0 = CadDone
+  struct lora_reg_t regs[3] = {
+      {REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECT_MASK},
+      {REG_DIO_MAPPING_1, (lora_read_reg(REG_DIO_MAPPING_1) & 0x3f) | 0x80},
+      {REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD},
+  };
+  lora_write_regs(regs, 3);
+}
+
+/**
+ * Check the result of lora_cad_start(). The modem is in standby after CAD.
+ * Clears the CAD flags and maps DIO0 back to RxDone.
+ * @return LORA_CAD_FREE, LORA_CAD_BUSY or LORA_CAD_PENDING if CAD is not done
+ */
+int lora_cad_done(void)
+{
+  int irq = lora_read_reg(REG_IRQ_FLAGS);
+  if ((irq & IRQ_CAD_DONE_MASK) == 0)
+  {
+    return LORA_CAD_PENDING;
+  }
+  struct lora_reg_t regs[2] = {
+      {REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECT_MASK},
+      {REG_DIO_MAPPING_1, lora_read_reg(REG_DIO_MAPPING_1) & 0x3f},
+  };
+  lora_write_regs(regs, 2);
   _modem_state = MODE_STDBY;
+  __lbt_stats.cad_runs++;
+  if (irq & IRQ_CAD_DETECT_MASK)
+  {
+    __lbt_stats.busy++;
+#ifdef LORA_DEBUG
+    printf("%s: channel busy\n", __func__);
+#endif
+    return LORA_CAD_BUSY;
+  }
+  return LORA_CAD_FREE;
+}
+
+/**
+ * Stop a CAD started with lora_cad_start() (e.g. CAD done did not arrive in time).
+ * The modem goes to standby, the CAD flags are cleared and DIO0 is mapped back to RxDone.
+ */
+void lora_cad_abort(void)
+{
+  lora_idle();
+  struct lora_reg_t regs[2] = {
+      {REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECT_MASK},
+      {REG_DIO_MAPPING_1, lora_read_reg(REG_DIO_MAPPING_1) & 0x3f},
+  };
+  lora_write_regs(regs, 2);
+}
+
+/**
+ * Run channel activity detection and wait for the result.
+ * @return LORA_CAD_FREE or LORA_CAD_BUSY (also if CAD did not finish in time)
+ */
+int lora_cad(void)
+{
+  int64_t start = esp_timer_get_time();
+  lora_cad_start();
+  for (;;)
+  {
+    int res = lora_cad_done();
+    if (res != LORA_CAD_PENDING)
+    {
+      return res;
+    }
+    if (esp_timer_get_time() - start > CAD_TIMEOUT_MS * 1000)
+    {
+      lora_cad_abort();
+      return LORA_CAD_BUSY;
+    }
+    vTaskDelay(1);
+  }
+}
+
+/**
+ * Random backoff after the channel was found busy (binary exponential backoff).
+ * @param attempt Retry number starting at 1.
+ * @return backoff in milliseconds or -1 if the retries are used up
+ */
+int lora_lbt_backoff_ms(const int attempt)
+{
+  if (attempt > __lbt.retries)
+  {
+    __lbt_stats.dropped++;
+    return -1;
+  }
+  __lbt_stats.retries++;
+  int shift = attempt - 1 < LBT_BACKOFF_SHIFT_MAX ? attempt - 1 : LBT_BACKOFF_SHIFT_MAX;
+  unsigned int window = (unsigned int)__lbt.backoff_ms << shift;
+  return 1 + esp_random() % window;
+}
+
+/**
+ * Send a packet after the channel was found free and wait until it was sent.
+ * Without listen before talk enabled this is lora_send_packet().
+ * @param buf Data to be sent
+ * @param size Size of data.
+ * @return 1 if sent, 0 if the channel stayed busy
+ */
+int lora_send_packet_lbt(uint8_t *buf, const int size)
+{
+  int attempt = 0;
+  while (__lbt.enabled && lora_cad() == LORA_CAD_BUSY)
+  {
+    int backoff = lora_lbt_backoff_ms(++attempt);
+    if (backoff < 0)
+    {
+      return 0;
+    }
+    vTaskDelay(pdMS_TO_TICKS(backoff) > 0 ? pdMS_TO_TICKS(backoff) : 1);
+  }
+  lora_send_packet(buf, size);
+  return 1;
 }
 
 /**
@@ -557,7 +1223,7 @@ void lora_send_packet(uint8_t *buf, const int size)
  */
 void lora_send_packet_irq(uint8_t *buf, const int size)
 {
-  while (_modem_state == MODE_RX_READ_BUF)
+  while (_modem_state == STATE_RX_READ_BUF)
   {
 #ifdef LORA_DEBUG
     printf("%s modem state == RX_READ_BUF\n", __func__);
@@ -593,6 +1259,7 @@ int lora_fhss_handle(const double *fhtable, const int fhtable_size)
 {
   int irq = lora_read_reg(REG_IRQ_FLAGS);
 
+  // CAD done / detected are handled by lora_cad_done()
 #if 0
   if ((irq & IRQ_RX_TIMEOUT) != 0) {
 #ifdef LORA_DEBUG
@@ -606,24 +1273,12 @@ int lora_fhss_handle(const double *fhtable, const int fhtable_size)
 #endif
     lora_write_reg(REG_IRQ_FLAGS, IRQ_VALID_HDR_MASK);
   }
-  if ((irq & IRQ_CAD_DETECT_MASK) != 0) {
-#ifdef LORA_DEBUG
-    printf("CAD detect\n");
-#endif
-    lora_write_reg(REG_IRQ_FLAGS, IRQ_CAD_DETECT_MASK);
-  }
   if ((irq & IRQ_PAYLOAD_CRC_ERROR_MASK) != 0) {
 #ifdef LORA_DEBUG
     printf("CRC ERROR\n");
 #endif
     lora_write_reg(REG_IRQ_FLAGS, IRQ_PAYLOAD_CRC_ERROR_MASK);
   }
-  if ((irq & IRQ_CAD_DONE_MASK) != 0) {
-#ifdef LORA_DEBUG
-    printf("CAD done\n");
-#endif
-    lora_write_reg(REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK);
-  }
 #endif
 
   // not change channel
@@ -648,6 +1303,34 @@ int lora_fhss_handle(const double *fhtable, const int fhtable_size)
   return 1;
 }
 
+/**
+ * Handle hopping with precomputed frequency registers (see lora_frf_table()).
+ * No floating point math on the hop path, the FRF registers are written in one burst.
+ * @param table FRF table
+ * @param num number of entries in the table
+ * @return 1 if channel change irq was handled and 0 for anything else
+ */
+int lora_fhss_handle_frf(const struct lora_frf_t *table, const int num)
+{
+  int irq = lora_read_reg(REG_IRQ_FLAGS);
+  if ((irq & IRQ_FHSS_CHANGE_CHANNEL) == 0 || num <= 0)
+  {
+    return 0;
+  }
+
+  int hop = (lora_read_reg(REG_HOP_CHANNEL) & 0x3F) % num;
+  __frequency = table[hop].frequency;
+  lora_write_burst(REG_FRF_MSB, table[hop].reg, 3);
+
+  // ONLY clear channel change IRQ
+  lora_write_reg(REG_IRQ_FLAGS, IRQ_FHSS_CHANGE_CHANNEL);
+
+#ifdef LORA_DEBUG
+  printf("%s: hop %d\n", __func__, hop);
+#endif
+  return 1;
+}
+
 /**
  * Read a received packet.
  * @param buf Buffer for the data.
@@ -664,9 +1347,19 @@ int lora_receive_packet(uint8_t *buf, const int size)
   if ((irq & IRQ_RX_DONE_MASK) == 0)
     return 0;
   if (irq & IRQ_PAYLOAD_CRC_ERROR_MASK)
+  {
+    __rx_stats.crc_errors++;
     return 0;
+  }
+  // explicit header mode: RX done without a valid header
+  if (!__implicit && (irq & IRQ_VALID_HDR_MASK) == 0)
+  {
+    __rx_stats.header_errors++;
+    return 0;
+  }
+  __rx_stats.packets++;
 
-  _modem_state = MODE_RX_READ_BUF;
+  _modem_state = STATE_RX_READ_BUF;
 
   // Find packet size.
   if (__implicit)
@@ -676,12 +1369,11 @@ int lora_receive_packet(uint8_t *buf, const int size)
 
   // Transfer data from radio.
   lora_idle();
-  _modem_state = MODE_RX_READ_BUF;
+  _modem_state = STATE_RX_READ_BUF;
   lora_write_reg(REG_FIFO_ADDR_PTR, lora_read_reg(REG_FIFO_RX_CURRENT_ADDR));
   if (len > size)
     len = size;
-  for (int i = 0; i < len; i++)
-    *buf++ = lora_read_reg(REG_FIFO);
+  lora_read_fifo(buf, len);
 
   _modem_state = MODE_STDBY;
   return len;
@@ -789,7 +1481,7 @@ int lora_received(void)
  */
 int lora_packet_rssi(void)
 {
-  return (lora_read_reg(REG_PKT_RSSI_VALUE) - (__frequency < 868E6 ? 164 : 157));
+  return (lora_read_reg(REG_PKT_RSSI_VALUE) - (__frequency < 868 ? 164 : 157));
 }
 
 void lora_set_gain(uint8_t gain)
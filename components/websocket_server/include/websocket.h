@@ -22,6 +22,10 @@ typedef void websocket_server_conninfo_callback(int);
 
 typedef int (*_log_printf_func_t)(const char *, ...);
 
+// allocator for frame payloads handed to the callback
+typedef void *websocket_server_payload_alloc(const size_t);
+typedef void websocket_server_payload_free(void *);
+
 typedef struct
 {
     uint16_t port;
@@ -30,6 +34,10 @@ typedef struct
     void *callback_data;
     websocket_server_conninfo_callback *conninfo_callback;
 
+    // NULL = malloc/free
+    websocket_server_payload_alloc *payload_alloc;
+    websocket_server_payload_free *payload_free;
+
     unsigned long server_timeout;
     unsigned long client_timeout;
 
@@ -42,6 +50,8 @@ typedef struct
  * ws_server_cfg->callback = my_callback;
  * ws_server_cfg->callback_data = NULL; // set callback data
  * ws_server_cfg->conninfo_callback = NULL;
+ * ws_server_cfg->payload_alloc = NULL; // use malloc
+ * ws_server_cfg->payload_free = NULL; // use free
  * websocket_start(ws_server_cfg);
  */
 
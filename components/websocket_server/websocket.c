@@ -237,7 +237,7 @@ static int websocket_serve(struct netconn *conn, websocket_server_config_t *cfg)
         cfg->log_printf("%s: payload len: %d\n", __func__, payload_len);
 #endif
 
-        char *payload = malloc(payload_len + 1);
+        char *payload = cfg->payload_alloc(payload_len + 1);
         if (payload == NULL)
         {
 #ifdef WS_DEBUG
@@ -267,7 +267,7 @@ static int websocket_serve(struct netconn *conn, websocket_server_config_t *cfg)
 #ifdef WS_DEBUG
             cfg->log_printf("%s: payload AND opcode bad = %d\n", __func__, hdr32->opcode);
 #endif
-            free(payload);
+            cfg->payload_free(payload);
             // I guess we only support TXT
             break;
         }
@@ -280,7 +280,7 @@ static int websocket_serve(struct netconn *conn, websocket_server_config_t *cfg)
         // free payload if callback didn't free it
         if (frame.payload != NULL)
         {
-            free(frame.payload);
+            cfg->payload_free(frame.payload);
         }
         if (status != ERR_OK)
         {
@@ -436,6 +436,11 @@ int websocket_start(websocket_server_config_t *ws_server_cfg)
     {
         ws_server_cfg->log_printf = printf;
     }
+    if (ws_server_cfg->payload_alloc == NULL || ws_server_cfg->payload_free == NULL)
+    {
+        ws_server_cfg->payload_alloc = malloc;
+        ws_server_cfg->payload_free = free;
+    }
 
     websocket_server_running = 1;
     return xTaskCreate(&websocket_server_task, "websocket_server", 2048, ws_server_cfg, 5, NULL);
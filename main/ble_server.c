@@ -383,7 +383,7 @@ static int send_function(unsigned char *buf, const size_t len, void *data)
 int ble_server_send(const uint8_t *buf, const size_t len)
 {
    if (!flux_is_connected) {
-      return 0;
+      return -1;
    }
 
    struct record_t r;
@@ -0,0 +1,155 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "coalesce.h"
+
+int coalesce_init(coalesce_t *c, const size_t size)
+{
+    c->buf = malloc(size);
+    c->size = c->buf != NULL ? size : 0;
+    coalesce_reset(c);
+    return c->buf != NULL;
+}
+
+void coalesce_free(coalesce_t *c)
+{
+    free(c->buf);
+    c->buf = NULL;
+    c->size = 0;
+    coalesce_reset(c);
+}
+
+void coalesce_reset(coalesce_t *c)
+{
+    c->len = 0;
+    c->num = 0;
+}
+
+int coalesce_add(coalesce_t *c, const uint8_t *msg, const size_t len)
+{
+    char hdr[16];
+    int hdr_len = snprintf(hdr, sizeof(hdr), "%u:", (unsigned int)len);
+    size_t need = hdr_len + len + (c->len == 0 ? 1 : 0);
+    if (c->len + need > c->size)
+    {
+        return 0;
+    }
+    if (c->len == 0)
+    {
+        c->buf[c->len++] = COALESCE_MARKER;
+    }
+    memcpy(c->buf + c->len, hdr, hdr_len);
+    c->len += hdr_len;
+    memcpy(c->buf + c->len, msg, len);
+    c->len += len;
+    c->num++;
+    return 1;
+}
+
+int coalesce_next(const uint8_t *frame, const size_t len, size_t *pos, const uint8_t **msg, size_t *msg_len)
+{
+    if (*pos == 0)
+    {
+        if (len == 0 || frame[0] != COALESCE_MARKER)
+        {
+            return -1;
+        }
+        *pos = 1;
+    }
+    if (*pos >= len)
+    {
+        return 0;
+    }
+    size_t l = 0;
+    size_t p = *pos;
+    while (p < len && frame[p] >= '0' && frame[p] <= '9')
+    {
+        l = l * 10 + (frame[p] - '0');
+        p++;
+    }
+    if (p == *pos || p >= len || frame[p] != ':' || l > len - p - 1)
+    {
+        return -1;
+    }
+    p++;
+    *msg = frame + p;
+    *msg_len = l;
+    *pos = p + l;
+    return 1;
+}
+
+#ifdef COALESCE_TEST
+
+#include <assert.h>
+
+static int unpack(const uint8_t *frame, const size_t len, const char **expect, const int num)
+{
+    size_t pos = 0;
+    const uint8_t *msg;
+    size_t msg_len;
+    int i = 0;
+    int res;
+    while ((res = coalesce_next(frame, len, &pos, &msg, &msg_len)) == 1)
+    {
+        assert(i < num);
+        assert(msg_len == strlen(expect[i]));
+        assert(memcmp(msg, expect[i], msg_len) == 0);
+        i++;
+    }
+    assert(res == 0);
+    return i;
+}
+
+int main()
+{
+    coalesce_t c;
+    assert(coalesce_init(&c, 64));
+
+    const char *msgs[] = {"{\"cmd\":\"log\"}", "", "12:34", "\xc3\xa4\xc3\xb6"};
+    for (int i = 0; i < 4; i++)
+    {
+        assert(coalesce_add(&c, (const uint8_t *)msgs[i], strlen(msgs[i])));
+    }
+    assert(c.num == 4);
+    assert(c.buf[0] == COALESCE_MARKER);
+    assert(memcmp(c.buf + 1, "13:{", 4) == 0);
+    assert(unpack(c.buf, c.len, msgs, 4) == 4);
+    printf("%zu bytes for 4 messages\n", c.len);
+
+    // cap
+    coalesce_reset(&c);
+    char big[64];
+    memset(big, 'x', sizeof(big));
+    assert(!coalesce_add(&c, (const uint8_t *)big, sizeof(big)));
+    assert(c.len == 0);
+    // marker + "59:" + 59 bytes = 63, then the next one does not fit
+    assert(coalesce_add(&c, (const uint8_t *)big, 59));
+    assert(c.len == 63);
+    assert(!coalesce_add(&c, (const uint8_t *)"", 0));
+    assert(c.num == 1);
+
+    // broken frames
+    size_t pos = 0;
+    const uint8_t *msg;
+    size_t msg_len;
+    assert(coalesce_next((const uint8_t *)"plain", 5, &pos, &msg, &msg_len) == -1);
+    pos = 0;
+    assert(coalesce_next((const uint8_t *)"\x1e" "5:abc", 6, &pos, &msg, &msg_len) == -1);
+    pos = 0;
+    assert(coalesce_next((const uint8_t *)"\x1e" "x:", 3, &pos, &msg, &msg_len) == -1);
+    pos = 0;
+    assert(coalesce_next((const uint8_t *)"\x1e" "3", 2, &pos, &msg, &msg_len) == -1);
+    pos = 0;
+    assert(coalesce_next((const uint8_t *)"\x1e", 1, &pos, &msg, &msg_len) == 0);
+
+    coalesce_free(&c);
+    assert(!coalesce_add(&c, (const uint8_t *)"a", 1));
+    return 0;
+}
+#endif
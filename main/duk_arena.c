@@ -0,0 +1,530 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "duk_arena.h"
+
+//#define DUK_ARENA_DEBUG 1
+
+struct duk_arena_block_t
+{
+    // block size including the header
+    uint32_t size;
+    // size class or one of the markers below
+    uint32_t cls;
+    // only used while the block is free, overlaps the payload
+    struct duk_arena_block_t *next;
+};
+
+#define ARENA_HDR 8
+#define ARENA_ALIGN(x) (((x) + 7) & ~7)
+#define ARENA_LARGE 0xff
+#define ARENA_FALLBACK 0xfe
+// a split off rest has to be a valid large block
+#define ARENA_LARGE_MIN (ARENA_HDR + DUK_ARENA_SMALL_MAX + 8)
+
+#define BLOCK(ptr) ((struct duk_arena_block_t *)((uint8_t *)(ptr)-ARENA_HDR))
+#define PAYLOAD(b) ((void *)((uint8_t *)(b) + ARENA_HDR))
+#define BLOCK_END(b) ((uint8_t *)(b) + (b)->size)
+
+// payload sizes, Duktape allocates mostly strings and objects below 128 bytes
+static const unsigned int class_size[DUK_ARENA_CLASS_NUM] = {16, 24, 32, 48, 64, 96, 128, DUK_ARENA_SMALL_MAX};
+// size class by payload size in 8 byte steps
+static uint8_t class_map[DUK_ARENA_SMALL_MAX / 8 + 1];
+
+void duk_arena_init(duk_arena_t *a, void *mem, const size_t size)
+{
+    int c = 0;
+    for (int i = 0; i <= DUK_ARENA_SMALL_MAX / 8; i++)
+    {
+        while (i * 8 > class_size[c])
+        {
+            c++;
+        }
+        class_map[i] = c;
+    }
+
+    memset(a, 0, sizeof(duk_arena_t));
+    // blocks are 8 byte aligned
+    uintptr_t off = ARENA_ALIGN((uintptr_t)mem) - (uintptr_t)mem;
+    a->mem = (uint8_t *)mem + off;
+    a->size = (size - off) & ~7;
+}
+
+void duk_arena_reset(duk_arena_t *a)
+{
+    a->top = 0;
+    memset(a->free_small, 0, sizeof(a->free_small));
+    a->free_large = NULL;
+    a->live = 0;
+    memset(a->class_live, 0, sizeof(a->class_live));
+    a->large_live = 0;
+}
+
+static inline int is_arena(duk_arena_t *a, void *ptr)
+{
+    return (uint8_t *)ptr >= a->mem && (uint8_t *)ptr < a->mem + a->size;
+}
+
+static struct duk_arena_block_t *arena_bump(duk_arena_t *a, const size_t size)
+{
+    if (a->size - a->top < size)
+    {
+        return NULL;
+    }
+    struct duk_arena_block_t *b = (struct duk_arena_block_t *)(a->mem + a->top);
+    a->top += size;
+    b->size = size;
+    return b;
+}
+
+static struct duk_arena_block_t *arena_alloc_large(duk_arena_t *a, const size_t size)
+{
+    // first fit
+    struct duk_arena_block_t **prev = &a->free_large;
+    for (struct duk_arena_block_t *b = a->free_large; b != NULL; prev = &b->next, b = b->next)
+    {
+        if (b->size < size)
+        {
+            continue;
+        }
+        if (b->size - size >= ARENA_LARGE_MIN)
+        {
+            // keep the front in the list so the order does not change
+            b->size -= size;
+            struct duk_arena_block_t *r = (struct duk_arena_block_t *)BLOCK_END(b);
+            r->size = size;
+            return r;
+        }
+        *prev = b->next;
+        return b;
+    }
+    return arena_bump(a, size);
+}
+
+// insert into the address ordered list and merge with the neighbors
+static void arena_free_large(duk_arena_t *a, struct duk_arena_block_t *b)
+{
+    if (BLOCK_END(b) == a->mem + a->top)
+    {
+        a->top = (uint8_t *)b - a->mem;
+        // a free block right below joins the unused space too
+        struct duk_arena_block_t **prev = &a->free_large;
+        while (*prev != NULL && (*prev)->next != NULL)
+        {
+            prev = &(*prev)->next;
+        }
+        if (*prev != NULL && BLOCK_END(*prev) == a->mem + a->top)
+        {
+            a->top = (uint8_t *)(*prev) - a->mem;
+            *prev = NULL;
+        }
+        return;
+    }
+
+    struct duk_arena_block_t *prev = NULL;
+    struct duk_arena_block_t *next = a->free_large;
+    while (next != NULL && next < b)
+    {
+        prev = next;
+        next = next->next;
+    }
+    if (next != NULL && BLOCK_END(b) == (uint8_t *)next)
+    {
+        b->size += next->size;
+        next = next->next;
+    }
+    if (prev != NULL && BLOCK_END(prev) == (uint8_t *)b)
+    {
+        prev->size += b->size;
+        prev->next = next;
+        return;
+    }
+    b->next = next;
+    if (prev == NULL)
+    {
+        a->free_large = b;
+    }
+    else
+    {
+        prev->next = b;
+    }
+}
+
+void *duk_arena_alloc(duk_arena_t *a, const size_t size)
+{
+    struct duk_arena_block_t *b;
+    a->allocs++;
+
+    if (size <= DUK_ARENA_SMALL_MAX)
+    {
+        int c = class_map[(size + 7) / 8];
+        b = a->free_small[c];
+        if (b != NULL)
+        {
+            a->free_small[c] = b->next;
+        }
+        else
+        {
+            b = arena_bump(a, ARENA_HDR + class_size[c]);
+        }
+        if (b != NULL)
+        {
+            b->cls = c;
+            a->class_live[c]++;
+        }
+    }
+    else
+    {
+        b = arena_alloc_large(a, ARENA_HDR + ARENA_ALIGN(size));
+        if (b != NULL)
+        {
+            b->cls = ARENA_LARGE;
+            a->large_live++;
+        }
+    }
+
+    if (b == NULL)
+    {
+#ifdef DUK_ARENA_DEBUG
+        printf("%s: arena full, %d bytes from heap\n", __func__, (int)size);
+#endif
+        b = malloc(ARENA_HDR + size);
+        if (b == NULL)
+        {
+            a->failed++;
+            return NULL;
+        }
+        b->size = ARENA_HDR + size;
+        b->cls = ARENA_FALLBACK;
+        a->fallbacks++;
+        a->fallback_live += b->size;
+        return PAYLOAD(b);
+    }
+
+    a->live += b->size;
+    if (a->live > a->peak)
+    {
+        a->peak = a->live;
+    }
+    return PAYLOAD(b);
+}
+
+void duk_arena_free(duk_arena_t *a, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    struct duk_arena_block_t *b = BLOCK(ptr);
+    if (!is_arena(a, b))
+    {
+        a->fallback_live -= b->size;
+        free(b);
+        return;
+    }
+
+    a->live -= b->size;
+    if (b->cls == ARENA_LARGE)
+    {
+        a->large_live--;
+        arena_free_large(a, b);
+    }
+    else
+    {
+        a->class_live[b->cls]--;
+        b->next = a->free_small[b->cls];
+        a->free_small[b->cls] = b;
+    }
+}
+
+void *duk_arena_realloc(duk_arena_t *a, void *ptr, const size_t size)
+{
+    if (ptr == NULL)
+    {
+        return duk_arena_alloc(a, size);
+    }
+    if (size == 0)
+    {
+        duk_arena_free(a, ptr);
+        return NULL;
+    }
+
+    struct duk_arena_block_t *b = BLOCK(ptr);
+    size_t payload = b->size - ARENA_HDR;
+    if (b->cls == ARENA_LARGE)
+    {
+        if (size > DUK_ARENA_SMALL_MAX && size <= payload)
+        {
+            return ptr;
+        }
+        // last block grows in place, e.g. the value stack
+        size_t need = ARENA_HDR + ARENA_ALIGN(size);
+        if (size > payload && BLOCK_END(b) == a->mem + a->top && a->size - ((uint8_t *)b - a->mem) >= need)
+        {
+            a->live += need - b->size;
+            if (a->live > a->peak)
+            {
+                a->peak = a->live;
+            }
+            a->top = ((uint8_t *)b - a->mem) + need;
+            b->size = need;
+            return ptr;
+        }
+    }
+    else if (b->cls != ARENA_FALLBACK && size <= DUK_ARENA_SMALL_MAX && class_map[(size + 7) / 8] == b->cls)
+    {
+        return ptr;
+    }
+
+    void *n = duk_arena_alloc(a, size);
+    if (n == NULL)
+    {
+        return NULL;
+    }
+    memcpy(n, ptr, size < payload ? size : payload);
+    duk_arena_free(a, ptr);
+    return n;
+}
+
+void duk_arena_get_stats(duk_arena_t *a, duk_arena_stats_t *stats)
+{
+    stats->size = a->size;
+    stats->top = a->top;
+    stats->live = a->live;
+    stats->peak = a->peak;
+    for (int i = 0; i < DUK_ARENA_CLASS_NUM; i++)
+    {
+        stats->class_size[i] = class_size[i];
+        stats->class_live[i] = a->class_live[i];
+    }
+    stats->large_live = a->large_live;
+    stats->allocs = a->allocs;
+    stats->fallbacks = a->fallbacks;
+    stats->fallback_live = a->fallback_live;
+    stats->failed = a->failed;
+}
+
+void *duk_arena_alloc_func(void *udata, size_t size)
+{
+    return duk_arena_alloc((duk_arena_t *)udata, size);
+}
+
+void *duk_arena_realloc_func(void *udata, void *ptr, size_t size)
+{
+    return duk_arena_realloc((duk_arena_t *)udata, ptr, size);
+}
+
+void duk_arena_free_func(void *udata, void *ptr)
+{
+    duk_arena_free((duk_arena_t *)udata, ptr);
+}
+
+#ifdef DUK_ARENA_TEST
+
+#include <assert.h>
+#include <time.h>
+
+#define TEST_SIZE (256 * 1024)
+
+static uint8_t test_mem[TEST_SIZE];
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// size mix roughly like Duktape: mostly small objects and strings, some buffers
+static size_t rand_size()
+{
+    int r = rand() % 100;
+    if (r < 85)
+    {
+        return 8 + rand() % 120;
+    }
+    if (r < 97)
+    {
+        return 128 + rand() % 384;
+    }
+    return 512 + rand() % 4096;
+}
+
+#define STRESS_SLOTS 512
+#define STRESS_ROUNDS 200000
+
+// random alloc/realloc/free, every block is filled with its slot number
+static void stress(duk_arena_t *a)
+{
+    void *ptr[STRESS_SLOTS] = {0};
+    size_t len[STRESS_SLOTS] = {0};
+
+    srand(1);
+    for (int i = 0; i < STRESS_ROUNDS; i++)
+    {
+        int s = rand() % STRESS_SLOTS;
+        if (ptr[s] != NULL)
+        {
+            for (size_t j = 0; j < len[s]; j++)
+            {
+                assert(((uint8_t *)ptr[s])[j] == (uint8_t)s);
+            }
+        }
+        if (ptr[s] != NULL && rand() % 3 == 0)
+        {
+            size_t n = rand_size();
+            void *p = duk_arena_realloc(a, ptr[s], n);
+            assert(p != NULL);
+            ptr[s] = p;
+            if (n > len[s])
+            {
+                memset((uint8_t *)p + len[s], (uint8_t)s, n - len[s]);
+            }
+            len[s] = n;
+        }
+        else if (ptr[s] != NULL)
+        {
+            duk_arena_free(a, ptr[s]);
+            ptr[s] = NULL;
+        }
+        else
+        {
+            len[s] = rand_size();
+            ptr[s] = duk_arena_alloc(a, len[s]);
+            assert(ptr[s] != NULL);
+            memset(ptr[s], (uint8_t)s, len[s]);
+        }
+    }
+    for (int s = 0; s < STRESS_SLOTS; s++)
+    {
+        duk_arena_free(a, ptr[s]);
+    }
+}
+
+static double bench(duk_arena_t *a)
+{
+    static void *ptr[STRESS_SLOTS];
+    memset(ptr, 0, sizeof(ptr));
+    srand(2);
+    double t = now_us();
+    for (int i = 0; i < STRESS_ROUNDS; i++)
+    {
+        int s = rand() % STRESS_SLOTS;
+        if (ptr[s] != NULL)
+        {
+            a ? duk_arena_free(a, ptr[s]) : free(ptr[s]);
+            ptr[s] = NULL;
+        }
+        else
+        {
+            size_t n = rand_size();
+            ptr[s] = a ? duk_arena_alloc(a, n) : malloc(n);
+        }
+    }
+    for (int s = 0; s < STRESS_SLOTS; s++)
+    {
+        a ? duk_arena_free(a, ptr[s]) : free(ptr[s]);
+    }
+    return (now_us() - t) / STRESS_ROUNDS;
+}
+
+int main()
+{
+    duk_arena_t a;
+    duk_arena_stats_t st;
+
+    duk_arena_init(&a, test_mem + 3, TEST_SIZE - 3);
+    assert(((uintptr_t)a.mem & 7) == 0);
+
+    // size classes
+    void *s1 = duk_arena_alloc(&a, 1);
+    void *s2 = duk_arena_alloc(&a, 16);
+    void *s3 = duk_arena_alloc(&a, 17);
+    void *s4 = duk_arena_alloc(&a, DUK_ARENA_SMALL_MAX);
+    assert(((uintptr_t)s1 & 7) == 0 && ((uintptr_t)s3 & 7) == 0);
+    duk_arena_get_stats(&a, &st);
+    assert(st.class_live[0] == 2);
+    assert(st.class_live[1] == 1);
+    assert(st.class_live[DUK_ARENA_CLASS_NUM - 1] == 1);
+    assert(st.live == 4 * ARENA_HDR + 16 + 16 + 24 + DUK_ARENA_SMALL_MAX);
+    // freed small blocks are reused by the same class
+    duk_arena_free(&a, s2);
+    assert(duk_arena_alloc(&a, 10) == s2);
+    // realloc within the class stays in place
+    assert(duk_arena_realloc(&a, s3, 20) == s3);
+    void *s5 = duk_arena_realloc(&a, s3, 40);
+    assert(s5 != s3);
+    duk_arena_free(&a, s1);
+    duk_arena_free(&a, s2);
+    duk_arena_free(&a, s4);
+    duk_arena_free(&a, s5);
+    duk_arena_get_stats(&a, &st);
+    assert(st.live == 0);
+
+    // large blocks merge and return to the unused space
+    duk_arena_reset(&a);
+    void *l1 = duk_arena_alloc(&a, 1000);
+    void *l2 = duk_arena_alloc(&a, 1000);
+    void *l3 = duk_arena_alloc(&a, 1000);
+    void *l4 = duk_arena_alloc(&a, 1000);
+    size_t top = a.top;
+    duk_arena_free(&a, l2);
+    duk_arena_free(&a, l3);
+    assert(a.free_large == BLOCK(l2));
+    assert(BLOCK(l2)->size == 2 * (ARENA_HDR + 1000));
+    // first fit splits the merged block
+    void *l5 = duk_arena_alloc(&a, 500);
+    assert((uint8_t *)l5 > (uint8_t *)l2 && (uint8_t *)l5 < (uint8_t *)l4);
+    duk_arena_free(&a, l5);
+    duk_arena_free(&a, l4);
+    assert(a.top < top);
+    assert(a.free_large == NULL);
+    assert(a.top == (uint8_t *)BLOCK(l2) - a.mem);
+    duk_arena_free(&a, l1);
+    assert(a.top == 0);
+
+    // last block grows in place
+    l1 = duk_arena_alloc(&a, 1000);
+    assert(duk_arena_realloc(&a, l1, 3000) == l1);
+    assert(duk_arena_realloc(&a, l1, 2000) == l1);
+    duk_arena_free(&a, l1);
+    assert(a.top == 0);
+
+    // full arena falls back to malloc
+    void *big = duk_arena_alloc(&a, TEST_SIZE);
+    assert(big != NULL && !is_arena(&a, big));
+    duk_arena_get_stats(&a, &st);
+    assert(st.fallbacks == 1 && st.fallback_live == TEST_SIZE + ARENA_HDR);
+    memset(big, 0, TEST_SIZE);
+    big = duk_arena_realloc(&a, big, 100);
+    assert(big != NULL && is_arena(&a, big));
+    duk_arena_free(&a, big);
+    duk_arena_get_stats(&a, &st);
+    assert(st.fallback_live == 0 && st.live == 0);
+
+    duk_arena_reset(&a);
+    stress(&a);
+    duk_arena_get_stats(&a, &st);
+    assert(st.live == 0 && st.fallback_live == 0);
+    // free list stays ordered and merged
+    for (struct duk_arena_block_t *b = a.free_large; b != NULL; b = b->next)
+    {
+        assert(b->next == NULL || BLOCK_END(b) < (uint8_t *)b->next);
+        assert(BLOCK_END(b) < a.mem + a.top);
+    }
+    printf("stress: peak %u bytes, top %u, fallbacks %u\n", (unsigned int)st.peak, (unsigned int)st.top, st.fallbacks);
+
+    duk_arena_reset(&a);
+    double arena_us = bench(&a);
+    double malloc_us = bench(NULL);
+    duk_arena_get_stats(&a, &st);
+    printf("alloc/free | arena %6.3f us | malloc %6.3f us | fallbacks %u\n", arena_us, malloc_us, st.fallbacks);
+    return 0;
+}
+#endif
@@ -13,8 +13,10 @@
 #include "driver/rtc_io.h"
 #include "soc/sens_periph.h"
 #include "soc/rtc.h"
+#include "soc/soc_memory_layout.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "esp_timer.h"
 
 #include <duktape.h>
 
@@ -32,6 +34,12 @@
 #include "button_service.h"
 #include "board.h"
 #include "util.h"
+#include "pool.h"
+#include "timer_heap.h"
+#include "duk_arena.h"
+#include "duk_worker.h"
+#include "event_source.h"
+#include "coalesce.h"
 
 //#define DUK_MAIN_DEBUG 1
 //#define TIMER_DEBUG 1
@@ -41,18 +49,79 @@ typedef event_msg_t *event_msg_ptr_t;
 struct event_msg_t
 {
     event_msg_ptr_t next;
-    event_msg_ptr_t prev;
 
     event_msg_type msg_type;
     event_direction_type msg_direction;
 
-    int rssi;
-    int snr;
+    union
+    {
+        // LORA_MSG
+        struct
+        {
+            int rssi;
+            int snr;
+        };
+        // outgoing UI_MSG, UI_SENT, UI_SEND_FAILED, LORA_TX_DONE, LORA_TX_FAILED
+        struct
+        {
+            uint32_t id;
+            union
+            {
+                // send_func result for UI_SEND_FAILED
+                int error;
+                // LORA_TX_DONE
+                uint32_t airtime_us;
+            };
+        };
+    };
     time_t ts;
     uint8_t *payload;
     size_t payload_len;
+
+    // enqueue time
+    TickType_t ticks;
+    uint32_t enqueue_us;
+    event_source_type source;
 };
 
+_Static_assert(sizeof(event_msg_t) <= POOL_EVENT_SIZE, "event_msg_t does not fit POOL_EVENT_SIZE");
+
+// websocket and UDP tasks stop reading, the radio can't be stopped
+static const struct
+{
+    event_policy_type policy;
+    int limit;
+} event_source_defaults[EVENT_SOURCE_NUM] = {
+    [EVENT_SOURCE_LORA] = {EVENT_POLICY_DROP_OLDEST, 16},
+    [EVENT_SOURCE_UI] = {EVENT_POLICY_BLOCK, 16},
+    // must not stall the bluetooth stack
+    [EVENT_SOURCE_BLE] = {EVENT_POLICY_DROP_NEWEST, 16},
+    [EVENT_SOURCE_UDP] = {EVENT_POLICY_BLOCK, 16},
+    [EVENT_SOURCE_BUTTON] = {EVENT_POLICY_DROP_NEWEST, 4},
+    // the worker waits for the application to catch up
+    [EVENT_SOURCE_WORKER] = {EVENT_POLICY_BLOCK, 8},
+    // the application never waits for the transport, sendEvent() fails instead
+    [EVENT_SOURCE_SEND] = {EVENT_POLICY_DROP_NEWEST, 32},
+    [EVENT_SOURCE_LOCAL] = {EVENT_POLICY_NONE, 0},
+};
+
+// event object property names, interned once per heap
+typedef enum
+{
+    KEY_EVENT_TYPE = 0,
+    KEY_EVENT_DATA,
+    KEY_LORA_RSSI,
+    KEY_LORA_SNR,
+    KEY_TIMESTAMP,
+    KEY_NUM_PRESS,
+    KEY_MSG_ID,
+    KEY_ERROR,
+    KEY_AIRTIME,
+    KEY_NUM,
+} event_key_type;
+
+static const char *event_key_names[KEY_NUM] = {"EventType", "EventData", "LoRaRSSI", "LoRaSNR", "TimeStamp", "NumPress", "MsgId", "Error", "AirTimeUS"};
+
 struct duk_globals_t
 {
     // duktape engine
@@ -67,16 +136,80 @@ struct duk_globals_t
     // task
     TaskHandle_t duk_main_task_handle;
 
+    // recv_queue: events for the application, send_queue: messages for the sender task
     work_queue_t *event_queue;
-    // function to send to UI client
-    ui_msg_send_func *send_func;
+    // function to send to UI client, changed under send_lock
+    ui_msg_send_func *volatile send_func;
+    // does the blocking websocket / BLE writes
+    TaskHandle_t sender_task_handle;
+    SemaphoreHandle_t send_lock;
+    uint32_t send_id;
+    int send_reports;
+    // pack messages queued within the window into one frame, 0 = off
+    volatile unsigned long int coalesce_ms;
+    volatile size_t coalesce_max;
+    duk_main_send_stats_t send_stats;
 
     int load_index;
     char *load_file;
+    // reset to OnStart() returned
+    unsigned long int start_us;
+
+    // batched delivery via OnEvents()
+    event_msg_ptr_t *batch;
+    int batch_len;
+    int batch_max;
+    TickType_t batch_latency;
+
+    event_source_t sources[EVENT_SOURCE_NUM];
+
+    // setTimeout() / setInterval()
+    timer_heap_t timers;
+    // stash array of timer callbacks, indexed by timer slot
+    void *timer_funcs;
+
+    // queue wait and handler run time
+    duk_main_dispatch_stats_t dispatch[DISPATCH_STAT_NUM];
+
+    // memory of the Duktape heap, reset with the heap
+    duk_arena_t arena;
+    duk_main_heap_stats_t heap_stats;
+    // heap stats requested by the web service
+    volatile int heap_stats_req;
+    SemaphoreHandle_t heap_stats_done;
+
+    // garbage collection while there is nothing to do
+    unsigned long int idle_gc_ms;
+    unsigned int idle_gc_allocs;
+    // arena allocations at the end of the last collection
+    unsigned int gc_allocs;
+    // duk_gc() called by the runtime is running
+    int gc_explicit;
+
+    // execution budget for handlers, heap udata
+    esp32_duktape_budget_t budget;
+    unsigned long int budget_last_us;
+    unsigned long int budget_max_us;
+
+    // OnStart, OnEvent, ... see duk_util_handlers_install()
+    void *handlers;
+    void *keys[KEY_NUM];
 };
 
 #define MS_PER_TICK 10
 
+// allocated once, allocations beyond the arena come from the system heap
+#define DUK_ARENA_SIZE (64 * 1024)
+// how long GET /stats waits for the duktape task
+#define HEAP_STATS_WAIT_MS 500
+// idle GC defaults, the application can change them
+#define IDLE_GC_MS 100
+#define IDLE_GC_ALLOCS 1000
+// UI message coalescing limits
+#define SEND_COALESCE_MAX_MS 1000
+#define SEND_COALESCE_MIN_BYTES 64
+#define SEND_COALESCE_MAX_BYTES 4096
+
 #define LOAD_FILES_NUM 2
 const char *load_files[LOAD_FILES_NUM] = {
     BASE_PATH "/main.js",
@@ -100,43 +233,305 @@ void duk_main_set_load_file(char *fname)
     g->load_file = fname;
 }
 
-static int send_event(duk_context *ctx, event_msg_ptr_t event)
+// log2 buckets, cheap enough to always be on
+static inline void hist_add(duk_main_hist_t *h, const uint32_t us)
 {
-    int result = 1;
-    duk_push_global_object(ctx);
-    duk_get_prop_string(ctx, -1, "OnEvent");
+    int b = us == 0 ? 0 : 32 - __builtin_clz(us);
+    if (b >= DISPATCH_HIST_BUCKETS)
+    {
+        b = DISPATCH_HIST_BUCKETS - 1;
+    }
+    h->buckets[b]++;
+    h->count++;
+    if (us > h->max_us)
+    {
+        h->max_us = us;
+    }
+}
 
-    duk_push_object(ctx);
-    duk_push_number(ctx, event->msg_type);
-    duk_put_prop_string(ctx, -2, "EventType");
+unsigned long int duk_main_hist_percentile(const duk_main_hist_t *h, const int percent)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    unsigned long int target = ((unsigned long long)h->count * percent + 99) / 100;
+    unsigned long int sum = 0;
+    for (int b = 0; b < DISPATCH_HIST_BUCKETS; b++)
+    {
+        sum += h->buckets[b];
+        if (sum >= target)
+        {
+            // upper bound of the bucket
+            unsigned long int upper = b == 0 ? 0 : (1UL << b) - 1;
+            return upper < h->max_us ? upper : h->max_us;
+        }
+    }
+    return h->max_us;
+}
 
-    if (event->payload_len && event->payload != NULL)
+void duk_main_get_dispatch_stats(const int stat, duk_main_dispatch_stats_t *stats)
+{
+    memcpy(stats, &g->dispatch[stat], sizeof(duk_main_dispatch_stats_t));
+}
+
+void duk_main_reset_dispatch_stats()
+{
+    memset(g->dispatch, 0, sizeof(g->dispatch));
+}
+
+// duk_pcall() with the execution budget armed
+static int handler_pcall(duk_context *ctx, const int nargs, const int stat)
+{
+    int64_t start = esp_timer_get_time();
+    if (g->budget.budget)
+    {
+        g->budget.deadline = start + g->budget.budget;
+    }
+    int rc = duk_pcall(ctx, nargs);
+    g->budget.deadline = 0;
+    g->budget_last_us = esp_timer_get_time() - start;
+    if ((unsigned int)stat < DISPATCH_STAT_NUM)
+    {
+        hist_add(&g->dispatch[stat].run, g->budget_last_us);
+    }
+    if (g->budget_last_us > g->budget_max_us)
+    {
+        g->budget_max_us = g->budget_last_us;
+    }
+    return rc;
+}
+
+int duk_main_set_exec_budget(const unsigned long int budgetMS)
+{
+    g->budget.budget = (int64_t)budgetMS * 1000;
+    g->budget_max_us = 0;
+    return 1;
+}
+
+void duk_main_get_exec_budget(duk_main_exec_budget_t *stats)
+{
+    stats->budget_ms = g->budget.budget / 1000;
+    stats->overruns = g->budget.overruns;
+    stats->last_us = g->budget_last_us;
+    stats->max_us = g->budget_max_us;
+    stats->remaining_us = 0;
+    if (g->budget.deadline)
+    {
+        int64_t left = g->budget.deadline - esp_timer_get_time();
+        stats->remaining_us = left > 0 ? left : 0;
+    }
+}
+
+/*
+ * Event payloads are handed to JavaScript as external buffers so they are
+ * not copied again. Duktape does not free the memory of external buffers,
+ * so the heap free function watches for the buffer headers and returns
+ * the payload to the pool once the buffer (and every view of it) is gone.
+ */
+#define EXT_BUF_NUM 32
+
+static struct
+{
+    void *hdr;
+    void *payload;
+} ext_bufs[EXT_BUF_NUM];
+static int ext_buf_num;
+
+static void *duk_heap_alloc(void *udata, duk_size_t size)
+{
+    return duk_arena_alloc(&g->arena, size);
+}
+
+static void *duk_heap_realloc(void *udata, void *ptr, duk_size_t size)
+{
+    return duk_arena_realloc(&g->arena, ptr, size);
+}
+
+static void duk_heap_free(void *udata, void *ptr)
+{
+    for (int i = 0; i < ext_buf_num; i++)
+    {
+        if (ext_bufs[i].hdr == ptr)
+        {
+            pool_free(ext_bufs[i].payload);
+            ext_buf_num--;
+            ext_bufs[i] = ext_bufs[ext_buf_num];
+            break;
+        }
+    }
+    duk_arena_free(&g->arena, ptr);
+}
+
+// push payload as buffer, takes ownership of the payload
+static void push_payload(duk_context *ctx, event_msg_ptr_t event)
+{
+    if (ext_buf_num < EXT_BUF_NUM)
     {
+        duk_push_external_buffer(ctx);
+        duk_config_buffer(ctx, -1, event->payload, event->payload_len);
+        ext_bufs[ext_buf_num].hdr = duk_get_heapptr(ctx, -1);
+        ext_bufs[ext_buf_num].payload = event->payload;
+        ext_buf_num++;
+    }
+    else
+    {
+        // app holds on to many payloads, copy
         uint8_t *buf = (uint8_t *)duk_push_fixed_buffer(ctx, event->payload_len);
         memcpy(buf, event->payload, event->payload_len);
-        duk_put_prop_string(ctx, -2, "EventData");
+        pool_free(event->payload);
+    }
+    event->payload = NULL;
+}
+
+// push event object for OnEvent() / OnEvents()
+static void push_event(duk_context *ctx, event_msg_ptr_t event)
+{
+    // event types are not all checked by the producers
+    if ((unsigned int)event->msg_type < DISPATCH_STAT_ON_EVENTS)
+    {
+        hist_add(&g->dispatch[event->msg_type].wait, (uint32_t)esp_timer_get_time() - event->enqueue_us);
+    }
+
+    duk_push_object(ctx);
+    ADD_KEY_NUMBER(g->keys[KEY_EVENT_TYPE], event->msg_type);
+
+    if (event->payload_len && event->payload != NULL)
+    {
+        duk_push_heapptr(ctx, g->keys[KEY_EVENT_DATA]);
+        push_payload(ctx, event);
+        duk_put_prop(ctx, -3);
     }
     if (event->msg_type == LORA_MSG)
     {
-        duk_push_number(ctx, event->rssi);
-        duk_put_prop_string(ctx, -2, "LoRaRSSI");
-        duk_push_number(ctx, event->snr);
-        duk_put_prop_string(ctx, -2, "LoRaSNR");
+        ADD_KEY_NUMBER(g->keys[KEY_LORA_RSSI], event->rssi);
+        ADD_KEY_NUMBER(g->keys[KEY_LORA_SNR], event->snr);
     }
     if (event->ts)
     {
-        duk_push_number(ctx, event->ts);
-        duk_put_prop_string(ctx, -2, "TimeStamp");
+        ADD_KEY_NUMBER(g->keys[KEY_TIMESTAMP], event->ts);
     }
 
     if (event->msg_type == BUTTON_PRESSED)
     {
-        duk_push_number(ctx, event->payload_len);
-        duk_put_prop_string(ctx, -2, "NumPress");
+        ADD_KEY_NUMBER(g->keys[KEY_NUM_PRESS], event->payload_len);
+    }
+    if (event->msg_type == UI_SENT || event->msg_type == UI_SEND_FAILED || event->msg_type == LORA_TX_DONE || event->msg_type == LORA_TX_FAILED)
+    {
+        ADD_KEY_NUMBER(g->keys[KEY_MSG_ID], event->id);
+    }
+    if (event->msg_type == UI_SEND_FAILED || event->msg_type == LORA_TX_FAILED)
+    {
+        ADD_KEY_NUMBER(g->keys[KEY_ERROR], event->error);
+    }
+    if (event->msg_type == LORA_TX_DONE)
+    {
+        ADD_KEY_NUMBER(g->keys[KEY_AIRTIME], event->airtime_us);
+    }
+}
+
+static int send_event(duk_context *ctx, event_msg_ptr_t event)
+{
+    int result = 1;
+    duk_util_push_handler(ctx, g->handlers, DUK_UTIL_ON_EVENT);
+    push_event(ctx, event);
+    if (handler_pcall(ctx, 1 /*nargs*/, event->msg_type) != 0)
+    {
+#ifdef DUK_MAIN_DEBUG
+        logprintf("%s: eval failed: '%s'\n", __func__, duk_safe_to_string(ctx, -1));
+#endif
+        result = 0;
+    }
+    duk_pop(ctx);
+    return result;
+}
+
+static void event_sources_init()
+{
+    for (int i = 0; i < EVENT_SOURCE_NUM; i++)
+    {
+        event_source_init(&g->sources[i], event_source_defaults[i].policy, event_source_defaults[i].limit);
+    }
+}
+
+int duk_main_set_event_limit(const event_source_type source, const int limit)
+{
+    if (source >= EVENT_SOURCE_NUM || limit < 0)
+    {
+        return 0;
+    }
+    event_source_t *s = &g->sources[source];
+    // blocking the app on its own events would dead lock
+    if (s->policy == EVENT_POLICY_NONE)
+    {
+        return 0;
+    }
+    s->limit = limit;
+    if (s->space != NULL)
+    {
+        xSemaphoreGive(s->space);
+    }
+    return 1;
+}
+
+void duk_main_get_event_stats(const event_source_type source, event_source_stats_t *stats)
+{
+    event_source_t *s = &g->sources[source];
+    stats->limit = s->limit;
+    stats->depth = __atomic_load_n(&s->depth, __ATOMIC_RELAXED);
+    stats->high_water = s->high_water;
+    stats->drops = s->drops;
+    stats->blocked = s->blocked;
+}
+
+int duk_main_get_event_queue_len()
+{
+    int len;
+    event_msg_ptr_t e;
+    WORK_QUEUE_RECV_LEN(g->event_queue, len, e);
+    return len;
+}
+
+static void event_msg_free(event_msg_ptr_t msg)
+{
+    pool_free(msg->payload);
+    pool_free(msg);
+}
+
+static void event_free(event_msg_ptr_t msg)
+{
+    event_source_release(&g->sources[msg->source]);
+    event_msg_free(msg);
+}
+
+// deliver all batched events with a single OnEvents() call
+static int send_batch(duk_context *ctx)
+{
+    int result = 1;
+
+    if (!duk_util_push_handler(ctx, g->handlers, DUK_UTIL_ON_EVENTS))
+    {
+        duk_pop(ctx);
+        // app has no OnEvents(), fall back to OnEvent()
+        for (int i = 0; i < g->batch_len; i++)
+        {
+            result &= send_event(ctx, g->batch[i]);
+            event_msg_free(g->batch[i]);
+        }
+        g->batch_len = 0;
+        return result;
+    }
+
+    duk_idx_t arr_idx = duk_push_array(ctx);
+    for (int i = 0; i < g->batch_len; i++)
+    {
+        push_event(ctx, g->batch[i]);
+        duk_put_prop_index(ctx, arr_idx, i);
+        event_msg_free(g->batch[i]);
     }
+    g->batch_len = 0;
 
-    duk_insert(ctx, -1);
-    if (duk_pcall(ctx, 1 /*nargs*/) != 0)
+    if (handler_pcall(ctx, 1 /*nargs*/, DISPATCH_STAT_ON_EVENTS) != 0)
     {
 #ifdef DUK_MAIN_DEBUG
         logprintf("%s: eval failed: '%s'\n", __func__, duk_safe_to_string(ctx, -1));
@@ -147,6 +542,52 @@ static int send_event(duk_context *ctx, event_msg_ptr_t event)
     return result;
 }
 
+// ticks until the pending batch has to be delivered
+static TickType_t batch_wait()
+{
+    if (g->batch_len == 0)
+    {
+        return portMAX_DELAY;
+    }
+    TickType_t age = xTaskGetTickCount() - g->batch[0]->ticks;
+    if (age >= g->batch_latency)
+    {
+        return 0;
+    }
+    return g->batch_latency - age;
+}
+
+static void batch_clear()
+{
+    for (int i = 0; i < g->batch_len; i++)
+    {
+        event_msg_free(g->batch[i]);
+    }
+    g->batch_len = 0;
+}
+
+#define BATCH_MAX_EVENTS 64
+
+int duk_main_set_batching(const int max_events, const unsigned long int max_latency_MS)
+{
+    if (max_events < 0 || max_events > BATCH_MAX_EVENTS)
+    {
+        return 0;
+    }
+    // events already batched are delivered by duktape_task
+    if (g->batch == NULL && max_events > 1)
+    {
+        g->batch = malloc(sizeof(event_msg_ptr_t) * BATCH_MAX_EVENTS);
+        if (g->batch == NULL)
+        {
+            return 0;
+        }
+    }
+    g->batch_max = max_events > 1 ? max_events : 0;
+    g->batch_latency = pdMS_TO_TICKS(max_latency_MS);
+    return 1;
+}
+
 #define MAX_DELAY (100 * 60 * 60 * 24) // 24h
 
 static int timer_set_check()
@@ -219,6 +660,92 @@ int duk_main_set_wake_up_time(unsigned long int wake_up_in_MS)
     return 1;
 }
 
+static uint64_t timers_now()
+{
+    return esp_timer_get_time() / 1000;
+}
+
+// ticks until the next timer expires
+static TickType_t timers_wait()
+{
+    int64_t ms = timer_heap_next(&g->timers, timers_now());
+    if (ms < 0)
+    {
+        return portMAX_DELAY;
+    }
+    // round up, the tick we wake up on has to be after the expire time
+    return (ms + MS_PER_TICK - 1) / MS_PER_TICK;
+}
+
+static void timers_run(duk_context *ctx)
+{
+    uint64_t now = timers_now();
+    uint32_t id;
+    int periodic;
+
+    // interval timers are re-armed into the future and new timers expire
+    // at least 1ms from now, so this ends
+    while ((id = timer_heap_expired(&g->timers, now, &periodic)) != 0)
+    {
+        duk_push_heapptr(ctx, g->timer_funcs);
+        duk_get_prop_index(ctx, -1, TIMER_HEAP_SLOT(id));
+        if (!periodic)
+        {
+            // slot can be reused by the callback
+            duk_del_prop_index(ctx, -2, TIMER_HEAP_SLOT(id));
+        }
+        duk_remove(ctx, -2);
+        hist_add(&g->dispatch[DISPATCH_STAT_ON_TIMER].wait, g->timers.last_late * 1000);
+        if (handler_pcall(ctx, 0 /*nargs*/, DISPATCH_STAT_ON_TIMER) != 0)
+        {
+#ifdef TIMER_DEBUG
+            logprintf("%s: timer %x failed: '%s'\n", __func__, id, duk_safe_to_string(ctx, -1));
+#endif
+        }
+        duk_pop(ctx);
+    }
+}
+
+unsigned long int duk_main_timer_add(duk_context *ctx, const int func_idx, const unsigned long int delayMS, const int periodic)
+{
+    // callbacks must not run in the same pass they were added in
+    uint32_t delay = delayMS == 0 ? 1 : delayMS;
+    duk_idx_t idx = duk_normalize_index(ctx, func_idx);
+    uint32_t id = timer_heap_add(&g->timers, timers_now(), delay, periodic ? delay : 0);
+    if (id == 0)
+    {
+        return 0;
+    }
+    duk_push_heapptr(ctx, g->timer_funcs);
+    duk_dup(ctx, idx);
+    duk_put_prop_index(ctx, -2, TIMER_HEAP_SLOT(id));
+    duk_pop(ctx);
+#ifdef TIMER_DEBUG
+    logprintf("%s: timer %x in %d ms\n", __func__, id, delay);
+#endif
+    return id;
+}
+
+int duk_main_timer_cancel(duk_context *ctx, const unsigned long int id)
+{
+    if (!timer_heap_cancel(&g->timers, id))
+    {
+        return 0;
+    }
+    duk_push_heapptr(ctx, g->timer_funcs);
+    duk_del_prop_index(ctx, -1, TIMER_HEAP_SLOT(id));
+    duk_pop(ctx);
+    return 1;
+}
+
+void duk_main_get_timer_stats(duk_main_timer_stats_t *stats)
+{
+    stats->active = g->timers.num;
+    stats->fired = g->timers.fired;
+    stats->skipped = g->timers.skipped;
+    stats->max_late = g->timers.max_late;
+}
+
 void duk_main_set_reset(int rst)
 {
     g->reset = rst;
@@ -226,30 +753,135 @@ void duk_main_set_reset(int rst)
 
 void duk_main_set_send_func(ui_msg_send_func *func)
 {
+    // waits for a running send, the old transport can be stopped after this
+    xSemaphoreTake(g->send_lock, portMAX_DELAY);
     g->send_func = func;
+    xSemaphoreGive(g->send_lock);
 }
 
-int duk_main_add_full_event(event_msg_type msg_type, const event_direction_type direction, uint8_t *payload, const size_t len, const int rssi, const int snr, const time_t ts)
+void duk_main_set_send_reports(const int enable)
+{
+    g->send_reports = enable;
+}
+
+int duk_main_set_send_coalescing(const unsigned long int windowMS, const size_t maxBytes)
+{
+    if (windowMS > SEND_COALESCE_MAX_MS || (windowMS != 0 && (maxBytes < SEND_COALESCE_MIN_BYTES || maxBytes > SEND_COALESCE_MAX_BYTES)))
+    {
+        return 0;
+    }
+    // the sender task picks up the size with the next message
+    g->coalesce_max = maxBytes;
+    g->coalesce_ms = windowMS;
+    return 1;
+}
+
+void duk_main_get_send_stats(duk_main_send_stats_t *stats)
+{
+    memcpy(stats, &g->send_stats, sizeof(duk_main_send_stats_t));
+}
+
+// outgoing events go to the sender task, returns the message id (0 = dropped)
+static uint32_t event_add(const event_source_type source, event_msg_type msg_type, const event_direction_type direction, uint8_t *payload, const size_t len, const int rssi, const int snr, const time_t ts, const uint32_t id, const int error)
 {
-    event_msg_ptr_t m = malloc(sizeof(event_msg_t));
+    if (!event_source_reserve(&g->sources[source]))
+    {
+#ifdef DUK_MAIN_DEBUG
+        logprintf("%s: queue limit reached for source %d, drop\n", __func__, source);
+#endif
+        // we own the payload
+        pool_free(payload);
+        return 0;
+    }
+
+    event_msg_ptr_t m = pool_alloc(sizeof(event_msg_t));
+    if (m == NULL)
+    {
+        event_source_release(&g->sources[source]);
+        pool_free(payload);
+        return 0;
+    }
+    m->source = source;
     m->next = NULL;
-    m->prev = NULL;
     m->msg_type = msg_type;
     m->msg_direction = direction;
     m->payload = payload;
     m->ts = ts;
-    m->rssi = rssi;
-    m->snr = snr;
+    if (msg_type == LORA_MSG)
+    {
+        m->rssi = rssi;
+        m->snr = snr;
+    }
+    else
+    {
+        m->id = id;
+        m->error = error;
+    }
+    m->ticks = xTaskGetTickCount();
+    m->enqueue_us = esp_timer_get_time();
     m->payload_len = len;
     if (m->payload_len == 0 && m->payload != NULL)
     {
         m->payload_len = strlen((char *)payload);
     }
+    if (direction == OUTGOING)
+    {
+        if (m->id == 0)
+        {
+            m->id = __atomic_add_fetch(&g->send_id, 1, __ATOMIC_RELAXED);
+            if (m->id == 0)
+            {
+                m->id = __atomic_add_fetch(&g->send_id, 1, __ATOMIC_RELAXED);
+            }
+        }
+        uint32_t msg_id = m->id;
+        WORK_QUEUE_SEND_ADD(g->event_queue, m);
+        xTaskNotifyGive(g->sender_task_handle);
+        return msg_id;
+    }
     WORK_QUEUE_RECV_ADD(g->event_queue, m);
     duk_main_wake();
     return 1;
 }
 
+int duk_main_add_source_event(const event_source_type source, event_msg_type msg_type, const event_direction_type direction, uint8_t *payload, const size_t len, const int rssi, const int snr, const time_t ts)
+{
+    return event_add(source, msg_type, direction, payload, len, rssi, snr, ts, 0, 0) != 0;
+}
+
+int duk_main_add_result_event(event_msg_type msg_type, const uint32_t id, const int value)
+{
+    return event_add(EVENT_SOURCE_LOCAL, msg_type, INCOMING, NULL, 0, 0, 0, time(NULL), id, value) != 0;
+}
+
+unsigned long int duk_main_send(uint8_t *payload, const size_t len)
+{
+    return event_add(EVENT_SOURCE_SEND, UI_MSG, OUTGOING, payload, len, 0, 0, 0, 0, 0);
+}
+
+int duk_main_add_full_event(event_msg_type msg_type, const event_direction_type direction, uint8_t *payload, const size_t len, const int rssi, const int snr, const time_t ts)
+{
+    event_source_type source = direction == OUTGOING ? EVENT_SOURCE_SEND : EVENT_SOURCE_LOCAL;
+    if (direction == INCOMING)
+    {
+        switch (msg_type)
+        {
+        case LORA_MSG:
+            source = EVENT_SOURCE_LORA;
+            break;
+        case UI_MSG:
+            source = EVENT_SOURCE_UI;
+            break;
+        case BUTTON_PRESSED:
+            source = EVENT_SOURCE_BUTTON;
+            break;
+        default:
+            break;
+        }
+    }
+    return duk_main_add_source_event(source, msg_type, direction, payload, len, rssi, snr, ts);
+}
+
 int duk_main_add_event(event_msg_type msg_type, event_direction_type direction, uint8_t *payload, size_t len)
 {
     return duk_main_add_full_event(msg_type, direction, payload, len, 0, 0, 0);
@@ -263,11 +895,7 @@ static void work_queue_delete(work_queue_t *q)
         WORK_QUEUE_RECV_GET(g->event_queue, msg);
         if (msg != NULL)
         {
-            if (msg->payload)
-            {
-                free(msg->payload);
-            }
-            free(msg);
+            event_free(msg);
         }
         else
         {
@@ -276,30 +904,209 @@ static void work_queue_delete(work_queue_t *q)
     }
 }
 
+/*
+ * Duktape has no hook for garbage collection. An unreachable reference
+ * cycle with a finalizer is only found by mark-and-sweep, so its finalizer
+ * runs once per collection and arms the next one.
+ */
+static void gc_canary_arm(duk_context *ctx);
+
+static duk_ret_t gc_canary_finalizer(duk_context *ctx)
+{
+    // heap destruction
+    if (duk_get_boolean(ctx, 1))
+    {
+        return 0;
+    }
+    g->heap_stats.gc_runs++;
+    if (!g->gc_explicit)
+    {
+        g->heap_stats.gc_inband++;
+    }
+    gc_canary_arm(ctx);
+    return 0;
+}
+
+static void gc_canary_arm(duk_context *ctx)
+{
+    duk_push_object(ctx);
+    duk_dup_top(ctx);
+    duk_put_prop_string(ctx, -2, "self");
+    duk_push_c_function(ctx, gc_canary_finalizer, 2);
+    duk_set_finalizer(ctx, -2);
+    duk_pop(ctx);
+}
+
+static portMUX_TYPE heap_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// builtins are in flash and do not use heap
+static int heap_walk_skip(const void *ptr)
+{
+    return esp_ptr_in_drom(ptr);
+}
+
+// timed collection started by the runtime
+static void heap_gc(duk_context *ctx, const int rounds)
+{
+    duk_main_heap_stats_t *hs = &g->heap_stats;
+    int64_t start = esp_timer_get_time();
+    g->gc_explicit = 1;
+    for (int i = 0; i < rounds; i++)
+    {
+        duk_gc(ctx, 0);
+    }
+    g->gc_explicit = 0;
+    unsigned long int t = esp_timer_get_time() - start;
+    hs->gc_time_us += t;
+    if (t > hs->gc_max_us)
+    {
+        hs->gc_max_us = t;
+    }
+    g->gc_allocs = g->arena.allocs;
+}
+
+int duk_main_set_idle_gc(const unsigned long int idleMS, const unsigned int minAllocs)
+{
+    g->idle_gc_ms = idleMS;
+    g->idle_gc_allocs = minAllocs;
+    return 1;
+}
+
+// wait is the time in ticks until the task has to run again
+static int idle_gc(duk_context *ctx, const TickType_t wait)
+{
+    if (g->idle_gc_ms == 0 || wait < (g->idle_gc_ms + MS_PER_TICK - 1) / MS_PER_TICK ||
+        g->arena.allocs - g->gc_allocs < g->idle_gc_allocs || duk_main_get_event_queue_len() > 0)
+    {
+        return 0;
+    }
+    heap_gc(ctx, 1);
+    g->heap_stats.gc_idle++;
+    return 1;
+}
+
+void duk_main_update_heap_stats(duk_context *ctx, const int collect)
+{
+    duk_main_heap_stats_t *hs = &g->heap_stats;
+    if (collect)
+    {
+        // twice so objects with finalizers are collected too
+        heap_gc(ctx, 2);
+        hs->gc_forced++;
+    }
+
+    duk_util_heap_walk_t walk;
+    int64_t start = esp_timer_get_time();
+    duk_util_heap_walk(ctx, &walk, heap_walk_skip);
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&heap_stats_mux);
+    hs->walk = walk;
+    hs->walk_us = now - start;
+    hs->updated_us = now;
+    portEXIT_CRITICAL(&heap_stats_mux);
+}
+
+void duk_main_get_heap_stats(duk_main_heap_stats_t *stats)
+{
+    portENTER_CRITICAL(&heap_stats_mux);
+    memcpy(stats, &g->heap_stats, sizeof(duk_main_heap_stats_t));
+    portEXIT_CRITICAL(&heap_stats_mux);
+}
+
+// GET /stats, runs in the web server task
+static int stats_callback(char *buf, size_t len)
+{
+    // the duktape task walks the heap between two handler calls
+    xSemaphoreTake(g->heap_stats_done, 0);
+    g->heap_stats_req = 1;
+    duk_main_wake();
+    // a busy app gets the previous numbers
+    xSemaphoreTake(g->heap_stats_done, pdMS_TO_TICKS(HEAP_STATS_WAIT_MS));
+
+    duk_main_heap_stats_t hs;
+    duk_arena_stats_t as;
+    duk_main_get_heap_stats(&hs);
+    duk_main_get_arena_stats(&as);
+
+    int n = snprintf(buf, len, "{");
+    for (int i = 0; i < DUK_UTIL_HEAP_TYPE_NUM && n < len; i++)
+    {
+        n += snprintf(buf + n, len - n, "\"%s\":{\"Count\":%u,\"Bytes\":%u},",
+                      duk_util_heap_type_name(i), hs.walk.count[i], (unsigned int)hs.walk.bytes[i]);
+    }
+    if (n < len)
+    {
+        n += snprintf(buf + n, len - n,
+                      "\"GCRuns\":%u,\"GCInBand\":%u,\"GCIdle\":%u,\"GCForced\":%u,\"GCTimeUS\":%lu,\"GCMaxUS\":%lu,\"WalkUS\":%lu,\"AgeMS\":%lu,"
+                      "\"ArenaLive\":%u,\"ArenaPeak\":%u,\"ArenaSize\":%u,\"ArenaFallbacks\":%u,\"ArenaFailed\":%u,"
+                      "\"FreeHeap\":%u}",
+                      hs.gc_runs, hs.gc_inband, hs.gc_idle, hs.gc_forced, hs.gc_time_us, hs.gc_max_us, hs.walk_us,
+                      (unsigned long int)((esp_timer_get_time() - hs.updated_us) / 1000),
+                      (unsigned int)as.live, (unsigned int)as.peak, (unsigned int)as.size, as.fallbacks, as.failed,
+                      esp_get_free_heap_size());
+    }
+    return n < len ? n : -1;
+}
+
 static void duk_init()
 {
 #ifdef DUK_MAIN_DEBUG
     logprintf("%s: start\n", __func__);
 #endif
+    int64_t start = esp_timer_get_time();
 
 load:
     if (g->ctx != NULL)
     {
+        // the worker posts events for this heap
+        duk_worker_stop();
         duk_destroy_heap(g->ctx);
     }
-    g->ctx = duk_create_heap_default();
+    // whatever the old heap left behind is gone
+    duk_arena_reset(&g->arena);
+    memset(&g->heap_stats, 0, sizeof(g->heap_stats));
+    g->gc_allocs = g->arena.allocs;
+    g->gc_explicit = 0;
+    g->idle_gc_ms = IDLE_GC_MS;
+    g->idle_gc_allocs = IDLE_GC_ALLOCS;
+    g->budget.deadline = 0;
+    g->ctx = duk_create_heap(duk_heap_alloc, duk_heap_realloc, duk_heap_free, &g->budget, NULL);
     // clear queue
     work_queue_delete(g->event_queue);
+    batch_clear();
+    g->batch_max = 0;
+    g->budget.budget = 0;
+    g->budget_max_us = 0;
+    // limits are set by the application
+    for (int i = 0; i < EVENT_SOURCE_NUM; i++)
+    {
+        g->sources[i].limit = g->sources[i].default_limit;
+    }
 
     g->delay = portMAX_DELAY;
     g->wake_up_timeMS = 0;
     g->reset = 0;
+    g->send_reports = 0;
+    g->coalesce_ms = 0;
 
     duk_util_register(g->ctx);
     platform_register(g->ctx);
     duk_fs_register(g->ctx);
     lora_main_register(g->ctx);
     crypto_register(g->ctx);
+    duk_worker_register(g->ctx);
+
+    timer_heap_clear(&g->timers);
+    duk_push_global_stash(g->ctx);
+    duk_push_array(g->ctx);
+    g->timer_funcs = duk_get_heapptr(g->ctx, -1);
+    duk_put_prop_string(g->ctx, -2, "timers");
+    duk_pop(g->ctx);
+
+    g->handlers = duk_util_handlers_install(g->ctx);
+    duk_util_intern_keys(g->ctx, "event_keys", event_key_names, g->keys, KEY_NUM);
+    gc_canary_arm(g->ctx);
 
     char *load_name = g->load_file;
     if (load_name == NULL)
@@ -310,7 +1117,8 @@ load:
 #ifdef DUK_MAIN_DEBUG
     logprintf("%s: loading %s\n", __func__, load_name);
 #endif
-    if (duk_util_load_and_run(g->ctx, load_name, "OnStart();") == 0)
+    if (duk_util_load_and_run(g->ctx, load_name, NULL) == 0 ||
+        duk_util_call_handler(g->ctx, g->handlers, DUK_UTIL_ON_START) == 0)
     {
         g->load_index++;
         g->load_index = g->load_index % LOAD_FILES_NUM;
@@ -332,6 +1140,21 @@ load:
         free(g->load_file);
         g->load_file = NULL;
     }
+
+    g->start_us = esp_timer_get_time() - start;
+#ifdef DUK_MAIN_DEBUG
+    logprintf("%s: reset to OnStart() done in %ld us\n", __func__, g->start_us);
+#endif
+}
+
+void duk_main_get_arena_stats(duk_arena_stats_t *stats)
+{
+    duk_arena_get_stats(&g->arena, stats);
+}
+
+unsigned long int duk_main_get_start_time()
+{
+    return g->start_us;
 }
 
 static void duktape_task(void *ignored)
@@ -351,53 +1174,193 @@ static void duktape_task(void *ignored)
             duk_init();
         }
 
-        int notify = ulTaskNotifyTake(pdTRUE, g->delay);
+        TickType_t wait = batch_wait();
+        TickType_t timers = timers_wait();
+        wait = timers < wait ? timers : wait;
+        wait = wait < g->delay ? wait : g->delay;
+        // collect now instead of in the middle of the next handler
+        if (idle_gc(g->ctx, wait))
+        {
+            continue;
+        }
+        int notify = ulTaskNotifyTake(pdTRUE, wait);
         // time out
         if (notify == 0)
         {
         }
 
+        if (g->heap_stats_req)
+        {
+            g->heap_stats_req = 0;
+            duk_main_update_heap_stats(g->ctx, 0);
+            xSemaphoreGive(g->heap_stats_done);
+        }
+
         // process event_queue, timers
         for (;;)
         {
             if (timer_check())
             {
-                duk_util_run(g->ctx, "OnTimer();");
+                duk_util_push_handler(g->ctx, g->handlers, DUK_UTIL_ON_TIMER);
+                handler_pcall(g->ctx, 0 /*nargs*/, DISPATCH_STAT_ON_TIMER);
+                duk_pop(g->ctx);
             }
+            timers_run(g->ctx);
 
             event_msg_ptr_t msg = NULL;
             WORK_QUEUE_RECV_GET(g->event_queue, msg);
             if (msg == NULL)
             {
+                if (g->batch_len > 0 && (batch_wait() == 0 || g->batch_len >= g->batch_max))
+                {
+                    send_batch(g->ctx);
+                }
                 // back to sleep
                 break;
             }
 
-            if (msg->msg_direction == INCOMING)
+            if (event_source_overrun(&g->sources[msg->source]))
             {
-                send_event(g->ctx, msg);
+                event_free(msg);
+                continue;
             }
-            else
+
+            if (g->batch_max > 1)
             {
-                if (msg->msg_type == UI_MSG)
+                // batched events are bounded by batch_max, give the credit back
+                event_source_release(&g->sources[msg->source]);
+                g->batch[g->batch_len++] = msg;
+                if (g->batch_len >= g->batch_max || batch_wait() == 0)
                 {
-                    if (g->send_func)
-                    {
-                        g->send_func(msg->payload, msg->payload_len);
-                    }
+                    send_batch(g->ctx);
                 }
-                else
-                {
+                continue;
+            }
+            // batching was just disabled, keep the order
+            if (g->batch_len > 0)
+            {
+                send_batch(g->ctx);
+            }
+            send_event(g->ctx, msg);
+            event_free(msg);
+        }
+    }
+}
+
+// send functions return 0 on success
+static int sender_write(const uint8_t *buf, const size_t len)
+{
+    int res = -1;
+    xSemaphoreTake(g->send_lock, portMAX_DELAY);
+    if (g->send_func != NULL)
+    {
+        res = g->send_func(buf, len);
+    }
+    xSemaphoreGive(g->send_lock);
+    g->send_stats.frames++;
+    return res;
+}
+
+static void sender_report(event_msg_ptr_t msg, const int res)
+{
+    if (res != 0)
+    {
 #ifdef DUK_MAIN_DEBUG
-                    logprintf("%s: got OUTGOING event that is not UI_MSG\n", __func__);
+        logprintf("%s: send %u failed: %d\n", __func__, msg->id, res);
 #endif
-                }
-            }
-            if (msg->payload)
+        g->send_stats.failed++;
+        event_add(EVENT_SOURCE_LOCAL, UI_SEND_FAILED, INCOMING, NULL, 0, 0, 0, 0, msg->id, res);
+        return;
+    }
+    g->send_stats.sent++;
+    if (g->send_reports)
+    {
+        event_add(EVENT_SOURCE_LOCAL, UI_SENT, INCOMING, NULL, 0, 0, 0, 0, msg->id, 0);
+    }
+}
+
+// add messages that fit into the frame until the window is over, returns the last one
+static event_msg_ptr_t sender_coalesce(coalesce_t *c, event_msg_ptr_t first, const TickType_t window)
+{
+    event_msg_ptr_t last = first;
+    TickType_t start = xTaskGetTickCount();
+    for (;;)
+    {
+        event_msg_ptr_t msg = NULL;
+        WORK_QUEUE_SEND_GET(g->event_queue, msg);
+        if (msg == NULL)
+        {
+            TickType_t waited = xTaskGetTickCount() - start;
+            if (waited >= window || ulTaskNotifyTake(pdTRUE, window - waited) == 0)
             {
-                free(msg->payload);
+                break;
             }
-            free(msg);
+            continue;
+        }
+        if (msg->msg_type != UI_MSG || !coalesce_add(c, msg->payload, msg->payload_len))
+        {
+            // starts the next frame
+            WORK_QUEUE_SEND_INSERT_HEAD(g->event_queue, msg);
+            break;
+        }
+        last->next = msg;
+        last = msg;
+    }
+    return last;
+}
+
+// drains send_queue so the application never waits for websocket / BLE writes
+static void sender_task(void *ignored)
+{
+#ifdef DUK_MAIN_DEBUG
+    logprintf("%s started\n", __func__);
+#endif
+    coalesce_t c;
+    memset(&c, 0, sizeof(c));
+    for (;;)
+    {
+        event_msg_ptr_t msg = NULL;
+        WORK_QUEUE_SEND_GET(g->event_queue, msg);
+        if (msg == NULL)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (msg->msg_type != UI_MSG)
+        {
+            sender_report(msg, -1);
+            event_free(msg);
+            continue;
+        }
+
+        unsigned long int window_ms = g->coalesce_ms;
+        size_t max = g->coalesce_max;
+        if (window_ms != 0 && c.size != max)
+        {
+            coalesce_free(&c);
+            coalesce_init(&c, max);
+        }
+        else if (window_ms == 0 && c.size != 0)
+        {
+            coalesce_free(&c);
+        }
+
+        event_msg_ptr_t last = msg;
+        coalesce_reset(&c);
+        if (window_ms != 0 && coalesce_add(&c, msg->payload, msg->payload_len))
+        {
+            TickType_t window = (window_ms + MS_PER_TICK - 1) / MS_PER_TICK;
+            last = sender_coalesce(&c, msg, window);
+        }
+        // a single message goes out as it is
+        int res = last == msg ? sender_write(msg->payload, msg->payload_len) : sender_write(c.buf, c.len);
+
+        while (msg != NULL)
+        {
+            event_msg_ptr_t next = msg->next;
+            sender_report(msg, res);
+            event_free(msg);
+            msg = next;
         }
     }
 }
@@ -446,7 +1409,9 @@ void duk_main_start()
     logprintf("%s started\n", __func__);
 #endif
 
+    pool_init();
     platform_init();
+    duk_worker_init();
     lora_main_start();
 
     board_config_t *board = get_board_config();
@@ -460,15 +1425,41 @@ void duk_main_start()
     }
 
     webserver_set_control_func(control_callback);
+    webserver_set_stats_func(stats_callback);
 
     g = malloc(sizeof(struct duk_globals_t));
     g->load_file = NULL;
     g->load_index = 0;
+    g->start_us = 0;
     g->send_func = NULL;
+    g->send_lock = xSemaphoreCreateMutex();
+    g->send_id = 0;
+    g->send_reports = 0;
+    g->coalesce_ms = 0;
+    g->coalesce_max = 0;
+    memset(&g->send_stats, 0, sizeof(g->send_stats));
+    g->batch = NULL;
+    g->batch_len = 0;
+    g->batch_max = 0;
+    g->batch_latency = 0;
     g->event_queue = NULL;
     g->event_queue = malloc(sizeof(work_queue_t));
     WORK_QUEUE_INIT(g->event_queue);
+    event_sources_init();
+    duk_util_set_bytecode_cache(1);
+    timer_heap_init(&g->timers);
+    // a failed malloc leaves an empty arena, everything then comes from the heap
+    void *arena_mem = malloc(DUK_ARENA_SIZE);
+    duk_arena_init(&g->arena, arena_mem, arena_mem != NULL ? DUK_ARENA_SIZE : 0);
+    memset(&g->heap_stats, 0, sizeof(g->heap_stats));
+    g->heap_stats_req = 0;
+    g->heap_stats_done = xSemaphoreCreateBinary();
+    memset(&g->budget, 0, sizeof(g->budget));
+    memset(g->dispatch, 0, sizeof(g->dispatch));
+    g->budget_last_us = 0;
+    g->budget_max_us = 0;
     g->ctx = NULL;
 
+    xTaskCreatePinnedToCore(&sender_task, "sender_task", 4 * 1024, NULL, 5, &g->sender_task_handle, tskNO_AFFINITY);
     xTaskCreatePinnedToCore(&duktape_task, "duktape_task", 16 * 1024, NULL, 5, NULL, tskNO_AFFINITY);
 }
@@ -3,14 +3,20 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 
 #include <duktape.h>
 
 #include "duk_helpers.h"
+#include "duk_util.h"
 #include "log.h"
 
 #define DUK_UTIL_DEBUG 1
 
+static void module_push_require(duk_context *ctx, const char *dir);
+
 static duk_ret_t native_print(duk_context *ctx)
 {
     duk_push_string(ctx, " ");
@@ -24,6 +30,8 @@ void duk_util_register(duk_context *ctx)
 {
     duk_push_c_function(ctx, native_print, DUK_VARARGS);
     duk_put_global_string(ctx, "print");
+    module_push_require(ctx, "");
+    duk_put_global_string(ctx, "require");
 }
 
 int duk_util_run(duk_context *ctx, const char *func_str)
@@ -46,6 +54,114 @@ int duk_util_run(duk_context *ctx, const char *func_str)
     return result;
 }
 
+/*
+ * Application callbacks (OnStart, OnEvent, ...) are kept in an array in the
+ * heap stash so the runtime can call them without a global lookup or eval.
+ * The globals are turned into accessors so assigning a new function from
+ * JavaScript updates the stash. Function declarations replace the accessor,
+ * therefore the handlers are refreshed after every file is loaded.
+ */
+static const char *handler_names[DUK_UTIL_HANDLER_NUM] = {"OnStart", "OnEvent", "OnEvents", "OnTimer"};
+
+#define HANDLERS_STASH_KEY "handlers"
+
+static duk_ret_t handler_get(duk_context *ctx)
+{
+    duk_push_global_stash(ctx);
+    duk_get_prop_string(ctx, -1, HANDLERS_STASH_KEY);
+    duk_get_prop_index(ctx, -1, duk_get_current_magic(ctx));
+    return 1;
+}
+
+static duk_ret_t handler_set(duk_context *ctx)
+{
+    duk_push_global_stash(ctx);
+    duk_get_prop_string(ctx, -1, HANDLERS_STASH_KEY);
+    duk_dup(ctx, 0);
+    duk_put_prop_index(ctx, -2, duk_get_current_magic(ctx));
+    return 0;
+}
+
+// [ handlers ]
+static duk_ret_t handlers_refresh(duk_context *ctx, void *udata)
+{
+    duk_push_global_object(ctx);
+    for (int i = 0; i < DUK_UTIL_HANDLER_NUM; i++)
+    {
+        // current value, calls handler_get if the accessor is still in place
+        duk_get_prop_string(ctx, -1, handler_names[i]);
+        duk_put_prop_index(ctx, 0, i);
+
+        duk_push_string(ctx, handler_names[i]);
+        duk_push_c_function(ctx, handler_get, 0);
+        duk_set_magic(ctx, -1, i);
+        duk_push_c_function(ctx, handler_set, 1);
+        duk_set_magic(ctx, -1, i);
+        duk_def_prop(ctx, -4, DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_HAVE_SETTER | DUK_DEFPROP_SET_CONFIGURABLE | DUK_DEFPROP_SET_ENUMERABLE);
+    }
+    duk_pop(ctx);
+    return 0;
+}
+
+void *duk_util_handlers_install(duk_context *ctx)
+{
+    duk_push_global_stash(ctx);
+    if (!duk_get_prop_string(ctx, -1, HANDLERS_STASH_KEY))
+    {
+        duk_pop(ctx);
+        duk_push_array(ctx);
+        duk_dup_top(ctx);
+        duk_put_prop_string(ctx, -3, HANDLERS_STASH_KEY);
+    }
+    void *handlers = duk_get_heapptr(ctx, -1);
+    if (duk_safe_call(ctx, handlers_refresh, NULL, 1, 1) != DUK_EXEC_SUCCESS)
+    {
+#ifdef DUK_UTIL_DEBUG
+        logprintf("%s: failed: %s\n", __func__, duk_safe_to_string(ctx, -1));
+#endif
+    }
+    duk_pop_2(ctx);
+    return handlers;
+}
+
+int duk_util_push_handler(duk_context *ctx, void *handlers, const duk_util_handler_type handler)
+{
+    duk_push_heapptr(ctx, handlers);
+    duk_get_prop_index(ctx, -1, handler);
+    duk_remove(ctx, -2);
+    return duk_is_function(ctx, -1);
+}
+
+int duk_util_call_handler(duk_context *ctx, void *handlers, const duk_util_handler_type handler)
+{
+    int result = 1;
+    duk_util_push_handler(ctx, handlers, handler);
+    if (duk_pcall(ctx, 0 /*nargs*/) != 0)
+    {
+#ifdef DUK_UTIL_DEBUG
+        logprintf("%s: %s failed: %s\n", __func__, handler_names[handler], duk_safe_to_string(ctx, -1));
+#endif
+        result = 0;
+    }
+    duk_pop(ctx);
+    return result;
+}
+
+void duk_util_intern_keys(duk_context *ctx, const char *stash_key, const char **names, void **keys, const int num)
+{
+    duk_push_global_stash(ctx);
+    duk_push_array(ctx);
+    for (int i = 0; i < num; i++)
+    {
+        duk_push_string(ctx, names[i]);
+        keys[i] = duk_get_heapptr(ctx, -1);
+        duk_put_prop_index(ctx, -2, i);
+    }
+    // keeps the strings reachable
+    duk_put_prop_string(ctx, -2, stash_key);
+    duk_pop(ctx);
+}
+
 int duk_util_call_with_buf(duk_context *ctx, const char *func_name, const uint8_t *inbuf, const size_t len)
 {
     int result = 1;
@@ -100,6 +216,335 @@ char *duk_util_load_file(const char *fname)
     return buff;
 }
 
+/*
+ * Bytecode cache: compiled scripts are stored next to the source as
+ * <name>c (e.g. main.jsc). The cache is valid if size and hash of the
+ * source and the firmware build match, SPIFFS has no mtime.
+ */
+#define BC_CACHE_MAGIC 0x43425846 // FXBC
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t build;
+    uint32_t src_len;
+    uint32_t src_hash;
+    uint32_t bc_len;
+} bc_cache_hdr_t;
+
+static int bc_cache_enabled;
+static duk_util_cache_stats_t bc_cache_stats;
+
+void duk_util_set_bytecode_cache(const int enable)
+{
+    bc_cache_enabled = enable;
+}
+
+void duk_util_get_cache_stats(duk_util_cache_stats_t *stats)
+{
+    memcpy(stats, &bc_cache_stats, sizeof(duk_util_cache_stats_t));
+}
+
+// FNV-1a
+static uint32_t bc_hash(const char *buf, const size_t len, uint32_t h)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (uint8_t)buf[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+// bytecode is only valid for the Duktape build that created it
+static uint32_t bc_build_id()
+{
+    const char *build = __DATE__ " " __TIME__;
+    return bc_hash(build, strlen(build), 2166136261u) ^ DUK_VERSION;
+}
+
+static duk_ret_t bc_load(duk_context *ctx, void *udata)
+{
+    duk_load_function(ctx);
+    return 1;
+}
+
+// push function from cache file, returns 0 if the cache is not valid
+static int bc_cache_load(duk_context *ctx, const char *cname, const bc_cache_hdr_t *want)
+{
+    FILE *fp = fopen(cname, "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    bc_cache_hdr_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        hdr.magic != want->magic || hdr.build != want->build ||
+        hdr.src_len != want->src_len || hdr.src_hash != want->src_hash)
+    {
+        fclose(fp);
+        return 0;
+    }
+    void *bc = duk_push_fixed_buffer(ctx, hdr.bc_len);
+    int num = fread(bc, 1, hdr.bc_len, fp);
+    fclose(fp);
+    if (num != hdr.bc_len || duk_safe_call(ctx, bc_load, NULL, 1, 1) != DUK_EXEC_SUCCESS)
+    {
+#ifdef DUK_UTIL_DEBUG
+        logprintf("%s: bad cache file %s\n", __func__, cname);
+#endif
+        duk_pop(ctx);
+        return 0;
+    }
+    return 1;
+}
+
+// function to cache is on top of the stack
+static void bc_cache_store(duk_context *ctx, const char *cname, bc_cache_hdr_t *hdr)
+{
+    duk_dup_top(ctx);
+    duk_dump_function(ctx);
+    duk_size_t bc_len = 0;
+    void *bc = duk_get_buffer(ctx, -1, &bc_len);
+    hdr->bc_len = bc_len;
+
+    FILE *fp = fopen(cname, "w");
+    if (fp != NULL)
+    {
+        if (fwrite(hdr, sizeof(bc_cache_hdr_t), 1, fp) == 1 && fwrite(bc, 1, bc_len, fp) == bc_len)
+        {
+            bc_cache_stats.writes++;
+        }
+        fclose(fp);
+    }
+    duk_pop(ctx);
+}
+
+// compile as eval code like duk_util_run(), use bytecode cache if possible
+// pushes the function or the error, frees buff
+static int duk_util_compile_file(duk_context *ctx, const char *fname, const char *cname, char *buff)
+{
+    size_t len = strlen(buff);
+    bc_cache_hdr_t hdr = {BC_CACHE_MAGIC, bc_build_id(), len, bc_hash(buff, len, 2166136261u), 0};
+
+    if (bc_cache_enabled && bc_cache_load(ctx, cname, &hdr))
+    {
+        bc_cache_stats.hits++;
+        free(buff);
+        return 1;
+    }
+
+    duk_push_string(ctx, fname);
+    int rc = duk_pcompile_lstring_filename(ctx, DUK_COMPILE_EVAL, buff, len);
+    free(buff);
+    if (rc != 0)
+    {
+#ifdef DUK_UTIL_DEBUG
+        logprintf("%s: compile failed: %s\n", __func__, duk_safe_to_string(ctx, -1));
+#endif
+        return 0;
+    }
+    if (bc_cache_enabled)
+    {
+        bc_cache_stats.misses++;
+        bc_cache_store(ctx, cname, &hdr);
+    }
+    return 1;
+}
+
+// eval code runs with the global object as this, pushes the result or the error
+static int duk_util_eval_compiled(duk_context *ctx)
+{
+    duk_push_global_object(ctx);
+    if (duk_pcall_method(ctx, 0) != 0)
+    {
+#ifdef DUK_UTIL_DEBUG
+        logprintf("%s: eval failed: %s\n", __func__, duk_safe_to_string(ctx, -1));
+#endif
+        return 0;
+    }
+    return 1;
+}
+
+static int duk_util_run_file(duk_context *ctx, const char *fname, char *buff)
+{
+    char cname[64];
+    snprintf(cname, sizeof(cname), "%sc", fname);
+    int result = duk_util_compile_file(ctx, fname, cname, buff) && duk_util_eval_compiled(ctx);
+    duk_pop(ctx);
+    return result;
+}
+
+/*
+ * CommonJS style modules: require() evaluates a file once per heap inside
+ * a function wrapper and caches module.exports in the heap stash, keyed
+ * by the normalized path. Every module gets its own require() that knows
+ * the directory of the module to resolve relative ids.
+ */
+#define MODULES_STASH_KEY "modules"
+#define MODULE_PATH_MAX 64
+
+static duk_util_module_stats_t module_stats;
+
+static const char module_prefix[] = "(function(exports,require,module,__filename,__dirname){";
+static const char module_suffix[] = "\n})";
+
+// resolve id against dir, removes . and .. and appends .js if missing
+static int module_resolve(const char *dir, const char *id, char *path)
+{
+    char tmp[MODULE_PATH_MAX * 2];
+    // ids that do not start with . are relative to the root
+    if (snprintf(tmp, sizeof(tmp), "%s/%s", id[0] == '.' ? dir : "", id) >= sizeof(tmp))
+    {
+        return 0;
+    }
+
+    int len = 0;
+    char *save = NULL;
+    for (char *part = strtok_r(tmp, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save))
+    {
+        if (strcmp(part, ".") == 0)
+        {
+            continue;
+        }
+        if (strcmp(part, "..") == 0)
+        {
+            while (len > 0 && path[--len] != '/')
+                ;
+            continue;
+        }
+        int n = snprintf(path + len, MODULE_PATH_MAX - len, "/%s", part);
+        if (n >= MODULE_PATH_MAX - len)
+        {
+            return 0;
+        }
+        len += n;
+    }
+    path[len] = 0;
+    if (len < 3 || strcmp(path + len - 3, ".js") != 0)
+    {
+        if (len + 3 >= MODULE_PATH_MAX)
+        {
+            return 0;
+        }
+        strcpy(path + len, ".js");
+    }
+    return 1;
+}
+
+static duk_ret_t native_require(duk_context *ctx);
+
+// [ ... ] -> [ ... require ]
+static void module_push_require(duk_context *ctx, const char *dir)
+{
+    duk_push_c_function(ctx, native_require, 1);
+    duk_push_string(ctx, dir);
+    duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("dir"));
+}
+
+static duk_ret_t native_require(duk_context *ctx)
+{
+    const char *id = duk_require_string(ctx, 0);
+
+    // directory of the calling module, the global require() resolves against /
+    duk_push_current_function(ctx);
+    duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("dir"));
+    const char *dir = duk_get_string_default(ctx, -1, "");
+
+    char path[MODULE_PATH_MAX];
+    if (!module_resolve(dir, id, path))
+    {
+        return duk_error(ctx, DUK_ERR_RANGE_ERROR, "module id too long: %s", id);
+    }
+
+    duk_push_global_stash(ctx);
+    if (!duk_get_prop_string(ctx, -1, MODULES_STASH_KEY))
+    {
+        duk_pop(ctx);
+        duk_push_object(ctx);
+        duk_dup_top(ctx);
+        duk_put_prop_string(ctx, -3, MODULES_STASH_KEY);
+    }
+    if (duk_get_prop_string(ctx, -1, path))
+    {
+        module_stats.hits++;
+        duk_get_prop_string(ctx, -1, "exports");
+        return 1;
+    }
+    duk_pop(ctx);
+
+    char *src = duk_util_load_file(path);
+    if (src == NULL)
+    {
+        return duk_error(ctx, DUK_ERR_ERROR, "cannot find module '%s'", path);
+    }
+    size_t src_len = strlen(src);
+    char *buff = malloc(sizeof(module_prefix) + src_len + sizeof(module_suffix));
+    if (buff == NULL)
+    {
+        free(src);
+        return duk_error(ctx, DUK_ERR_ERROR, "can't allocate module '%s'", path);
+    }
+    memcpy(buff, module_prefix, sizeof(module_prefix) - 1);
+    memcpy(buff + sizeof(module_prefix) - 1, src, src_len);
+    memcpy(buff + sizeof(module_prefix) - 1 + src_len, module_suffix, sizeof(module_suffix));
+    free(src);
+
+    // the wrapped source differs from the plain file, use a separate cache file
+    char cname[MODULE_PATH_MAX + 1];
+    snprintf(cname, sizeof(cname), "%sm", path);
+    if (!duk_util_compile_file(ctx, path, cname, buff) || !duk_util_eval_compiled(ctx))
+    {
+        return duk_throw(ctx);
+    }
+    module_stats.loads++;
+
+    // [ ... modules wrapper ]
+    duk_push_object(ctx);
+    duk_push_object(ctx);
+    duk_put_prop_string(ctx, -2, "exports");
+    duk_push_string(ctx, path);
+    duk_put_prop_string(ctx, -2, "id");
+    // cache before running so circular requires get the partial exports
+    duk_dup_top(ctx);
+    duk_put_prop_string(ctx, -4, path);
+
+    // wrapper.call(exports, exports, require, module, __filename, __dirname)
+    duk_idx_t module_idx = duk_get_top_index(ctx);
+    char dirname[MODULE_PATH_MAX];
+    int dir_len = strrchr(path, '/') - path;
+    if (dir_len == 0)
+    {
+        strcpy(dirname, "/");
+    }
+    else
+    {
+        snprintf(dirname, sizeof(dirname), "%.*s", dir_len, path);
+    }
+    duk_dup(ctx, module_idx - 1);
+    duk_get_prop_string(ctx, module_idx, "exports");
+    duk_dup_top(ctx);
+    module_push_require(ctx, dirname);
+    duk_dup(ctx, module_idx);
+    duk_push_string(ctx, path);
+    duk_push_string(ctx, dirname);
+    if (duk_pcall_method(ctx, 5) != 0)
+    {
+        // a failed module is not cached, the next require() tries again
+        duk_del_prop_string(ctx, module_idx - 2, path);
+        return duk_throw(ctx);
+    }
+    duk_pop(ctx);
+    // module.exports may have been replaced
+    duk_get_prop_string(ctx, -1, "exports");
+    return 1;
+}
+
+void duk_util_get_module_stats(duk_util_module_stats_t *stats)
+{
+    memcpy(stats, &module_stats, sizeof(duk_util_module_stats_t));
+}
+
 int duk_util_load_and_run(duk_context *ctx, const char *fname, const char *func_call)
 {
     char *buff = duk_util_load_file(fname);
@@ -107,11 +552,206 @@ int duk_util_load_and_run(duk_context *ctx, const char *fname, const char *func_
     {
         return 0;
     }
-    int result = duk_util_run(ctx, buff);
-    free(buff);
+    int result = duk_util_run_file(ctx, fname, buff);
+    // pick up handlers (re)declared by the file
+    duk_push_global_stash(ctx);
+    if (duk_has_prop_string(ctx, -1, HANDLERS_STASH_KEY))
+    {
+        duk_util_handlers_install(ctx);
+    }
+    duk_pop(ctx);
     if (!result)
         return result;
     if (func_call)
         return duk_util_run(ctx, func_call);
     return 1;
 }
+
+/*
+ * Heap walk: follows prototypes and all own properties (including hidden
+ * and non-enumerable ones) starting at the global object and the stashes.
+ * Getters are not called. Values only reachable through closures or the
+ * call stack are not seen, so the numbers are a lower bound.
+ */
+typedef struct
+{
+    const void **slots;
+    size_t size;
+    size_t num;
+} ptr_set_t;
+
+typedef struct
+{
+    duk_util_heap_walk_t *walk;
+    int (*skip)(const void *ptr);
+    ptr_set_t seen;
+} heap_walk_t;
+
+// duk_inspect_value() "class", from duk_hobject.h (not part of the public API)
+#ifndef DUK_HOBJECT_CLASS_ARRAY
+#define DUK_HOBJECT_CLASS_ARRAY 2
+#endif
+
+static const char *heap_type_names[DUK_UTIL_HEAP_TYPE_NUM] = {"Objects", "Arrays", "Functions", "Strings", "Buffers"};
+
+const char *duk_util_heap_type_name(const duk_util_heap_type type)
+{
+    return (unsigned int)type < DUK_UTIL_HEAP_TYPE_NUM ? heap_type_names[type] : "";
+}
+
+// 1 = added, 0 = already in the set, -1 = out of memory
+static int ptr_set_add(ptr_set_t *s, const void *ptr)
+{
+    if (s->num * 2 >= s->size)
+    {
+        size_t size = s->size ? s->size * 2 : 256;
+        const void **slots = calloc(size, sizeof(void *));
+        if (slots == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < s->size; i++)
+        {
+            if (s->slots[i] != NULL)
+            {
+                size_t h = (((uintptr_t)s->slots[i] >> 3) * 2654435761u) & (size - 1);
+                while (slots[h] != NULL)
+                {
+                    h = (h + 1) & (size - 1);
+                }
+                slots[h] = s->slots[i];
+            }
+        }
+        free(s->slots);
+        s->slots = slots;
+        s->size = size;
+    }
+    size_t h = (((uintptr_t)ptr >> 3) * 2654435761u) & (s->size - 1);
+    while (s->slots[h] != NULL)
+    {
+        if (s->slots[h] == ptr)
+        {
+            return 0;
+        }
+        h = (h + 1) & (s->size - 1);
+    }
+    s->slots[h] = ptr;
+    s->num++;
+    return 1;
+}
+
+static size_t inspect_bytes(duk_context *ctx, const char *name)
+{
+    duk_get_prop_string(ctx, -1, name);
+    size_t bytes = duk_get_uint_default(ctx, -1, 0);
+    duk_pop(ctx);
+    return bytes;
+}
+
+// [ ... value ] -> [ ... children ]
+static void heap_walk_value(duk_context *ctx, heap_walk_t *w)
+{
+    duk_idx_t obj_idx = duk_get_top_index(ctx);
+    duk_int_t type = duk_get_type(ctx, obj_idx);
+    if (type != DUK_TYPE_STRING && type != DUK_TYPE_OBJECT && type != DUK_TYPE_BUFFER)
+    {
+        duk_pop(ctx);
+        return;
+    }
+    void *ptr = duk_get_heapptr(ctx, obj_idx);
+    if ((w->skip != NULL && w->skip(ptr)) || ptr_set_add(&w->seen, ptr) != 1)
+    {
+        duk_pop(ctx);
+        return;
+    }
+
+    duk_inspect_value(ctx, obj_idx);
+    size_t bytes = inspect_bytes(ctx, "hbytes") + inspect_bytes(ctx, "pbytes") + inspect_bytes(ctx, "bcbytes") + inspect_bytes(ctx, "dbytes");
+    unsigned int cls = inspect_bytes(ctx, "class");
+    duk_pop(ctx);
+
+    duk_util_heap_type ht = DUK_UTIL_HEAP_OBJECT;
+    if (type == DUK_TYPE_STRING)
+    {
+        ht = DUK_UTIL_HEAP_STRING;
+    }
+    else if (type == DUK_TYPE_BUFFER || duk_is_buffer_data(ctx, obj_idx))
+    {
+        ht = DUK_UTIL_HEAP_BUFFER;
+        // views share the data, count it once
+        duk_size_t len = 0;
+        void *data = duk_get_buffer_data(ctx, obj_idx, &len);
+        if (type == DUK_TYPE_OBJECT && data != NULL && ptr_set_add(&w->seen, data) == 1)
+        {
+            bytes += len;
+        }
+    }
+    else if (duk_is_function(ctx, obj_idx))
+    {
+        ht = DUK_UTIL_HEAP_FUNCTION;
+    }
+    else if (cls == DUK_HOBJECT_CLASS_ARRAY)
+    {
+        ht = DUK_UTIL_HEAP_ARRAY;
+    }
+    w->walk->count[ht]++;
+    w->walk->bytes[ht] += bytes;
+
+    if (type != DUK_TYPE_OBJECT)
+    {
+        duk_pop(ctx);
+        return;
+    }
+
+    duk_require_stack(ctx, 2);
+    duk_get_prototype(ctx, obj_idx);
+    duk_enum(ctx, obj_idx, DUK_ENUM_INCLUDE_NONENUMERABLE | DUK_ENUM_INCLUDE_HIDDEN | DUK_ENUM_INCLUDE_SYMBOLS | DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_NO_PROXY_BEHAVIOR);
+    duk_idx_t enum_idx = duk_get_top_index(ctx);
+    for (;;)
+    {
+        duk_require_stack(ctx, 6);
+        if (!duk_next(ctx, enum_idx, 0))
+        {
+            break;
+        }
+        // [ ... key ] -> [ ... key value getter setter ]
+        duk_dup_top(ctx);
+        duk_get_prop_desc(ctx, obj_idx, 0);
+        duk_get_prop_string(ctx, -1, "value");
+        duk_get_prop_string(ctx, -2, "get");
+        duk_get_prop_string(ctx, -3, "set");
+        duk_remove(ctx, -4);
+    }
+    duk_remove(ctx, enum_idx);
+    duk_remove(ctx, obj_idx);
+}
+
+static duk_ret_t heap_walk(duk_context *ctx, void *udata)
+{
+    heap_walk_t *w = (heap_walk_t *)udata;
+    duk_push_global_object(ctx);
+    duk_push_global_stash(ctx);
+    duk_push_heap_stash(ctx);
+    while (duk_get_top(ctx) > 0)
+    {
+        heap_walk_value(ctx, w);
+    }
+    return 0;
+}
+
+int duk_util_heap_walk(duk_context *ctx, duk_util_heap_walk_t *walk, int (*skip)(const void *ptr))
+{
+    heap_walk_t w = {walk, skip, {NULL, 0, 0}};
+    memset(walk, 0, sizeof(duk_util_heap_walk_t));
+    int result = 1;
+    if (duk_safe_call(ctx, heap_walk, &w, 0, 1) != DUK_EXEC_SUCCESS)
+    {
+#ifdef DUK_UTIL_DEBUG
+        logprintf("%s: failed: %s\n", __func__, duk_safe_to_string(ctx, -1));
+#endif
+        result = 0;
+    }
+    duk_pop(ctx);
+    free(w.seen.slots);
+    return result;
+}
@@ -0,0 +1,452 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include <duktape.h>
+
+#include "log.h"
+#include "queue.h"
+#include "pool.h"
+#include "duk_arena.h"
+#include "duk_util.h"
+#include "duk_fs.h"
+#include "duk_crypto.h"
+#include "duk_helpers.h"
+#include "duk_main.h"
+#include "duk_worker.h"
+
+//#define DUK_WORKER_DEBUG 1
+
+/* jsondoc
+{
+"class": "Worker",
+"longtext": "
+A worker runs a second JavaScript application on the other CPU core.
+It is meant for CPU heavy work (e.g. decrypting LoRaWAN payloads) that
+would otherwise delay events for the main application.
+
+The worker has its own heap and does not share any JavaScript objects with
+the main application. Messages are buffers that are copied when sent.
+Only one worker can run at a time, it is stopped when the main
+application is restarted.
+
+The worker application has `OnStart()` and `OnEvent(event)` like the main
+application. It receives messages as events with `EventType` 9
+and `EventData` set to the message. It can use print(), require(),
+FileSystem and Crypto. The Worker object of the worker only has
+`postMessage()` to send messages to the main application, they are
+delivered to the main application's `OnEvent()` with `EventType` 9.
+
+Example:
+```
+// main.js
+function OnStart() {
+    Worker.start('/decrypt.js');
+    Worker.postMessage(Uint8Array.allocPlain('hello'));
+}
+
+function OnEvent(event) {
+    if (event.EventType == 9) {
+        print('worker says: ' + new TextDecoder().decode(event.EventData) + '\\n');
+    }
+}
+
+// decrypt.js
+function OnStart() {}
+
+function OnEvent(event) {
+    Worker.postMessage(event.EventData);
+}
+```
+"
+}
+*/
+
+// APP_CPU, the network stacks run on the PRO_CPU
+#define WORKER_CORE 1
+#define WORKER_PRIORITY 4
+#define WORKER_STACK (16 * 1024)
+#define WORKER_ARENA_SIZE (32 * 1024)
+// a worker blocked on a full main queue gives up after EVENT_BLOCK_MAX_MS
+#define WORKER_STOP_WAIT_MS 3000
+
+typedef enum
+{
+    WORKER_STOPPED = 0,
+    WORKER_RUNNING,
+    WORKER_STOPPING,
+} worker_state_t;
+
+typedef struct worker_msg_t
+{
+    struct worker_msg_t *next;
+    size_t len;
+    uint8_t data[];
+} worker_msg_t;
+
+static struct
+{
+    volatile worker_state_t state;
+    TaskHandle_t task;
+    SemaphoreHandle_t done;
+    // main -> worker, the main task is the only producer
+    work_list_t inbox;
+    char *fname;
+    duk_arena_t arena;
+    // heap udata, used to abort the worker's JavaScript on stop
+    esp32_duktape_budget_t budget;
+    duk_worker_stats_t stats;
+} w;
+// state leaving WORKER_RUNNING, task, inbox push and notify (main and worker run on different cores)
+static portMUX_TYPE worker_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void *worker_alloc(void *udata, duk_size_t size)
+{
+    return duk_arena_alloc(&w.arena, size);
+}
+
+static void *worker_realloc(void *udata, void *ptr, duk_size_t size)
+{
+    return duk_arena_realloc(&w.arena, ptr, size);
+}
+
+static void worker_free(void *udata, void *ptr)
+{
+    duk_arena_free(&w.arena, ptr);
+}
+
+// buffer or string argument, returns NULL if it is neither
+static const void *message_data(duk_context *ctx, const duk_idx_t idx, duk_size_t *len)
+{
+    if (duk_is_string(ctx, idx))
+    {
+        return duk_get_lstring(ctx, idx, len);
+    }
+    return duk_get_buffer_data(ctx, idx, len);
+}
+
+// -- worker heap
+
+static duk_ret_t worker_post_message(duk_context *ctx)
+{
+    duk_size_t len = 0;
+    const void *data = message_data(ctx, 0, &len);
+    if (data == NULL)
+    {
+        return duk_error(ctx, DUK_ERR_TYPE_ERROR, "buffer or string required");
+    }
+    uint8_t *payload = NULL;
+    if (len > 0)
+    {
+        payload = pool_alloc(len);
+        if (payload == NULL)
+        {
+            duk_push_boolean(ctx, 0);
+            return 1;
+        }
+        memcpy(payload, data, len);
+    }
+    int res = duk_main_add_source_event(EVENT_SOURCE_WORKER, WORKER_MSG, INCOMING, payload, len, 0, 0, 0);
+    if (res)
+    {
+        w.stats.received++;
+    }
+    duk_push_boolean(ctx, res);
+    return 1;
+}
+
+static duk_function_list_entry worker_self_funcs[] = {
+    {"postMessage", worker_post_message, 1},
+    {NULL, NULL, 0},
+};
+
+static void worker_deliver(duk_context *ctx, void *handlers, worker_msg_t *m)
+{
+    if (!duk_util_push_handler(ctx, handlers, DUK_UTIL_ON_EVENT))
+    {
+        duk_pop(ctx);
+        return;
+    }
+    duk_push_object(ctx);
+    ADD_NUMBER("EventType", WORKER_MSG);
+    uint8_t *buf = (uint8_t *)duk_push_fixed_buffer(ctx, m->len);
+    memcpy(buf, m->data, m->len);
+    duk_put_prop_string(ctx, -2, "EventData");
+    if (duk_pcall(ctx, 1) != 0)
+    {
+#ifdef DUK_WORKER_DEBUG
+        logprintf("%s: OnEvent failed: %s\n", __func__, duk_safe_to_string(ctx, -1));
+#endif
+    }
+    duk_pop(ctx);
+}
+
+static void worker_task(void *ignored)
+{
+    void *mem = malloc(WORKER_ARENA_SIZE);
+    duk_arena_init(&w.arena, mem, mem != NULL ? WORKER_ARENA_SIZE : 0);
+    duk_context *ctx = duk_create_heap(worker_alloc, worker_realloc, worker_free, &w.budget, NULL);
+    if (ctx != NULL)
+    {
+        duk_util_register(ctx);
+        duk_fs_register(ctx);
+        crypto_register(ctx);
+        duk_push_global_object(ctx);
+        duk_push_object(ctx);
+        duk_put_function_list(ctx, -1, worker_self_funcs);
+        duk_put_prop_string(ctx, -2, "Worker");
+        duk_pop(ctx);
+
+        void *handlers = duk_util_handlers_install(ctx);
+        if (duk_util_load_and_run(ctx, w.fname, NULL))
+        {
+            duk_util_call_handler(ctx, handlers, DUK_UTIL_ON_START);
+            while (w.state == WORKER_RUNNING)
+            {
+                worker_msg_t *m = NULL;
+                WORK_LIST_GET(&w.inbox, m);
+                if (m == NULL)
+                {
+                    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                    continue;
+                }
+                worker_deliver(ctx, handlers, m);
+                pool_free(m);
+            }
+        }
+#ifdef DUK_WORKER_DEBUG
+        else
+        {
+            logprintf("%s: can't load %s\n", __func__, w.fname);
+        }
+#endif
+        duk_destroy_heap(ctx);
+    }
+
+    // the worker may exit on its own (load or heap failure), no messages or notifications after this
+    portENTER_CRITICAL(&worker_mux);
+    if (w.state == WORKER_RUNNING)
+    {
+        w.state = WORKER_STOPPING;
+    }
+    w.task = NULL;
+    portEXIT_CRITICAL(&worker_mux);
+
+    for (;;)
+    {
+        worker_msg_t *m = NULL;
+        WORK_LIST_GET(&w.inbox, m);
+        if (m == NULL)
+        {
+            break;
+        }
+        w.stats.dropped++;
+        pool_free(m);
+    }
+    free(mem);
+    free(w.fname);
+    w.fname = NULL;
+    w.state = WORKER_STOPPED;
+    xSemaphoreGive(w.done);
+    vTaskDelete(NULL);
+}
+
+// -- main heap
+
+/* jsondoc
+{
+"name": "start",
+"args": [{"name": "filename", "vtype": "string", "text": "worker application"}],
+"text": "Start a worker that runs filename. Fails if a worker is already running.",
+"return": "boolean status",
+"example": "
+Worker.start('/decrypt.js');
+"
+}
+*/
+static duk_ret_t worker_start(duk_context *ctx)
+{
+    const char *fname = duk_require_string(ctx, 0);
+    if (w.state != WORKER_STOPPED)
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    xSemaphoreTake(w.done, 0);
+    w.fname = strdup(fname);
+    w.budget.deadline = 0;
+    w.budget.budget = 0;
+    w.state = WORKER_RUNNING;
+    if (w.fname == NULL || xTaskCreatePinnedToCore(&worker_task, "worker_task", WORKER_STACK, NULL, WORKER_PRIORITY, &w.task, WORKER_CORE) != pdPASS)
+    {
+        free(w.fname);
+        w.fname = NULL;
+        w.state = WORKER_STOPPED;
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    duk_push_boolean(ctx, 1);
+    return 1;
+}
+
+int duk_worker_stop()
+{
+    if (w.state == WORKER_STOPPED)
+    {
+        return 1;
+    }
+    portENTER_CRITICAL(&worker_mux);
+    if (w.state == WORKER_RUNNING)
+    {
+        w.state = WORKER_STOPPING;
+        // the deadline is always over, running JavaScript keeps throwing until it returns
+        w.budget.deadline = 1;
+        xTaskNotifyGive(w.task);
+    }
+    portEXIT_CRITICAL(&worker_mux);
+    if (xSemaphoreTake(w.done, pdMS_TO_TICKS(WORKER_STOP_WAIT_MS)) != pdTRUE)
+    {
+#ifdef DUK_WORKER_DEBUG
+        logprintf("%s: worker did not stop\n", __func__);
+#endif
+        return 0;
+    }
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "stop",
+"args": [],
+"text": "Stop the worker. Running worker code is aborted. Messages the worker did not process yet are dropped.",
+"return": "boolean status (false if the worker did not exit in time)",
+"example": "
+Worker.stop();
+"
+}
+*/
+static duk_ret_t worker_stop(duk_context *ctx)
+{
+    duk_push_boolean(ctx, duk_worker_stop());
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "postMessage",
+"args": [{"name": "data", "vtype": "plain buffer or string", "text": "message"}],
+"text": "Send a message to the worker. The data is copied. The worker receives it via OnEvent() with EventType 9.",
+"return": "boolean status",
+"example": "
+Worker.postMessage(Uint8Array.allocPlain('hello'));
+"
+}
+*/
+static duk_ret_t worker_post(duk_context *ctx)
+{
+    duk_size_t len = 0;
+    const void *data = message_data(ctx, 0, &len);
+    if (data == NULL)
+    {
+        return duk_error(ctx, DUK_ERR_TYPE_ERROR, "buffer or string required");
+    }
+    if (w.state != WORKER_RUNNING)
+    {
+        w.stats.dropped++;
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    worker_msg_t *m = pool_alloc(sizeof(worker_msg_t) + len);
+    if (m == NULL)
+    {
+        w.stats.dropped++;
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    m->next = NULL;
+    m->len = len;
+    memcpy(m->data, data, len);
+    portENTER_CRITICAL(&worker_mux);
+    int running = w.state == WORKER_RUNNING;
+    if (running)
+    {
+        WORK_LIST_PUSH(&w.inbox, m);
+        xTaskNotifyGive(w.task);
+    }
+    portEXIT_CRITICAL(&worker_mux);
+    if (!running)
+    {
+        // the worker exited after the check above
+        pool_free(m);
+        w.stats.dropped++;
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    w.stats.sent++;
+    duk_push_boolean(ctx, 1);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getStats",
+"args": [],
+"text": "Returns worker statistics. `Running` is true while a worker is running, `Sent` counts messages sent to the worker, `Received` messages received from the worker and `Dropped` messages the worker did not get.",
+"return": "object",
+"example": "
+var ws = Worker.getStats();
+print('worker running: ' + ws.Running + '\\n');
+"
+}
+*/
+static duk_ret_t worker_stats(duk_context *ctx)
+{
+    duk_worker_stats_t st;
+    duk_worker_get_stats(&st);
+    duk_push_object(ctx);
+    duk_push_boolean(ctx, st.running);
+    duk_put_prop_string(ctx, -2, "Running");
+    ADD_NUMBER("Sent", st.sent);
+    ADD_NUMBER("Received", st.received);
+    ADD_NUMBER("Dropped", st.dropped);
+    return 1;
+}
+
+void duk_worker_get_stats(duk_worker_stats_t *stats)
+{
+    memcpy(stats, &w.stats, sizeof(duk_worker_stats_t));
+    stats->running = w.state == WORKER_RUNNING;
+}
+
+static duk_function_list_entry worker_funcs[] = {
+    {"start", worker_start, 1},
+    {"stop", worker_stop, 0},
+    {"postMessage", worker_post, 1},
+    {"getStats", worker_stats, 0},
+    {NULL, NULL, 0},
+};
+
+void duk_worker_register(duk_context *ctx)
+{
+    duk_push_global_object(ctx);
+    duk_push_object(ctx);
+
+    duk_put_function_list(ctx, -1, worker_funcs);
+    duk_put_prop_string(ctx, -2, "Worker");
+    duk_pop(ctx);
+}
+
+void duk_worker_init()
+{
+    memset(&w, 0, sizeof(w));
+    WORK_LIST_INIT(&w.inbox);
+    w.done = xSemaphoreCreateBinary();
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef EVENT_SOURCE_TEST
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#else
+// time only moves while a producer waits
+typedef unsigned int TickType_t;
+static TickType_t ticks;
+#define pdMS_TO_TICKS(ms) (ms)
+#define xTaskGetTickCount() (ticks)
+#define xSemaphoreCreateBinary() ((SemaphoreHandle_t)&ticks)
+#define xSemaphoreGive(sem)
+#define xSemaphoreTake(sem, wait) (ticks += (wait))
+#endif
+
+#include "event_source.h"
+
+void event_source_init(event_source_t *s, const event_policy_type policy, const int limit)
+{
+    s->policy = policy;
+    s->default_limit = limit;
+    s->limit = limit;
+    s->depth = 0;
+    s->high_water = 0;
+    s->drops = 0;
+    s->blocked = 0;
+    s->space = NULL;
+    if (s->policy == EVENT_POLICY_BLOCK)
+    {
+        s->space = xSemaphoreCreateBinary();
+    }
+}
+
+int event_source_reserve(event_source_t *s)
+{
+    if (s->limit == 0)
+    {
+        __atomic_add_fetch(&s->depth, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    // drop oldest happens on the consumer side, this only bounds memory
+    int max = s->policy == EVENT_POLICY_DROP_OLDEST ? s->limit * 2 : s->limit;
+    TickType_t start = xTaskGetTickCount();
+    int blocked = 0;
+    for (;;)
+    {
+        int depth = __atomic_add_fetch(&s->depth, 1, __ATOMIC_RELAXED);
+        if (depth <= max)
+        {
+            if (depth > s->high_water)
+            {
+                s->high_water = depth;
+            }
+            return 1;
+        }
+        __atomic_sub_fetch(&s->depth, 1, __ATOMIC_RELAXED);
+
+        if (s->policy != EVENT_POLICY_BLOCK || xTaskGetTickCount() - start >= pdMS_TO_TICKS(EVENT_BLOCK_MAX_MS))
+        {
+            break;
+        }
+        if (!blocked)
+        {
+            blocked = 1;
+            __atomic_add_fetch(&s->blocked, 1, __ATOMIC_RELAXED);
+        }
+        xSemaphoreTake(s->space, pdMS_TO_TICKS(EVENT_BLOCK_SLICE_MS));
+    }
+    __atomic_add_fetch(&s->drops, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void event_source_release(event_source_t *s)
+{
+    int depth = __atomic_sub_fetch(&s->depth, 1, __ATOMIC_RELAXED);
+    if (s->policy == EVENT_POLICY_BLOCK && depth < s->limit)
+    {
+        xSemaphoreGive(s->space);
+    }
+}
+
+int event_source_overrun(event_source_t *s)
+{
+    if (s->policy != EVENT_POLICY_DROP_OLDEST || s->limit == 0)
+    {
+        return 0;
+    }
+    if (__atomic_load_n(&s->depth, __ATOMIC_RELAXED) > s->limit)
+    {
+        __atomic_add_fetch(&s->drops, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef EVENT_SOURCE_TEST
+
+#include <assert.h>
+
+// duktape_task moving events from the queue into the batch
+static int batch_events(event_source_t *s, const int num)
+{
+    int batched = 0;
+    for (int i = 0; i < num; i++)
+    {
+        if (event_source_overrun(s))
+        {
+            event_source_release(s);
+            continue;
+        }
+        event_source_release(s);
+        batched++;
+    }
+    return batched;
+}
+
+int main()
+{
+    event_source_t s;
+
+    // LoRa: batch bigger than the limit, queue is empty, nothing is dropped
+    event_source_init(&s, EVENT_POLICY_DROP_OLDEST, 16);
+    for (int i = 0; i < 40; i++)
+    {
+        assert(event_source_reserve(&s));
+        assert(batch_events(&s, 1) == 1);
+    }
+    assert(s.depth == 0 && s.drops == 0 && s.high_water == 1);
+
+    // consumer falls behind, the oldest queued events are dropped
+    for (int i = 0; i < 20; i++)
+    {
+        assert(event_source_reserve(&s));
+    }
+    assert(batch_events(&s, 20) == 16);
+    assert(s.depth == 0 && s.drops == 4);
+    // memory bound for the producer
+    for (int i = 0; i < 32; i++)
+    {
+        assert(event_source_reserve(&s));
+    }
+    assert(!event_source_reserve(&s));
+    assert(s.drops == 5);
+    assert(batch_events(&s, 32) == 16);
+
+    // UI: producer doesn't wait for events that sit in the batch
+    event_source_init(&s, EVENT_POLICY_BLOCK, 16);
+    for (int i = 0; i < 16; i++)
+    {
+        assert(event_source_reserve(&s));
+    }
+    assert(batch_events(&s, 16) == 16);
+    for (int i = 0; i < 16; i++)
+    {
+        assert(event_source_reserve(&s));
+    }
+    assert(s.blocked == 0 && s.drops == 0 && ticks == 0);
+    // queue full, producer gives up
+    assert(!event_source_reserve(&s));
+    assert(s.blocked == 1 && s.drops == 1 && ticks >= EVENT_BLOCK_MAX_MS);
+    assert(batch_events(&s, 16) == 16);
+    assert(s.depth == 0);
+
+    // unlimited
+    event_source_init(&s, EVENT_POLICY_DROP_NEWEST, 0);
+    for (int i = 0; i < 100; i++)
+    {
+        assert(event_source_reserve(&s));
+    }
+    assert(batch_events(&s, 100) == 100);
+    assert(s.drops == 0);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,40 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef _COALESCE_H_
+#define _COALESCE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Packs several UI messages into one frame:
+ *
+ *   0x1e ("record separator") followed by "<byte length>:<message>" per message
+ *
+ * The frame stays valid UTF-8 if the messages are, so it can go out as
+ * websocket text frame. Single messages are sent as they are, see the
+ * decoder in spiffs_image/index.html.
+ */
+
+#define COALESCE_MARKER 0x1e
+
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    int num;
+} coalesce_t;
+
+// returns 0 if the buffer can't be allocated
+int coalesce_init(coalesce_t *c, const size_t size);
+void coalesce_free(coalesce_t *c);
+void coalesce_reset(coalesce_t *c);
+// returns 0 if the message does not fit
+int coalesce_add(coalesce_t *c, const uint8_t *msg, const size_t len);
+// decode: returns 1 and the next message, 0 at the end, -1 if the frame is broken. *pos starts at 0
+int coalesce_next(const uint8_t *frame, const size_t len, size_t *pos, const uint8_t **msg, size_t *msg_len);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef _DUK_ARENA_H_
+#define _DUK_ARENA_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Allocator for the Duktape heap. All memory comes from one fixed block
+ * that is reset in one go when the heap is destroyed. Small allocations
+ * are served from per size class free lists, larger ones from an address
+ * ordered free list that merges neighbors. Allocations that do not fit
+ * fall back to malloc. Not thread safe, one arena per Duktape heap.
+ */
+
+#define DUK_ARENA_CLASS_NUM 8
+// largest size class, bigger allocations use the large free list
+#define DUK_ARENA_SMALL_MAX 256
+
+struct duk_arena_block_t;
+
+typedef struct
+{
+    uint8_t *mem;
+    size_t size;
+    // bump pointer, everything above is unused
+    size_t top;
+    struct duk_arena_block_t *free_small[DUK_ARENA_CLASS_NUM];
+    struct duk_arena_block_t *free_large;
+
+    // stats
+    size_t live;
+    size_t peak;
+    unsigned int class_live[DUK_ARENA_CLASS_NUM];
+    unsigned int large_live;
+    unsigned int allocs;
+    // served by malloc
+    unsigned int fallbacks;
+    size_t fallback_live;
+    // malloc failed too
+    unsigned int failed;
+} duk_arena_t;
+
+typedef struct
+{
+    size_t size;
+    // highest address used since the last reset
+    size_t top;
+    // bytes allocated from the arena (including headers)
+    size_t live;
+    size_t peak;
+    unsigned int class_size[DUK_ARENA_CLASS_NUM];
+    unsigned int class_live[DUK_ARENA_CLASS_NUM];
+    unsigned int large_live;
+    unsigned int allocs;
+    unsigned int fallbacks;
+    size_t fallback_live;
+    unsigned int failed;
+} duk_arena_stats_t;
+
+void duk_arena_init(duk_arena_t *a, void *mem, const size_t size);
+// drop all allocations, keeps peak and counters
+void duk_arena_reset(duk_arena_t *a);
+void *duk_arena_alloc(duk_arena_t *a, const size_t size);
+void *duk_arena_realloc(duk_arena_t *a, void *ptr, const size_t size);
+void duk_arena_free(duk_arena_t *a, void *ptr);
+void duk_arena_get_stats(duk_arena_t *a, duk_arena_stats_t *stats);
+
+// duk_alloc_function compatible wrappers, udata is the arena
+void *duk_arena_alloc_func(void *udata, size_t size);
+void *duk_arena_realloc_func(void *udata, void *ptr, size_t size);
+void duk_arena_free_func(void *udata, void *ptr);
+
+#endif
@@ -18,4 +18,10 @@
     duk_push_int(ctx, NUM_VALUE);       \
     duk_put_prop_string(ctx, -2, NUM_NAME)
 
+// KEY_PTR is an interned string, see duk_util_intern_keys()
+#define ADD_KEY_NUMBER(KEY_PTR, NUM_VALUE) \
+    duk_push_heapptr(ctx, KEY_PTR);        \
+    duk_push_number(ctx, NUM_VALUE);       \
+    duk_put_prop(ctx, -3)
+
 #endif
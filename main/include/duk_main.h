@@ -9,6 +9,11 @@
 
 #include "freertos/FreeRTOS.h"
 
+#include <duktape.h>
+
+#include "duk_arena.h"
+#include "duk_util.h"
+
 typedef enum
 {
     LORA_MSG = 0,
@@ -21,6 +26,14 @@ typedef enum
     USB_DISCONNECTED,
     BATT_CHARGING,
     BATT_DRAINING,
+    // message from the worker (and to the worker, in the worker)
+    WORKER_MSG,
+    // outgoing UI message was sent / could not be sent
+    UI_SENT,
+    UI_SEND_FAILED,
+    // LoRa.sendPacket() packet was sent / timed out
+    LORA_TX_DONE,
+    LORA_TX_FAILED,
 } event_msg_type;
 
 typedef enum
@@ -29,14 +42,150 @@ typedef enum
     OUTGOING = 1,
 } event_direction_type;
 
+// event producers, each with its own queue limit
+typedef enum
+{
+    EVENT_SOURCE_LORA = 0,
+    // websocket
+    EVENT_SOURCE_UI,
+    EVENT_SOURCE_BLE,
+    EVENT_SOURCE_UDP,
+    EVENT_SOURCE_BUTTON,
+    EVENT_SOURCE_WORKER,
+    // outgoing UI messages waiting for the sender task
+    EVENT_SOURCE_SEND,
+    // connection status and events sent by the application
+    EVENT_SOURCE_LOCAL,
+    EVENT_SOURCE_NUM,
+} event_source_type;
+
+typedef struct
+{
+    // 0 = unlimited
+    int limit;
+    // events queued and not yet delivered or batched
+    int depth;
+    int high_water;
+    unsigned int drops;
+    // producer had to wait for the queue to drain
+    unsigned int blocked;
+} event_source_stats_t;
+
+typedef struct
+{
+    int active;
+    unsigned int fired;
+    unsigned int skipped;
+    unsigned int max_late;
+} duk_main_timer_stats_t;
+
+typedef struct
+{
+    // 0 = no limit
+    unsigned long int budget_ms;
+    unsigned int overruns;
+    // run time of the last and the longest handler call
+    unsigned long int last_us;
+    unsigned long int max_us;
+    // time left for the running handler
+    unsigned long int remaining_us;
+} duk_main_exec_budget_t;
+
+// dispatch statistics: one entry per event_msg_type, then these
+typedef enum
+{
+    DISPATCH_STAT_ON_EVENTS = LORA_TX_FAILED + 1,
+    // OnTimer() and setTimeout() / setInterval() callbacks
+    DISPATCH_STAT_ON_TIMER,
+    DISPATCH_STAT_NUM,
+} dispatch_stat_type;
+
+// bucket 0 counts 0us, bucket n counts [2^(n-1), 2^n) us, the last bucket everything above
+#define DISPATCH_HIST_BUCKETS 24
+
+typedef struct
+{
+    unsigned int count;
+    unsigned int max_us;
+    unsigned int buckets[DISPATCH_HIST_BUCKETS];
+} duk_main_hist_t;
+
+typedef struct
+{
+    // enqueue to dispatch (timers: expire to dispatch)
+    duk_main_hist_t wait;
+    // handler run time
+    duk_main_hist_t run;
+} duk_main_dispatch_stats_t;
+
+typedef struct
+{
+    // reachable values by type, see duk_util_heap_walk()
+    duk_util_heap_walk_t walk;
+    unsigned long int walk_us;
+    // esp_timer time of the walk
+    int64_t updated_us;
+    // all mark-and-sweep runs since the application was started
+    unsigned int gc_runs;
+    // runs Duktape started while JavaScript was running
+    unsigned int gc_inband;
+    // runs started by the runtime while idle and on request
+    unsigned int gc_idle;
+    unsigned int gc_forced;
+    // time spent in runs started by the runtime
+    unsigned long int gc_time_us;
+    unsigned long int gc_max_us;
+} duk_main_heap_stats_t;
+
+typedef struct
+{
+    // UI messages sent and failed
+    unsigned int sent;
+    unsigned int failed;
+    // websocket frames / BLE records, less than messages with coalescing
+    unsigned int frames;
+} duk_main_send_stats_t;
+
 typedef int ui_msg_send_func(const uint8_t *buffer, const size_t len);
 
 int duk_main_add_full_event(event_msg_type msg_type, const event_direction_type direction, uint8_t *payload, const size_t len, const int rssi, const int snr, const time_t ts);
+int duk_main_add_source_event(const event_source_type source, event_msg_type msg_type, const event_direction_type direction, uint8_t *payload, const size_t len, const int rssi, const int snr, const time_t ts);
 int duk_main_add_event(event_msg_type msg_type, event_direction_type direction, uint8_t *payload, size_t len);
+// report the result of a queued request (LORA_TX_DONE: value = on air time in us, LORA_TX_FAILED: value = error)
+int duk_main_add_result_event(event_msg_type msg_type, const uint32_t id, const int value);
+// queue UI message for the sender task, takes ownership of payload, returns message id (0 = dropped)
+unsigned long int duk_main_send(uint8_t *payload, const size_t len);
+// report sent messages as UI_SENT events, failures are always reported
+void duk_main_set_send_reports(const int enable);
+// pack UI messages queued within windowMS into frames of up to maxBytes, 0 = off
+int duk_main_set_send_coalescing(const unsigned long int windowMS, const size_t maxBytes);
+void duk_main_get_send_stats(duk_main_send_stats_t *stats);
 void duk_main_start();
 void duk_main_set_send_func(ui_msg_send_func *func);
 void duk_main_set_reset(int rst);
 int duk_main_set_wake_up_time(unsigned long int wake_up_timeMS);
 void duk_main_set_load_file(char *fname);
+int duk_main_set_batching(const int max_events, const unsigned long int max_latency_MS);
+int duk_main_set_event_limit(const event_source_type source, const int limit);
+void duk_main_get_event_stats(const event_source_type source, event_source_stats_t *stats);
+int duk_main_get_event_queue_len();
+// func_idx is the callback on the value stack of ctx, returns timer id (0 = failed)
+unsigned long int duk_main_timer_add(duk_context *ctx, const int func_idx, const unsigned long int delayMS, const int periodic);
+int duk_main_timer_cancel(duk_context *ctx, const unsigned long int id);
+void duk_main_get_timer_stats(duk_main_timer_stats_t *stats);
+int duk_main_set_exec_budget(const unsigned long int budgetMS);
+void duk_main_get_exec_budget(duk_main_exec_budget_t *stats);
+void duk_main_get_dispatch_stats(const int stat, duk_main_dispatch_stats_t *stats);
+void duk_main_reset_dispatch_stats();
+unsigned long int duk_main_hist_percentile(const duk_main_hist_t *hist, const int percent);
+void duk_main_get_arena_stats(duk_arena_stats_t *stats);
+// walk the heap (optionally after a full collection), call from the duktape task only
+void duk_main_update_heap_stats(duk_context *ctx, const int collect);
+// copy of the last update
+void duk_main_get_heap_stats(duk_main_heap_stats_t *stats);
+// collect garbage if the task will be idle for at least idleMS and minAllocs allocations happened since the last run, 0 = off
+int duk_main_set_idle_gc(const unsigned long int idleMS, const unsigned int minAllocs);
+// time the last reset took until OnStart() returned
+unsigned long int duk_main_get_start_time();
 
 #endif
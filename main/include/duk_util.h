@@ -7,11 +7,67 @@
 
 #include <duktape.h>
 
+typedef enum
+{
+    DUK_UTIL_ON_START = 0,
+    DUK_UTIL_ON_EVENT,
+    DUK_UTIL_ON_EVENTS,
+    DUK_UTIL_ON_TIMER,
+    DUK_UTIL_HANDLER_NUM,
+} duk_util_handler_type;
+
+typedef struct
+{
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int writes;
+} duk_util_cache_stats_t;
+
+typedef struct
+{
+    // modules evaluated
+    unsigned int loads;
+    // require() calls served from the module cache
+    unsigned int hits;
+} duk_util_module_stats_t;
+
+typedef enum
+{
+    DUK_UTIL_HEAP_OBJECT = 0,
+    DUK_UTIL_HEAP_ARRAY,
+    DUK_UTIL_HEAP_FUNCTION,
+    DUK_UTIL_HEAP_STRING,
+    DUK_UTIL_HEAP_BUFFER,
+    DUK_UTIL_HEAP_TYPE_NUM,
+} duk_util_heap_type;
+
+typedef struct
+{
+    unsigned int count[DUK_UTIL_HEAP_TYPE_NUM];
+    size_t bytes[DUK_UTIL_HEAP_TYPE_NUM];
+} duk_util_heap_walk_t;
+
 void duk_util_register(duk_context *ctx);
 
+// returns handle for duk_util_push_handler(), valid for the life of the heap
+void *duk_util_handlers_install(duk_context *ctx);
+// push handler function, returns 0 if the handler is not a function
+int duk_util_push_handler(duk_context *ctx, void *handlers, const duk_util_handler_type handler);
+int duk_util_call_handler(duk_context *ctx, void *handlers, const duk_util_handler_type handler);
+// intern property names once, keys[] are heap pointers for duk_push_heapptr()
+void duk_util_intern_keys(duk_context *ctx, const char *stash_key, const char **names, void **keys, const int num);
+
 int duk_util_run(duk_context *ctx, const char *func_str);
 int duk_util_call_with_buf(duk_context *ctx, const char *func_name, const uint8_t *inbuf, const size_t len);
 int duk_util_load_and_run(duk_context *ctx, const char *fname, const char *func_call);
 char *duk_util_load_file(const char *fname);
+// keep compiled bytecode next to loaded files (off by default)
+void duk_util_set_bytecode_cache(const int enable);
+void duk_util_get_cache_stats(duk_util_cache_stats_t *stats);
+void duk_util_get_module_stats(duk_util_module_stats_t *stats);
+// count values reachable from the global object and the stashes, skip() filters out e.g. ROM objects
+int duk_util_heap_walk(duk_context *ctx, duk_util_heap_walk_t *walk, int (*skip)(const void *ptr));
+// e.g. "Objects", used as property name / in the heap report
+const char *duk_util_heap_type_name(const duk_util_heap_type type);
 
 #endif
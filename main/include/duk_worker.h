@@ -0,0 +1,27 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef __duk_worker_h__
+#define __duk_worker_h__
+
+#include <duktape.h>
+
+typedef struct
+{
+    int running;
+    // messages main -> worker and worker -> main
+    unsigned int sent;
+    unsigned int received;
+    // messages the worker did not get (stopped or out of memory)
+    unsigned int dropped;
+} duk_worker_stats_t;
+
+void duk_worker_init();
+// Worker API for the main heap
+void duk_worker_register(duk_context *ctx);
+// stop the worker and wait for it to exit, returns 0 if it did not exit in time
+int duk_worker_stop();
+void duk_worker_get_stats(duk_worker_stats_t *stats);
+
+#endif
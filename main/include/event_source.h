@@ -0,0 +1,56 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef _EVENT_SOURCE_H_
+#define _EVENT_SOURCE_H_
+
+#ifndef EVENT_SOURCE_TEST
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#else
+typedef void *SemaphoreHandle_t;
+#endif
+
+/*
+ * Queue credits of an event producer. A producer takes a credit before it
+ * queues an event, duktape_task gives it back once the event left the event
+ * queue: after it was delivered or when it is moved into the batch. Batched
+ * events are bounded by the batch size and don't count towards the limit.
+ */
+
+typedef enum
+{
+    // no limit
+    EVENT_POLICY_NONE = 0,
+    // producer waits for the queue to drain (EVENT_BLOCK_MAX_MS)
+    EVENT_POLICY_BLOCK,
+    EVENT_POLICY_DROP_NEWEST,
+    // consumer drops the oldest events that are over the limit
+    EVENT_POLICY_DROP_OLDEST,
+} event_policy_type;
+
+typedef struct
+{
+    event_policy_type policy;
+    int default_limit;
+    int limit;
+    int depth;
+    int high_water;
+    unsigned int drops;
+    unsigned int blocked;
+    SemaphoreHandle_t space;
+} event_source_t;
+
+// blocked producers give up and drop after this
+#define EVENT_BLOCK_MAX_MS 2000
+#define EVENT_BLOCK_SLICE_MS 20
+
+void event_source_init(event_source_t *s, const event_policy_type policy, const int limit);
+// take a queue credit, returns 0 if the event has to be dropped
+int event_source_reserve(event_source_t *s);
+void event_source_release(event_source_t *s);
+// consumer side of EVENT_POLICY_DROP_OLDEST, returns 1 if the event has to be dropped
+int event_source_overrun(event_source_t *s);
+
+#endif
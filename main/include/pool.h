@@ -0,0 +1,46 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdio.h>
+
+typedef enum
+{
+    POOL_EVENT = 0,
+    POOL_FRAME,
+    POOL_LARGE,
+    POOL_CLASS_NUM,
+} pool_class_t;
+
+// event_msg_t
+#define POOL_EVENT_SIZE 64
+#define POOL_EVENT_NUM 64
+// LoRa frames and small UI messages
+#define POOL_FRAME_SIZE 256
+#define POOL_FRAME_NUM 32
+// UDP and websocket frames
+#define POOL_LARGE_SIZE 2048
+#define POOL_LARGE_NUM 4
+
+typedef struct
+{
+    size_t size;
+    int num;
+    int used;
+    int high_water;
+    // class was exhausted
+    unsigned int failed;
+} pool_stats_t;
+
+void pool_init();
+// allocation that does not fit a pool class falls back to malloc
+void *pool_alloc(const size_t size);
+// accepts pool and malloc'ed memory
+void pool_free(void *ptr);
+void pool_get_stats(const pool_class_t cls, pool_stats_t *stats);
+unsigned int pool_get_heap_fallbacks();
+
+#endif
@@ -5,159 +5,193 @@
 #ifndef _QUEUE_H_
 #define _QUEUE_H_
 
+/*
+ * Intrusive multi-producer / single-consumer work queue.
+ *
+ * Nodes need a 'next' pointer as their first member.
+ * Producers push onto 'in' with a single CAS (lock-free, O(1)).
+ * The consumer moves everything from 'in' to its private FIFO
+ * (head/tail) with a single atomic exchange, so GET and TAKE_HEAD never
+ * wait on producers. Only one task may call GET, TAKE_HEAD and INSERT_HEAD.
+ */
+
+typedef struct
+{
+  // producer side, newest first
+  void *in;
+  // consumer side, oldest first
+  void *head;
+  void *tail;
+  // number of nodes on the consumer side
+  int out_len;
+  // number of nodes queued (producer + consumer side)
+  int len;
+} work_list_t;
+
 typedef struct
 {
-  void *send_queue;
-  void *recv_queue;
-  SemaphoreHandle_t send_queue_mutex;
-  SemaphoreHandle_t recv_queue_mutex;
+  work_list_t send_queue;
+  work_list_t recv_queue;
 } work_queue_t;
 
-#define WORK_QUEUE_INIT(q)                         \
-  do                                               \
-  {                                                \
-    q->send_queue = NULL;                          \
-    q->recv_queue = NULL;                          \
-    q->send_queue_mutex = xSemaphoreCreateMutex(); \
-    q->recv_queue_mutex = xSemaphoreCreateMutex(); \
+#define WORK_LIST_INIT(l) \
+  do                      \
+  {                       \
+    (l)->in = NULL;       \
+    (l)->head = NULL;     \
+    (l)->tail = NULL;     \
+    (l)->out_len = 0;     \
+    (l)->len = 0;         \
+  } while (0)
+
+#define WORK_QUEUE_INIT(q)            \
+  do                                  \
+  {                                   \
+    WORK_LIST_INIT(&q->send_queue);   \
+    WORK_LIST_INIT(&q->recv_queue);   \
   } while (0)
 
-#define QUEUE_DL_APPEND(head, entry) \
-  do                                 \
-  {                                  \
-    if (head)                        \
-    {                                \
-      typeof(entry) _tmp = head;     \
-      while (_tmp->next != NULL)     \
-      {                              \
-        _tmp = _tmp->next;           \
-      }                              \
-      entry->prev = _tmp;            \
-      _tmp->next = entry;            \
-    }                                \
-    else                             \
-    {                                \
-      head = (typeof(head))entry;    \
-    }                                \
+// producer: push node (lock-free)
+// len is counted before the node is published, the consumer can't take it first
+#define WORK_LIST_PUSH(l, node)                                                \
+  do                                                                           \
+  {                                                                            \
+    __atomic_add_fetch(&(l)->len, 1, __ATOMIC_RELAXED);                        \
+    void *_old = __atomic_load_n(&(l)->in, __ATOMIC_RELAXED);                  \
+    do                                                                         \
+    {                                                                          \
+      (node)->next = _old;                                                     \
+    } while (!__atomic_compare_exchange_n(&(l)->in, &_old, (void *)(node), 1,  \
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED)); \
   } while (0)
 
+// consumer: move all pushed nodes to the consumer side (wait-free)
+#define WORK_LIST_COLLECT(l, type)                                     \
+  do                                                                   \
+  {                                                                    \
+    type _c_n = __atomic_exchange_n(&(l)->in, NULL, __ATOMIC_ACQUIRE); \
+    type _c_newest = _c_n;                                             \
+    type _c_rev = NULL;                                                \
+    while (_c_n != NULL)                                               \
+    {                                                                  \
+      type _c_next = _c_n->next;                                       \
+      _c_n->next = _c_rev;                                             \
+      _c_rev = _c_n;                                                   \
+      _c_n = _c_next;                                                  \
+      (l)->out_len++;                                                  \
+    }                                                                  \
+    if (_c_rev != NULL)                                                \
+    {                                                                  \
+      if ((l)->head == NULL)                                           \
+      {                                                                \
+        (l)->head = _c_rev;                                            \
+      }                                                                \
+      else                                                             \
+      {                                                                \
+        ((type)(l)->tail)->next = _c_rev;                              \
+      }                                                                \
+      (l)->tail = _c_newest;                                           \
+    }                                                                  \
+  } while (0)
+
+// consumer: get first node
+#define WORK_LIST_GET(l, item)                                \
+  do                                                          \
+  {                                                           \
+    if ((l)->head == NULL)                                    \
+    {                                                         \
+      WORK_LIST_COLLECT(l, typeof(item));                     \
+    }                                                         \
+    item = (typeof(item))(l)->head;                           \
+    if (item != NULL)                                         \
+    {                                                         \
+      (l)->head = item->next;                                 \
+      if ((l)->head == NULL)                                  \
+      {                                                       \
+        (l)->tail = NULL;                                     \
+      }                                                       \
+      item->next = NULL;                                      \
+      (l)->out_len--;                                         \
+      __atomic_sub_fetch(&(l)->len, 1, __ATOMIC_RELAXED);     \
+    }                                                         \
+  } while (0)
+
+// consumer: take all nodes as a NULL terminated list (empties queue)
+#define WORK_LIST_TAKE_HEAD(l, h)                                    \
+  do                                                                 \
+  {                                                                  \
+    WORK_LIST_COLLECT(l, typeof(h));                                 \
+    h = (typeof(h))(l)->head;                                        \
+    __atomic_sub_fetch(&(l)->len, (l)->out_len, __ATOMIC_RELAXED);   \
+    (l)->head = NULL;                                                \
+    (l)->tail = NULL;                                                \
+    (l)->out_len = 0;                                                \
+  } while (0)
+
+// consumer: add node (or list of nodes) as new head
+#define WORK_LIST_INSERT_HEAD(l, node)                      \
+  do                                                        \
+  {                                                         \
+    typeof(node) _i_last = node;                            \
+    int _i_num = 1;                                         \
+    while (_i_last->next != NULL)                           \
+    {                                                       \
+      _i_last = _i_last->next;                              \
+      _i_num++;                                             \
+    }                                                       \
+    _i_last->next = (l)->head;                              \
+    if ((l)->head == NULL)                                  \
+    {                                                       \
+      (l)->tail = _i_last;                                  \
+    }                                                       \
+    (l)->head = node;                                       \
+    (l)->out_len += _i_num;                                 \
+    __atomic_add_fetch(&(l)->len, _i_num, __ATOMIC_RELAXED); \
+  } while (0)
+
+// number of queued nodes, safe to call from any task
+#define WORK_LIST_LEN(l) __atomic_load_n(&(l)->len, __ATOMIC_RELAXED)
+
 // -- RECV --
 
-// get length of queue - do we need to add locking?
+// get length of queue (entry is unused, kept for compatibility)
 #define WORK_QUEUE_RECV_LEN(q, q_length, entry) \
   do                                            \
   {                                             \
-    q_length = 0;                               \
-    typeof(entry) _q_l_head = q->recv_queue;    \
-    while (_q_l_head != NULL)                   \
-    {                                           \
-      q_length++;                               \
-      _q_l_head = _q_l_head->next;              \
-    }                                           \
+    q_length = WORK_LIST_LEN(&q->recv_queue);   \
   } while (0)
 
 // append item at end
-#define WORK_QUEUE_RECV_ADD(q, node)                    \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->recv_queue_mutex, portMAX_DELAY); \
-    QUEUE_DL_APPEND(q->recv_queue, node);               \
-    xSemaphoreGive(q->recv_queue_mutex);                \
-  } while (0)
+#define WORK_QUEUE_RECV_ADD(q, node) WORK_LIST_PUSH(&q->recv_queue, node)
 
 // add item as new head
-#define WORK_QUEUE_RECV_INSERT_HEAD(q, node)            \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->recv_queue_mutex, portMAX_DELAY); \
-    typeof(node) __head = q->recv_queue;                \
-    q->recv_queue = node;                               \
-    if (__head)                                         \
-      QUEUE_DL_APPEND(q->recv_queue, __head);           \
-    xSemaphoreGive(q->recv_queue_mutex);                \
-  } while (0)
+#define WORK_QUEUE_RECV_INSERT_HEAD(q, node) WORK_LIST_INSERT_HEAD(&q->recv_queue, node)
 
 // get first item
-#define WORK_QUEUE_RECV_GET(q, item)                    \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->recv_queue_mutex, portMAX_DELAY); \
-    item = (typeof(item))q->recv_queue;                 \
-    if (item != NULL)                                   \
-    {                                                   \
-      if (item->next == NULL)                           \
-      {                                                 \
-        q->recv_queue = NULL;                           \
-      }                                                 \
-      else                                              \
-      {                                                 \
-        q->recv_queue = (void *)item->next;             \
-      }                                                 \
-    }                                                   \
-    xSemaphoreGive(q->recv_queue_mutex);                \
-  } while (0)
+#define WORK_QUEUE_RECV_GET(q, item) WORK_LIST_GET(&q->recv_queue, item)
 
 // take head and all attached nodes (emptys queue)
-#define WORK_QUEUE_RECV_TAKE_HEAD(q, head)              \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->recv_queue_mutex, portMAX_DELAY); \
-    head = q->recv_queue;                               \
-    q->recv_queue = NULL;                               \
-    xSemaphoreGive(q->recv_queue_mutex);                \
-  } while (0)
+#define WORK_QUEUE_RECV_TAKE_HEAD(q, head) WORK_LIST_TAKE_HEAD(&q->recv_queue, head)
 
 // -- SEND --
 
-// append item at end
-#define WORK_QUEUE_SEND_ADD(q, node)                    \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->send_queue_mutex, portMAX_DELAY); \
-    QUEUE_DL_APPEND(q->send_queue, node);               \
-    xSemaphoreGive(q->send_queue_mutex);                \
+// get length of queue (entry is unused, kept for compatibility)
+#define WORK_QUEUE_SEND_LEN(q, q_length, entry) \
+  do                                            \
+  {                                             \
+    q_length = WORK_LIST_LEN(&q->send_queue);   \
   } while (0)
 
+// append item at end
+#define WORK_QUEUE_SEND_ADD(q, node) WORK_LIST_PUSH(&q->send_queue, node)
+
 // add item as new head
-#define WORK_QUEUE_SEND_INSERT_HEAD(q, node)            \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->send_queue_mutex, portMAX_DELAY); \
-    typeof(node) __head = q->send_queue;                \
-    q->send_queue = node;                               \
-    if (__head)                                         \
-      QUEUE_DL_APPEND(q->send_queue, __head);           \
-    xSemaphoreGive(q->send_queue_mutex);                \
-  } while (0)
+#define WORK_QUEUE_SEND_INSERT_HEAD(q, node) WORK_LIST_INSERT_HEAD(&q->send_queue, node)
 
 // get first item
-#define WORK_QUEUE_SEND_GET(q, item)                    \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->send_queue_mutex, portMAX_DELAY); \
-    item = (typeof(item))q->send_queue;                 \
-    if (item != NULL)                                   \
-    {                                                   \
-      if (item->next == NULL)                           \
-      {                                                 \
-        q->send_queue = NULL;                           \
-      }                                                 \
-      else                                              \
-      {                                                 \
-        q->send_queue = (void *)item->next;             \
-      }                                                 \
-    }                                                   \
-    xSemaphoreGive(q->send_queue_mutex);                \
-  } while (0)
+#define WORK_QUEUE_SEND_GET(q, item) WORK_LIST_GET(&q->send_queue, item)
 
 // take head and all attached nodes (emptys queue)
-#define WORK_QUEUE_SEND_TAKE_HEAD(q, head)              \
-  do                                                    \
-  {                                                     \
-    xSemaphoreTake(q->send_queue_mutex, portMAX_DELAY); \
-    head = q->send_queue;                               \
-    q->send_queue = NULL;                               \
-    xSemaphoreGive(q->send_queue_mutex);                \
-  } while (0)
+#define WORK_QUEUE_SEND_TAKE_HEAD(q, head) WORK_LIST_TAKE_HEAD(&q->send_queue, head)
 
 #endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef _RX_FILTER_H_
+#define _RX_FILTER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Receive filter for LoRa frames, evaluated by the LoRa RX task before a
+ * frame is queued for the application. All configured predicates have to
+ * match. MType and DevAddr look at the LoRaWAN MAC header: MType is the
+ * upper 3 bits of the first byte, DevAddr (little endian, bytes 1-4) is
+ * only checked for data frames (MType 2 - 5).
+ */
+
+typedef enum
+{
+    RX_FILTER_RSSI = 0,
+    RX_FILTER_SNR,
+    RX_FILTER_LENGTH,
+    RX_FILTER_MTYPE,
+    RX_FILTER_DEVADDR,
+    RX_FILTER_NUM,
+} rx_filter_type;
+
+typedef struct
+{
+    // RX_FILTER_* bit set for every configured predicate
+    unsigned int active;
+    int min_rssi;
+    int min_snr;
+    size_t min_len;
+    size_t max_len;
+    // bit n = MType n is accepted
+    uint8_t mtypes;
+    // DevAddr allow list, open addressing, slots is a power of 2
+    uint32_t *addrs;
+    uint8_t *used;
+    size_t slots;
+    size_t num;
+    // frames passed / rejected by each predicate
+    unsigned int passed;
+    unsigned int hits[RX_FILTER_NUM];
+} rx_filter_t;
+
+#define RX_FILTER_ACTIVE(f, type) (((f)->active & (1 << (type))) != 0)
+
+void rx_filter_init(rx_filter_t *f);
+void rx_filter_free(rx_filter_t *f);
+void rx_filter_set_rssi(rx_filter_t *f, const int min_rssi);
+void rx_filter_set_snr(rx_filter_t *f, const int min_snr);
+void rx_filter_set_length(rx_filter_t *f, const size_t min_len, const size_t max_len);
+// mtypes: bit mask, bit n = MType n
+void rx_filter_set_mtypes(rx_filter_t *f, const uint8_t mtypes);
+// allocate the allow list for num addresses, returns 0 if out of memory
+int rx_filter_devaddr_init(rx_filter_t *f, const size_t num);
+int rx_filter_devaddr_add(rx_filter_t *f, const uint32_t addr);
+int rx_filter_devaddr_contains(const rx_filter_t *f, const uint32_t addr);
+// returns 1 if the frame passes, updates the counters
+int rx_filter_check(rx_filter_t *f, const uint8_t *frame, const size_t len, const int rssi, const int snr);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef _TIMER_HEAP_H_
+#define _TIMER_HEAP_H_
+
+#include <stdint.h>
+
+/*
+ * Binary min-heap of timers ordered by expire time (milliseconds).
+ * Timers live in slots that are reused, the id encodes the slot so
+ * cancel is O(log n) without a search. Not thread safe.
+ */
+
+#define TIMER_HEAP_MAX_SLOTS 0x10000
+#define TIMER_HEAP_SLOT(id) ((id)&0xffff)
+
+typedef struct
+{
+    // 0 = free slot
+    uint32_t id;
+    uint64_t expire;
+    // 0 = one shot
+    uint32_t interval;
+    // index in heap, next free slot if unused
+    int pos;
+} timer_heap_timer_t;
+
+typedef struct
+{
+    timer_heap_timer_t *timers;
+    // slot numbers, heap[0] expires first
+    int *heap;
+    int num;
+    int size;
+    int free_slot;
+    uint16_t serial;
+
+    // stats
+    unsigned int fired;
+    // periods skipped because the timer was serviced too late
+    unsigned int skipped;
+    unsigned int max_late;
+    // of the timer last returned by timer_heap_expired()
+    unsigned int last_late;
+} timer_heap_t;
+
+void timer_heap_init(timer_heap_t *th);
+void timer_heap_free(timer_heap_t *th);
+// remove all timers, keeps stats
+void timer_heap_clear(timer_heap_t *th);
+// returns timer id, 0 on failure
+uint32_t timer_heap_add(timer_heap_t *th, const uint64_t now, const uint32_t delay, const uint32_t interval);
+int timer_heap_cancel(timer_heap_t *th, const uint32_t id);
+// milliseconds until the next timer expires, -1 if there is no timer
+int64_t timer_heap_next(timer_heap_t *th, const uint64_t now);
+// remove the first expired timer (interval timers are re-armed), returns id or 0
+uint32_t timer_heap_expired(timer_heap_t *th, const uint64_t now, int *periodic);
+
+#endif
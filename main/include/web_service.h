@@ -20,4 +20,9 @@ typedef int webserver_control_function_t(int, char*, size_t);
 
 void webserver_set_control_func(webserver_control_function_t *func);
 
+// fill buf with JSON, returns length or -1
+typedef int webserver_stats_function_t(char *, size_t);
+
+void webserver_set_stats_func(webserver_stats_function_t *func);
+
 #endif
@@ -13,6 +13,8 @@
 #include "soc/sens_periph.h"
 #include "soc/rtc.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include <time.h>
 
 #include "lora.h"
@@ -24,6 +26,9 @@
 #include "duk_helpers.h"
 #include "duk_main.h"
 #include "board.h"
+#include "pool.h"
+#include "queue.h"
+#include "rx_filter.h"
 
 //#define LORA_MAIN_DEBUG 1
 
@@ -42,12 +47,33 @@ The library has been tested on [RFM95](https://www.hoperf.com/modules/lora/RFM95
 }
 */
 
-static double *fqtable = NULL;
+// hopping channels as precomputed frequency registers
+static struct lora_frf_t *fqtable = NULL;
 static unsigned int fqtable_entries = 0;
 
-#define ISR_TASK_READ_PACKET 1
-#define ISR_TASK_STOP 2
-#define ISR_TASK_FHSS 3
+// isr_recv_task() notification bits
+#define ISR_TASK_READ_PACKET 0x01
+#define ISR_TASK_STOP 0x02
+#define ISR_TASK_FHSS 0x04
+#define ISR_TASK_TX 0x08
+
+// frame buffers ready for the next packets
+#define RX_RING_SIZE 4
+// DevAddr allow list limit for LoRa.setRxFilter()
+#define RX_FILTER_DEVADDR_MAX 1024
+
+// isr_recv_task() also runs the TX / CAD path (register writes, events)
+#define ISR_TASK_STACK 4096
+
+// packets queued by LoRa.sendPacket()
+#define TX_QUEUE_MAX 8
+// TX done has to arrive within twice the time on air plus this
+#define TX_TIMEOUT_EXTRA_MS 1000
+// CAD done has to arrive within this
+#define TX_CAD_TIMEOUT_MS 1000
+// lora_tx_failed errors
+#define TX_ERROR_TIMEOUT -1
+#define TX_ERROR_CHANNEL_BUSY -2
 
 enum LoRaMode_T
 {
@@ -56,14 +82,80 @@ enum LoRaMode_T
     LORA_RECV
 };
 
+// packet in tx_current: listen before talk or on air
+enum LoRaTxState_T
+{
+    TX_CAD = 0,
+    TX_BACKOFF,
+    TX_ON_AIR
+};
+
+typedef struct lora_tx_t
+{
+    struct lora_tx_t *next;
+    uint32_t id;
+    size_t len;
+    uint8_t data[];
+} lora_tx_t;
+
 static enum LoRaMode_T lora_mode;
-static xQueueHandle isr_recv_queue = NULL;
+static TaskHandle_t isr_task_handle = NULL;
 
-static void IRAM_ATTR gpio_isr_handler(void *arg)
+// pool buffers the FIFO is read into, handed to the event queue and refilled afterwards
+static struct
+{
+    uint8_t *slot[RX_RING_SIZE];
+    int head;
+    int num;
+} rx_ring;
+
+// set by the application, evaluated in isr_recv_task()
+static rx_filter_t *rx_filter;
+static SemaphoreHandle_t rx_filter_lock;
+
+static struct
+{
+    // interrupt arrived before the previous one was handled
+    volatile unsigned int overruns;
+    // packet dropped, no frame buffer
+    unsigned int ring_full;
+} rx_stats;
+
+// TX queue, filled by the JavaScript task, sent by isr_recv_task()
+static work_list_t tx_queue;
+static uint32_t tx_id;
+// queued and on air
+static int tx_pending;
+// only used by isr_recv_task()
+static lora_tx_t *tx_current;
+static enum LoRaTxState_T tx_state;
+// CADs that found the channel busy for tx_current
+static int tx_attempt;
+static int64_t tx_start_us;
+static TickType_t tx_deadline;
+// time of the last DIO0 interrupt
+static volatile int64_t dio0_us;
+// time of the last FHSS (DIO2) interrupt
+static volatile int64_t fhss_us;
+
+// channel change interrupt to new frequency written
+static struct
+{
+    unsigned int hops;
+    unsigned long last_us;
+    unsigned long max_us;
+    uint64_t total_us;
+} fhss_stats;
+
+static void IRAM_ATTR isr_notify(const uint32_t bit)
 {
-    uint32_t cmd = ISR_TASK_READ_PACKET;
-    BaseType_t task_woken;
-    xQueueSendFromISR(isr_recv_queue, &cmd, &task_woken);
+    uint32_t prev = 0;
+    BaseType_t task_woken = pdFALSE;
+    xTaskNotifyAndQueryFromISR(isr_task_handle, bit, eSetBits, &prev, &task_woken);
+    if (prev & bit)
+    {
+        rx_stats.overruns++;
+    }
     if (task_woken)
     {
         // important: this will make isr_recv_task() active
@@ -71,54 +163,319 @@ static void IRAM_ATTR gpio_isr_handler(void *arg)
     }
 }
 
+static void IRAM_ATTR gpio_isr_handler(void *arg)
+{
+    dio0_us = esp_timer_get_time();
+    isr_notify(ISR_TASK_READ_PACKET);
+}
+
 static void IRAM_ATTR gpio_fhss_isr_handler(void *arg)
 {
-    uint32_t cmd = ISR_TASK_FHSS;
-    BaseType_t task_woken;
-    xQueueSendFromISR(isr_recv_queue, &cmd, &task_woken);
-    if (task_woken)
+    fhss_us = esp_timer_get_time();
+    isr_notify(ISR_TASK_FHSS);
+}
+
+void lm_stop_isr_task()
+{
+    xTaskNotify(isr_task_handle, ISR_TASK_STOP, eSetBits);
+}
+
+static void rx_ring_fill()
+{
+    while (rx_ring.num < RX_RING_SIZE)
     {
-        // important: this will make isr_recv_task() active
-        portYIELD_FROM_ISR();
+        uint8_t *buf = pool_alloc(LORA_MSG_MAX_SIZE + 1);
+        if (buf == NULL)
+        {
+            return;
+        }
+        rx_ring.slot[(rx_ring.head + rx_ring.num) % RX_RING_SIZE] = buf;
+        rx_ring.num++;
     }
 }
 
-void lm_stop_isr_task()
+static uint8_t *rx_ring_get()
+{
+    if (rx_ring.num == 0)
+    {
+        return NULL;
+    }
+    uint8_t *buf = rx_ring.slot[rx_ring.head];
+    rx_ring.slot[rx_ring.head] = NULL;
+    rx_ring.head = (rx_ring.head + 1) % RX_RING_SIZE;
+    rx_ring.num--;
+    return buf;
+}
+
+// buffer was not used, back to the front
+static void rx_ring_put(uint8_t *buf)
 {
-    uint32_t cmd = ISR_TASK_STOP;
-    xQueueSend(isr_recv_queue, &cmd, portMAX_DELAY);
+    rx_ring.head = (rx_ring.head + RX_RING_SIZE - 1) % RX_RING_SIZE;
+    rx_ring.slot[rx_ring.head] = buf;
+    rx_ring.num++;
+}
+
+// frame is kept if no filter is set
+static int rx_filter_pass(const uint8_t *buf, const size_t len, const int rssi, const int snr)
+{
+    int pass = 1;
+    xSemaphoreTake(rx_filter_lock, portMAX_DELAY);
+    if (rx_filter != NULL)
+    {
+        pass = rx_filter_check(rx_filter, buf, len, rssi, snr);
+    }
+    xSemaphoreGive(rx_filter_lock);
+    return pass;
+}
+
+// install a new filter (NULL = none), frees the old one
+static void rx_filter_replace(rx_filter_t *f)
+{
+    xSemaphoreTake(rx_filter_lock, portMAX_DELAY);
+    rx_filter_t *old = rx_filter;
+    rx_filter = f;
+    xSemaphoreGive(rx_filter_lock);
+    if (old != NULL)
+    {
+        rx_filter_free(old);
+        free(old);
+    }
+}
+
+static void rx_read()
+{
+    uint8_t *buf = rx_ring_get();
+    if (buf == NULL)
+    {
+        // the application holds on to all frame buffers, drop the packet
+        if (lora_received())
+        {
+            rx_stats.ring_full++;
+        }
+        lora_receive_packet(NULL, 0);
+        lora_receive();
+        rx_ring_fill();
+        return;
+    }
+
+    int bytes_recv = lora_receive_packet(buf, LORA_MSG_MAX_SIZE + 1);
+    int rssi = lora_packet_rssi();
+    int snr = lora_packet_snr();
+    lora_receive();
+#ifdef LORA_MAIN_DEBUG
+    logprintf("LoRa received: %d bytes\n", bytes_recv);
+#endif
+    if (bytes_recv > 0 && rx_filter_pass(buf, bytes_recv, rssi, snr))
+    {
+        duk_main_add_full_event(LORA_MSG, INCOMING, buf, bytes_recv, rssi, snr, time(NULL));
+        rx_ring_fill();
+    }
+    else
+    {
+        // nothing received or filtered, the JavaScript task is not woken up
+        rx_ring_put(buf);
+    }
+}
+
+// mode and configuration changes are refused until all queued packets are sent
+static int tx_busy()
+{
+    return __atomic_load_n(&tx_pending, __ATOMIC_ACQUIRE) > 0;
+}
+
+// go back to the mode set by the application
+static void tx_resume_mode()
+{
+    if (lora_mode == LORA_RECV)
+    {
+        lora_receive();
+    }
+    else
+    {
+        lora_enable_irq_recv(LORA_IRQ_DISABLE);
+        if (lora_mode == LORA_SLEEP)
+        {
+            lora_sleep();
+        }
+    }
+}
+
+static void tx_send()
+{
+    // DIO0 signals TX done
+    lora_enable_irq_recv(LORA_IRQ_ENABLE);
+    unsigned long airtime_ms = lora_time_on_air_us(tx_current->len) / 1000;
+    lora_send_packet_start(tx_current->data, tx_current->len);
+    tx_state = TX_ON_AIR;
+    tx_start_us = esp_timer_get_time();
+    tx_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(2 * airtime_ms + TX_TIMEOUT_EXTRA_MS);
+}
+
+// send tx_current, check the channel first if listen before talk is enabled
+static void tx_start()
+{
+    if (!lora_lbt_enabled())
+    {
+        tx_send();
+        return;
+    }
+    // DIO0 signals CAD done
+    lora_enable_irq_recv(LORA_IRQ_ENABLE);
+    lora_cad_start();
+    tx_state = TX_CAD;
+    tx_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(TX_CAD_TIMEOUT_MS);
+}
+
+// start the next queued packet or go back to the mode set by the application
+static void tx_next()
+{
+    WORK_LIST_GET(&tx_queue, tx_current);
+    if (tx_current == NULL)
+    {
+        tx_resume_mode();
+        return;
+    }
+    tx_attempt = 0;
+    tx_start();
+}
+
+// drop tx_current, start the next one
+static void tx_release()
+{
+    pool_free(tx_current);
+    tx_current = NULL;
+    tx_next();
+    __atomic_sub_fetch(&tx_pending, 1, __ATOMIC_RELEASE);
+}
+
+// report the packet on air, start the next one
+static void tx_finish(const int sent)
+{
+    if (sent)
+    {
+        // TX done found by polling if the interrupt is older than the start
+        int64_t end = dio0_us > tx_start_us ? dio0_us : esp_timer_get_time();
+        duk_main_add_result_event(LORA_TX_DONE, tx_current->id, end - tx_start_us);
+    }
+    else
+    {
+        logprintf("%s: TX timeout\n", __func__);
+        lora_send_packet_abort();
+        duk_main_add_result_event(LORA_TX_FAILED, tx_current->id, TX_ERROR_TIMEOUT);
+    }
+    tx_release();
+}
+
+// CAD result for tx_current: send, back off or give up
+static void tx_cad(const int res)
+{
+    if (res == LORA_CAD_FREE)
+    {
+        tx_send();
+        return;
+    }
+    int backoff_ms = lora_lbt_backoff_ms(++tx_attempt);
+    if (backoff_ms < 0)
+    {
+#if LORA_MAIN_DEBUG
+        logprintf("%s: channel busy, dropping %d\n", __func__, tx_current->id);
+#endif
+        duk_main_add_result_event(LORA_TX_FAILED, tx_current->id, TX_ERROR_CHANNEL_BUSY);
+        tx_release();
+        return;
+    }
+    // keep receiving while backing off
+    tx_state = TX_BACKOFF;
+    tx_resume_mode();
+    tx_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(backoff_ms);
 }
 
 static void isr_recv_task(void *arg)
 {
+    rx_ring_fill();
     for (;;)
     {
-        uint32_t cmd;
-        if (xQueueReceive(isr_recv_queue, (void *)&cmd, portMAX_DELAY))
+        uint32_t bits = 0;
+        TickType_t wait = portMAX_DELAY;
+        if (tx_current != NULL)
+        {
+            TickType_t now = xTaskGetTickCount();
+            wait = (int32_t)(tx_deadline - now) > 0 ? tx_deadline - now : 0;
+        }
+        if (!xTaskNotifyWait(0, UINT32_MAX, &bits, wait))
         {
-            // handle hopping
-            if (lora_fhss_handle(fqtable, fqtable_entries))
+            if (tx_current == NULL)
             {
                 continue;
             }
+            if (tx_state == TX_ON_AIR)
+            {
+                // no TX done interrupt in time
+                tx_finish(lora_send_packet_done());
+            }
+            else if (tx_state == TX_CAD)
+            {
+                // no CAD done interrupt in time, count as busy
+                int res = lora_cad_done();
+                if (res == LORA_CAD_PENDING)
+                {
+                    lora_cad_abort();
+                    res = LORA_CAD_BUSY;
+                }
+                tx_cad(res);
+            }
+            else
+            {
+                // backoff is over
+                tx_start();
+            }
+            continue;
+        }
 
-            if (cmd != ISR_TASK_READ_PACKET)
+        // handle hopping
+        if (bits & (ISR_TASK_FHSS | ISR_TASK_READ_PACKET))
+        {
+            if (lora_fhss_handle_frf(fqtable, fqtable_entries) && (bits & ISR_TASK_FHSS))
             {
-                logprintf("%s: isr task cmd is not read_packet: %d\n", __func__, cmd);
+                unsigned long us = esp_timer_get_time() - fhss_us;
+                fhss_stats.hops++;
+                fhss_stats.last_us = us;
+                fhss_stats.total_us += us;
+                if (us > fhss_stats.max_us)
+                {
+                    fhss_stats.max_us = us;
+                }
             }
+        }
 
-            uint8_t *buf = malloc(LORA_MSG_MAX_SIZE + 1);
-            int bytes_recv = lora_receive_packet(buf, LORA_MSG_MAX_SIZE + 1);
-            int rssi = lora_packet_rssi();
-            int snr = lora_packet_snr();
-            lora_receive();
-#ifdef LORA_MAIN_DEBUG
-            logprintf("LoRa received: %d bytes\n", bytes_recv);
-#endif
-            if (bytes_recv > 0)
+        // DIO0 is TX done while sending and CAD done during listen before talk
+        if (tx_current != NULL && tx_state != TX_BACKOFF)
+        {
+            if (bits & ISR_TASK_READ_PACKET)
             {
-                duk_main_add_full_event(LORA_MSG, INCOMING, buf, bytes_recv, rssi, snr, time(NULL));
+                if (tx_state == TX_ON_AIR && lora_send_packet_done())
+                {
+                    tx_finish(1);
+                }
+                else if (tx_state == TX_CAD)
+                {
+                    int res = lora_cad_done();
+                    if (res != LORA_CAD_PENDING)
+                    {
+                        tx_cad(res);
+                    }
+                }
             }
+            continue;
+        }
+        if (bits & ISR_TASK_READ_PACKET)
+        {
+            rx_read();
+        }
+        // picked up by tx_release() while a packet is backing off
+        if ((bits & ISR_TASK_TX) && tx_current == NULL)
+        {
+            tx_next();
         }
     }
 }
@@ -127,9 +484,11 @@ static void isr_recv_task(void *arg)
 {
 "name": "loraReceive",
 "args": [],
+"return": "boolean status, false while packets are queued",
 "text": "Set LoRa modem to Receive.
 Packets will arrive via OnEvent().
-The type of EventData is plain buffer, see: https://wiki.duktape.org/howtobuffers2x",
+The type of EventData is plain buffer, see: https://wiki.duktape.org/howtobuffers2x 
+LoRaRSSI is the packet RSSI in dBm. Above 868 MHz (e.g. 902 - 928 MHz) the high frequency port offset is used, older firmware always used the low frequency offset and reported values 7 dB too low in these bands.",
 "example": "
 function OnStart() {
   LoRa.loraReceive();
@@ -145,68 +504,97 @@ function OnEvent(evt) {
 "
 }
 */
-int recv_enable()
+static int recv_enable(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     lora_install_irq_recv(gpio_isr_handler);
     lora_enable_irq_recv(LORA_IRQ_ENABLE);
     lora_install_irq_fhss(gpio_fhss_isr_handler);
     lora_enable_irq_fhss(LORA_IRQ_ENABLE);
     lora_receive();
     lora_mode = LORA_RECV;
-    return 0;
+    duk_push_boolean(ctx, 1);
+    return 1;
 }
 
 /* jsondoc
 {
 "name": "loraSleep",
 "args": [],
+"return": "boolean status, false while packets are queued",
 "text": "Set LoRa modem to sleep. Lowest power consumption.",
 "example": "
 LoRa.loraSleep();
 "
 }
 */
-int sleep_set()
+static int sleep_set(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     if (lora_mode == LORA_RECV)
     {
         lora_enable_irq_recv(LORA_IRQ_DISABLE);
     }
     lora_sleep();
     lora_mode = LORA_SLEEP;
-    return 0;
+    duk_push_boolean(ctx, 1);
+    return 1;
 }
 
 /* jsondoc
 {
 "name": "loraIdle",
 "args": [],
+"return": "boolean status, false while packets are queued",
 "text": "Set LoRa modem to idle.",
 "example": "
 LoRa.loraIdle();
 "
 }
 */
-int idle_set()
+static int idle_set(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     if (lora_mode == LORA_RECV)
     {
         lora_enable_irq_recv(LORA_IRQ_DISABLE);
     }
     lora_idle();
     lora_mode = LORA_IDLE;
-    return 0;
+    duk_push_boolean(ctx, 1);
+    return 1;
 }
 
 /* jsondoc
 {
 "name": "sendPacket",
 "args": [{"name": "packet_bytes", "vtype": "Plain Buffer", "text": "packet bytes length 1-255"}],
-"text": "Send a LoRa packet. LoRa.loraReceive() has to be called before sending. 
-The modem can be put into idle or sleep right after sendPacket returns. 
+"return": "packet id or false if the TX queue is full",
+"text": "Queue a LoRa packet for sending and return right away. 
+Packets are sent in order, the result arrives via OnEvent() as lora_tx_done (12) with the on air time in AirTimeUS or lora_tx_failed (13), MsgId is the returned id. 
+After the last queued packet the modem goes back to receive if LoRa.loraReceive() was called. 
+Mode and configuration changes (e.g. LoRa.loraIdle(), LoRa.setFrequency()) return false until all queued packets are sent, change them after lora_tx_done / lora_tx_failed of the last packet. 
+With LoRa.setListenBeforeTalk() enabled a packet waits for a free channel first. 
 For plain buffers see: https://wiki.duktape.org/howtobuffers2x",
 "example": "
-LoRa.sendPacket(Uint8Array.plainOf('Hello'));
+var id = LoRa.sendPacket(Uint8Array.plainOf('Hello'));
+function OnEvent(evt) {
+  if (evt.EventType == 12 && evt.MsgId == id) {
+    print('sent in ' + evt.AirTimeUS + 'us\\n');
+  }
+}
 "
 }
 */
@@ -217,13 +605,31 @@ static int send_packet(duk_context *ctx)
 #if LORA_MAIN_DEBUG
     logprintf("%s: len = %d\n", __func__, len);
 #endif
-    lora_send_packet_irq(buf, len);
-    // back to lora receive
-    if (lora_mode == LORA_RECV)
+    if (len == 0 || len > LORA_MSG_MAX_SIZE || __atomic_load_n(&tx_pending, __ATOMIC_ACQUIRE) >= TX_QUEUE_MAX)
     {
-        lora_receive();
+        duk_push_boolean(ctx, 0);
+        return 1;
     }
-    return 0;
+    lora_tx_t *tx = pool_alloc(sizeof(lora_tx_t) + len);
+    if (tx == NULL)
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    uint32_t id = ++tx_id;
+    if (id == 0)
+    {
+        id = ++tx_id;
+    }
+    tx->id = id;
+    tx->len = len;
+    memcpy(tx->data, buf, len);
+    __atomic_add_fetch(&tx_pending, 1, __ATOMIC_RELEASE);
+    WORK_LIST_PUSH(&tx_queue, tx);
+
+    xTaskNotify(isr_task_handle, ISR_TASK_TX, eSetBits);
+    duk_push_uint(ctx, id);
+    return 1;
 }
 
 /* jsondoc
@@ -239,6 +645,11 @@ LoRa.setFrequency(902.3);
 */
 static int set_freq(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     double freq = duk_require_number(ctx, 0);
     if (freq < 902.0 || freq > 928.0)
     {
@@ -263,6 +674,11 @@ LoRa.setBW(125E3);
 */
 static int set_bandwidth(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int bw = duk_require_int(ctx, 0);
     if (bw < 7.8E3 || bw > 500E3)
     {
@@ -287,6 +703,11 @@ LoRa.setSF(7);
 */
 static int set_sf(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int sf = duk_require_int(ctx, 0);
     if (sf < 6 || sf > 12)
     {
@@ -311,6 +732,11 @@ LoRa.setCR(5);
 */
 static int set_cr(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int cr = duk_require_int(ctx, 0);
     if (cr < 5 || cr > 8)
     {
@@ -335,6 +761,11 @@ LoRa.setPreambleLen(8);
 */
 static int set_preamble_len(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int pl = duk_require_int(ctx, 0);
     if (pl < 0 || pl > 0xffff)
     {
@@ -350,6 +781,7 @@ static int set_preamble_len(duk_context *ctx)
 {
 "name": "setSyncWord",
 "args": [{"name": "syncword", "vtype": "uint8", "text": "sync word"}],
+"return": "boolean status",
 "text": "Set the LoRa sync word.",
 "example": "
 LoRa.setSyncWord(0x42);
@@ -358,9 +790,15 @@ LoRa.setSyncWord(0x42);
 */
 static int set_sync_word(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     uint sw = duk_require_uint(ctx, 0);
     lora_set_sync_word((uint8_t)sw);
-    return 0;
+    duk_push_boolean(ctx, 1);
+    return 1;
 }
 
 /* jsondoc
@@ -376,12 +814,18 @@ LoRa.setCRC(true);
 */
 static int set_crc(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int crc = duk_require_boolean(ctx, 0);
     if (crc)
         lora_enable_crc();
     else
         lora_disable_crc();
-    return 0;
+    duk_push_boolean(ctx, 1);
+    return 1;
 }
 
 /* jsondoc
@@ -397,6 +841,11 @@ LoRa.setPayloadLen(0);
 */
 static int set_payload_len(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int pl = duk_require_int(ctx, 0);
     if (pl > 0 && pl < 256)
     {
@@ -428,6 +877,11 @@ LoRa.setTxPower(17);
 */
 static int set_tx_power(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     uint txp = duk_require_uint(ctx, 0);
     if (txp < 2 || txp > 17)
     {
@@ -443,6 +897,7 @@ static int set_tx_power(duk_context *ctx)
 {
 "name": "setIQMode",
 "args": [{"name": "iq_invert", "vtype": "boolean", "text": "enable IQ invert"}],
+"return": "boolean status",
 "text": "Enable / Disable IQ invert.",
 "example": "
 LoRa.setIQMode(true);
@@ -451,12 +906,18 @@ LoRa.setIQMode(true);
 */
 static int set_iq_mode(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int iq = duk_require_boolean(ctx, 0);
     if (iq)
         lora_enable_invert_iq();
     else
         lora_disable_invert_iq();
-    return 0;
+    duk_push_boolean(ctx, 1);
+    return 1;
 }
 
 /* jsondoc
@@ -466,7 +927,7 @@ static int set_iq_mode(duk_context *ctx)
 {"name": "hops", "vtype": "uint", "text": "number of hops, 0 = don't use frequency hopping"},
 {"name": "hopfreqs", "vtype": "double[]", "text": "the hopping frequencies, needs to contain at least 1 entry if hops > 0"}
 ],
-"text": "Configure the frequency hopping functionality. Disable frequency hopping by setting hops to `0`.",
+"text": "Configure the frequency hopping functionality. Disable frequency hopping by setting hops to `0`. The modem registers for each frequency are computed here so a hop only has to write them. Hop latency is part of LoRa.getStats().",
 "return": "boolean status",
 "example": "
 // 5 hops
@@ -478,6 +939,11 @@ LoRa.setHopping(0, []);
  */
 static int set_hopping(duk_context *ctx)
 {
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     int hops = duk_require_int(ctx, 0);
 
     if (fqtable)
@@ -508,7 +974,7 @@ static int set_hopping(duk_context *ctx)
     }
 
     fqtable_entries = n;
-    fqtable = (double *)malloc(sizeof(double) * fqtable_entries);
+    fqtable = (struct lora_frf_t *)malloc(sizeof(struct lora_frf_t) * fqtable_entries);
 #ifdef LORA_MAIN_DEBUG
     logprintf("%s: hops %d table %d\n", __func__, hops, fqtable_entries);
 #endif
@@ -517,9 +983,11 @@ static int set_hopping(duk_context *ctx)
     {
         if (duk_get_prop_index(ctx, 1, i))
         {
-            fqtable[i] = duk_to_number(ctx, -1);
+            // register values are computed here, not on every hop
+            double freq = duk_to_number(ctx, -1);
+            lora_frf_table(&freq, &fqtable[i], 1);
 #ifdef LORA_MAIN_DEBUG
-            logprintf("%s: entry[%d] = %f\n", __func__, i, fqtable[i]);
+            logprintf("%s: entry[%d] = %f\n", __func__, i, freq);
 #endif
         }
         else
@@ -536,6 +1004,364 @@ static int set_hopping(duk_context *ctx)
     return 1;
 }
 
+// setConfig() keys, read before the modem configuration is batched
+enum LoRaConfig_T
+{
+    CFG_FREQUENCY = 0,
+    CFG_BW,
+    CFG_SF,
+    CFG_CR,
+    CFG_PREAMBLE_LEN,
+    CFG_SYNC_WORD,
+    CFG_CRC,
+    CFG_PAYLOAD_LEN,
+    CFG_TX_POWER,
+    CFG_IQ_INVERT,
+    CFG_NUM
+};
+
+static const char *config_keys[CFG_NUM] = {"Frequency", "BW", "SF", "CR", "PreambleLen", "SyncWord", "CRC", "PayloadLen", "TxPower", "IQInvert"};
+
+/* jsondoc
+{
+"name": "setConfig",
+"args": [{"name": "config", "vtype": "object", "text": "any of: Frequency, BW, SF, CR, PreambleLen, SyncWord, CRC, PayloadLen, TxPower, IQInvert"}],
+"return": "boolean status",
+"text": "Set several modem parameters at once. The values have the same range as for the individual set functions. Only the registers that changed are written to the modem in one batch. Invalid values are skipped and `false` is returned.",
+"example": "
+LoRa.loraIdle();
+LoRa.setConfig({Frequency: 903.9, BW: 125E3, SF: 7, IQInvert: false, CRC: true});
+"
+}
+*/
+static int set_config(duk_context *ctx)
+{
+    int ok = 1;
+    int set[CFG_NUM] = {0};
+    double val[CFG_NUM] = {0};
+    duk_require_object(ctx, 0);
+
+    // getters and valueOf() can throw, no Duktape calls between lora_config_begin() and lora_config_commit()
+    for (int i = 0; i < CFG_NUM; i++)
+    {
+        if (duk_get_prop_string(ctx, 0, config_keys[i]))
+        {
+            set[i] = 1;
+            if (i == CFG_CRC || i == CFG_IQ_INVERT)
+                val[i] = duk_to_boolean(ctx, -1);
+            else if (i == CFG_FREQUENCY)
+                val[i] = duk_to_number(ctx, -1);
+            else if (i == CFG_SYNC_WORD || i == CFG_TX_POWER)
+                val[i] = duk_to_uint(ctx, -1);
+            else
+                val[i] = duk_to_int(ctx, -1);
+        }
+        duk_pop(ctx);
+    }
+
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    lora_config_begin();
+    if (set[CFG_FREQUENCY])
+    {
+        if (val[CFG_FREQUENCY] >= 902.0 && val[CFG_FREQUENCY] <= 928.0)
+            lora_set_frequency(val[CFG_FREQUENCY]);
+        else
+            ok = 0;
+    }
+    if (set[CFG_BW])
+    {
+        int bw = val[CFG_BW];
+        if (bw >= 7.8E3 && bw <= 500E3)
+            lora_set_bandwidth(bw);
+        else
+            ok = 0;
+    }
+    if (set[CFG_SF])
+    {
+        int sf = val[CFG_SF];
+        if (sf >= 6 && sf <= 12)
+            lora_set_spreading_factor(sf);
+        else
+            ok = 0;
+    }
+    if (set[CFG_CR])
+    {
+        int cr = val[CFG_CR];
+        if (cr >= 5 && cr <= 8)
+            lora_set_coding_rate(cr);
+        else
+            ok = 0;
+    }
+    if (set[CFG_PREAMBLE_LEN])
+    {
+        int pl = val[CFG_PREAMBLE_LEN];
+        if (pl >= 0 && pl <= 0xffff)
+            lora_set_preamble_length(pl);
+        else
+            ok = 0;
+    }
+    if (set[CFG_SYNC_WORD])
+    {
+        lora_set_sync_word((uint8_t)(uint32_t)val[CFG_SYNC_WORD]);
+    }
+    if (set[CFG_CRC])
+    {
+        if (val[CFG_CRC])
+            lora_enable_crc();
+        else
+            lora_disable_crc();
+    }
+    if (set[CFG_PAYLOAD_LEN])
+    {
+        int pl = val[CFG_PAYLOAD_LEN];
+        if (pl > 0 && pl < 256)
+            lora_implicit_header_mode(pl);
+        else if (pl == 0)
+            lora_explicit_header_mode();
+        else
+            ok = 0;
+    }
+    if (set[CFG_TX_POWER])
+    {
+        uint txp = val[CFG_TX_POWER];
+        if (txp >= 2 && txp <= 17)
+            lora_set_tx_power(txp);
+        else
+            ok = 0;
+    }
+    if (set[CFG_IQ_INVERT])
+    {
+        if (val[CFG_IQ_INVERT])
+            lora_enable_invert_iq();
+        else
+            lora_disable_invert_iq();
+    }
+    lora_config_commit();
+
+    duk_push_boolean(ctx, ok);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "setListenBeforeTalk",
+"args": [
+{"name": "enable", "vtype": "boolean", "text": "run channel activity detection (CAD) before sending"},
+{"name": "retries", "vtype": "uint", "text": "retries after the channel was found busy (0 - 15, default 5)"},
+{"name": "backoffMS", "vtype": "uint", "text": "backoff before the first retry in milliseconds (1 - 10000, default 50)"}
+],
+"return": "boolean status",
+"text": "Configure listen before talk for LoRa.sendPacket(). Before each packet the modem checks the channel for LoRa activity, if the channel is busy sending is retried after a random backoff. The backoff window starts at backoffMS and doubles with each retry (up to 16 times backoffMS). Packets are still received while backing off. If the channel is still busy after the last retry the packet is dropped and reported as lora_tx_failed with Error -2. LBT statistics are part of LoRa.getStats(). Listen before talk is off by default and disabled when the application is restarted.",
+"example": "
+LoRa.setListenBeforeTalk(true, 3, 100);
+// disable
+LoRa.setListenBeforeTalk(false);
+"
+}
+*/
+static int set_lbt(duk_context *ctx)
+{
+    int enable = duk_require_boolean(ctx, 0);
+    int retries = duk_get_int_default(ctx, 1, 5);
+    int backoff_ms = duk_get_int_default(ctx, 2, 50);
+    if (retries < 0 || retries > 15 || backoff_ms < 1 || backoff_ms > 10000)
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    if (tx_busy())
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    lora_set_lbt(enable, retries, backoff_ms);
+    duk_push_boolean(ctx, 1);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "setRxFilter",
+"args": [{"name": "filter", "vtype": "object", "text": "any of: MinRSSI, MinSNR, MinLength, MaxLength, MType (array of 0 - 7), DevAddr (array of uint, max 1024). null removes the filter."}],
+"return": "boolean status",
+"text": "Set a receive filter. Packets that do not match all of the configured values are dropped before they reach OnEvent(). MType is the LoRaWAN message type (upper 3 bits of the first byte), DevAddr is checked for LoRaWAN data frames (MType 2 - 5) only. The filter is not changed if a value is invalid. The filter is removed when the application is restarted.",
+"example": "
+// downlinks for one device
+LoRa.setRxFilter({MType: [3, 5], DevAddr: [0x260CA79F], MinRSSI: -125});
+LoRa.setRxFilter(null);
+"
+}
+*/
+static int set_rx_filter(duk_context *ctx)
+{
+    rx_filter_t *f = NULL;
+    if (!duk_is_null_or_undefined(ctx, 0))
+    {
+        duk_require_object(ctx, 0);
+        f = malloc(sizeof(rx_filter_t));
+        if (f == NULL)
+        {
+            duk_push_boolean(ctx, 0);
+            return 1;
+        }
+        rx_filter_init(f);
+        int ok = 1;
+
+        if (duk_get_prop_string(ctx, 0, "MinRSSI"))
+        {
+            rx_filter_set_rssi(f, duk_to_int(ctx, -1));
+        }
+        duk_pop(ctx);
+        if (duk_get_prop_string(ctx, 0, "MinSNR"))
+        {
+            rx_filter_set_snr(f, duk_to_int(ctx, -1));
+        }
+        duk_pop(ctx);
+        int min_len = duk_get_prop_string(ctx, 0, "MinLength") ? duk_to_int(ctx, -1) : 0;
+        duk_pop(ctx);
+        int max_len = duk_get_prop_string(ctx, 0, "MaxLength") ? duk_to_int(ctx, -1) : LORA_MSG_MAX_SIZE;
+        duk_pop(ctx);
+        if (min_len < 0 || max_len > LORA_MSG_MAX_SIZE || min_len > max_len)
+        {
+            ok = 0;
+        }
+        else if (min_len > 0 || max_len < LORA_MSG_MAX_SIZE)
+        {
+            rx_filter_set_length(f, min_len, max_len);
+        }
+        if (duk_get_prop_string(ctx, 0, "MType"))
+        {
+            uint8_t mtypes = 0;
+            duk_size_t n = duk_is_array(ctx, -1) ? duk_get_length(ctx, -1) : 0;
+            for (duk_size_t i = 0; i < n; i++)
+            {
+                duk_get_prop_index(ctx, -1, i);
+                int mt = duk_to_int(ctx, -1);
+                duk_pop(ctx);
+                if (mt < 0 || mt > 7)
+                {
+                    ok = 0;
+                    break;
+                }
+                mtypes |= 1 << mt;
+            }
+            if (n == 0)
+            {
+                ok = 0;
+            }
+            rx_filter_set_mtypes(f, mtypes);
+        }
+        duk_pop(ctx);
+        if (ok && duk_get_prop_string(ctx, 0, "DevAddr"))
+        {
+            duk_size_t n = duk_is_array(ctx, -1) ? duk_get_length(ctx, -1) : 0;
+            if (n == 0 || n > RX_FILTER_DEVADDR_MAX || !rx_filter_devaddr_init(f, n))
+            {
+                ok = 0;
+            }
+            for (duk_size_t i = 0; ok && i < n; i++)
+            {
+                duk_get_prop_index(ctx, -1, i);
+                rx_filter_devaddr_add(f, duk_to_uint32(ctx, -1));
+                duk_pop(ctx);
+            }
+        }
+        duk_pop(ctx);
+
+        if (!ok)
+        {
+            rx_filter_free(f);
+            free(f);
+            duk_push_boolean(ctx, 0);
+            return 1;
+        }
+    }
+
+    rx_filter_replace(f);
+    duk_push_boolean(ctx, 1);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getRxFilterStats",
+"args": [],
+"return": "object",
+"text": "Returns the counters of the receive filter set with LoRa.setRxFilter(). `Passed` counts packets delivered to the application, `RSSI`, `SNR`, `Length`, `MType` and `DevAddr` the packets dropped by each check. The counters start at 0 with every new filter.",
+"example": "
+var fs = LoRa.getRxFilterStats();
+print('dropped for DevAddr: ' + fs.DevAddr + '\\n');
+"
+}
+*/
+static int get_rx_filter_stats(duk_context *ctx)
+{
+    rx_filter_t st;
+    rx_filter_init(&st);
+    xSemaphoreTake(rx_filter_lock, portMAX_DELAY);
+    if (rx_filter != NULL)
+    {
+        st.passed = rx_filter->passed;
+        memcpy(st.hits, rx_filter->hits, sizeof(st.hits));
+    }
+    xSemaphoreGive(rx_filter_lock);
+    duk_push_object(ctx);
+    ADD_NUMBER("Passed", st.passed);
+    ADD_NUMBER("RSSI", st.hits[RX_FILTER_RSSI]);
+    ADD_NUMBER("SNR", st.hits[RX_FILTER_SNR]);
+    ADD_NUMBER("Length", st.hits[RX_FILTER_LENGTH]);
+    ADD_NUMBER("MType", st.hits[RX_FILTER_MTYPE]);
+    ADD_NUMBER("DevAddr", st.hits[RX_FILTER_DEVADDR]);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getStats",
+"args": [],
+"return": "object",
+"text": "Returns modem statistics. `SPITransactions` counts SPI transactions with the modem. `SPIReadsSaved` and `SPIWritesSaved` count register accesses answered by the register shadow (unchanged configuration is not written again). `FIFOTransfers` counts packets moved to or from the modem, `FIFOLastUS` and `FIFOMaxUS` are the time the last and the slowest transfer took in microseconds. `RXPackets` counts packets received, `RXCRCErrors` and `RXHeaderErrors` packets dropped for a payload CRC error or a missing valid header. `RXOverruns` counts modem interrupts that arrived before the previous one was handled (packets or hops may be lost), `RXRingFull` packets dropped because the application holds on to all frame buffers. `LBTCAD` counts channel activity detections run for listen before talk, `LBTChannelBusy` the ones that found the channel busy, `LBTRetries` the backoffs and `LBTDropped` packets given up after the last retry. `FHSSHops` counts frequency hops, `FHSSLatencyLastUS`, `FHSSLatencyMaxUS` and `FHSSLatencyAvgUS` are the time from the channel change interrupt to the new frequency being set in microseconds.",
+"example": "
+var ls = LoRa.getStats();
+print('last packet transfer: ' + ls.FIFOLastUS + 'us\\n');
+"
+}
+*/
+static int get_stats(duk_context *ctx)
+{
+    struct lora_spi_stats_t st;
+    lora_get_spi_stats(&st);
+    duk_push_object(ctx);
+    ADD_NUMBER("SPITransactions", st.transactions);
+    ADD_NUMBER("SPIReadsSaved", st.reads_saved);
+    ADD_NUMBER("SPIWritesSaved", st.writes_saved);
+    ADD_NUMBER("FIFOTransfers", st.fifo_transfers);
+    ADD_NUMBER("FIFOLastUS", st.fifo_last_us);
+    ADD_NUMBER("FIFOMaxUS", st.fifo_max_us);
+    struct lora_rx_stats_t rs;
+    lora_get_rx_stats(&rs);
+    ADD_NUMBER("RXPackets", rs.packets);
+    ADD_NUMBER("RXCRCErrors", rs.crc_errors);
+    ADD_NUMBER("RXHeaderErrors", rs.header_errors);
+    ADD_NUMBER("RXOverruns", rx_stats.overruns);
+    ADD_NUMBER("RXRingFull", rx_stats.ring_full);
+    struct lora_lbt_stats_t ls;
+    lora_get_lbt_stats(&ls);
+    ADD_NUMBER("LBTCAD", ls.cad_runs);
+    ADD_NUMBER("LBTChannelBusy", ls.busy);
+    ADD_NUMBER("LBTRetries", ls.retries);
+    ADD_NUMBER("LBTDropped", ls.dropped);
+    ADD_NUMBER("FHSSHops", fhss_stats.hops);
+    ADD_NUMBER("FHSSLatencyLastUS", fhss_stats.last_us);
+    ADD_NUMBER("FHSSLatencyMaxUS", fhss_stats.max_us);
+    ADD_NUMBER("FHSSLatencyAvgUS", fhss_stats.hops ? fhss_stats.total_us / fhss_stats.hops : 0);
+    return 1;
+}
+
 static duk_function_list_entry lora_funcs[] = {
     {"setCRC", set_crc, 1},
     {"setTxPower", set_tx_power, 1},
@@ -552,10 +1378,19 @@ static duk_function_list_entry lora_funcs[] = {
     {"loraReceive", recv_enable, 0},
     {"setHopping", set_hopping, 2},
     {"sendPacket", send_packet, 1},
+    {"setConfig", set_config, 1},
+    {"setListenBeforeTalk", set_lbt, 3},
+    {"setRxFilter", set_rx_filter, 1},
+    {"getRxFilterStats", get_rx_filter_stats, 0},
+    {"getStats", get_stats, 0},
     {NULL, NULL, 0}};
 
 int lora_main_register(duk_context *ctx)
 {
+    // settings of the previous application
+    rx_filter_replace(NULL);
+    lora_set_lbt(0, 0, 0);
+
     duk_push_global_object(ctx);
     duk_push_object(ctx);
 
@@ -588,12 +1423,16 @@ int lora_main_start()
     }
     lora_mode = LORA_SLEEP;
 
-    isr_recv_queue = xQueueCreate(10, sizeof(uint32_t));
-    if (xTaskCreate(&isr_recv_task, "lora_isr_recv_task", 2048, NULL, 10, NULL) != 1)
+    WORK_LIST_INIT(&tx_queue);
+    rx_filter_lock = xSemaphoreCreateMutex();
+    if (xTaskCreate(&isr_recv_task, "lora_isr_recv_task", ISR_TASK_STACK, NULL, 10, &isr_task_handle) != 1)
     {
         logprintf("%s: xTaskCreate ERROR\n", __func__);
         return 0;
     }
+    // DIO0 also signals TX done, the handlers stay installed
+    lora_install_irq_recv(gpio_isr_handler);
+    lora_install_irq_fhss(gpio_fhss_isr_handler);
 
     return 1;
 }
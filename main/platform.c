@@ -27,6 +27,7 @@
 #include "log.h"
 #include "version.h"
 #include "udp_service.h"
+#include "pool.h"
 
 #define UDP_EVENT_SERVICE 1
 
@@ -65,6 +66,9 @@ Event = {
     LoRaSNR: int,
     TimeStamp: uint,
     NumPress: uint,
+    MsgId: uint,
+    Error: int,
+    AirTimeUS: uint,
 }
 ```
 
@@ -72,7 +76,11 @@ Event = {
 ui refer to messages received from either
 the websocket connection or the BLE connection.
 ui_connect/ui_disconnect refers to the UI connection
-being established or torn down.
+being established or torn down. worker (9) is a message
+from the Worker (see worker.md). ui_sent (10) and
+ui_send_failed (11) report the result of Platform.sendEvent().
+lora_tx_done (12) and lora_tx_failed (13) report the result
+of LoRa.sendPacket().
 
 ```
 function EventName(event) {
@@ -97,6 +105,24 @@ and indicates the time of when the packet was received.
 and indicates how often the button was pressed within the 3 seconds
 frame after the first press.
 
+**MsgId (uint)** is set for ui_sent and ui_send_failed events
+and is the id returned by Platform.sendEvent(). For lora_tx_done
+and lora_tx_failed events it is the id returned by LoRa.sendPacket().
+
+**Error (int)** is set for ui_send_failed events and is the
+error of the websocket or BLE write (-1 if no UI client was connected).
+For lora_tx_failed events it is -1 (the modem did not signal TX done in time)
+or -2 (listen before talk found the channel busy, see LoRa.setListenBeforeTalk()).
+
+**AirTimeUS (uint)** is set for lora_tx_done events and is the
+time from starting the transmission to TX done in microseconds.
+
+## OnEvents(events)
+OnEvents is optional and only used after batching was enabled
+via Platform.setEventBatching(). It is called with an array of
+event objects (see OnEvent) in the order they were received.
+Batching saves the per event call overhead when events arrive in bursts.
+
 ## OnTimer()
 is called after the timeout configured via Platform.setTimer() has expired.
 
@@ -170,6 +196,68 @@ print('Hi\\n');
 }
 */
 
+/* jsondoc
+{
+"name": "setTimeout",
+"args": [
+{"name": "func", "vtype": "function", "text": "function to call when the timer expires"},
+{"name": "delay", "vtype": "uint", "text": "timeout in milliseconds"}],
+"return": "timer ID",
+"text": "Call function once after delay milliseconds. Timers are kept in a native timer heap, any number of timers can be active. Timers fire on the next system tick (10 milliseconds) after they expired. Note: setTimeout is not part of the Platform namespace.",
+"example": "
+var id = setTimeout(function() { print('timer\\n'); }, 5000);
+"
+}
+*/
+static int set_timeout(duk_context *ctx)
+{
+    duk_require_function(ctx, 0);
+    uint delay = duk_require_uint(ctx, 1);
+    duk_push_uint(ctx, duk_main_timer_add(ctx, 0, delay, 0));
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "setInterval",
+"args": [
+{"name": "func", "vtype": "function", "text": "function to call when the timer expires"},
+{"name": "interval", "vtype": "uint", "text": "interval in milliseconds"}],
+"return": "timer ID",
+"text": "Call function repeatedly every interval milliseconds until cleared. The next call is scheduled from the time the previous call was due, not from when it ran, so the interval does not drift. Calls that were missed because the application was busy are skipped. Note: setInterval is not part of the Platform namespace.",
+"example": "
+var id = setInterval(function() { print('tick\\n'); }, 1000);
+"
+}
+*/
+static int set_interval(duk_context *ctx)
+{
+    duk_require_function(ctx, 0);
+    uint interval = duk_require_uint(ctx, 1);
+    duk_push_uint(ctx, duk_main_timer_add(ctx, 0, interval, 1));
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "clearTimeout",
+"args": [
+{"name": "timerID", "vtype": "uint", "text": "ID returned by setTimeout() or setInterval()"}],
+"return": "boolean status",
+"text": "Cancel a timer. clearInterval() is the same function. Note: clearTimeout is not part of the Platform namespace.",
+"example": "
+var id = setTimeout(x, 1000);
+clearTimeout(id);
+"
+}
+*/
+static int clear_timeout(duk_context *ctx)
+{
+    uint id = duk_require_uint(ctx, 0);
+    duk_push_boolean(ctx, duk_main_timer_cancel(ctx, id));
+    return 1;
+}
+
 /* jsondoc
 {
 "name": "setSystemTime",
@@ -283,6 +371,35 @@ static int set_timer(duk_context *ctx)
     return 1;
 }
 
+/* jsondoc
+{
+"name": "setEventBatching",
+"args": [
+{"name": "maxEvents", "vtype": "uint", "text": "maximum events per OnEvents() call (2-64), 0 or 1 = disable batching"},
+{"name": "maxLatency", "vtype": "uint", "text": "milliseconds an event is held back waiting for more events"}
+],
+"text": "Deliver incoming events in batches via OnEvents(events). A batch is delivered once it holds `maxEvents` events or the oldest event is `maxLatency` milliseconds old. If the application has no OnEvents() function the events are delivered one by one via OnEvent(). Batched events don't count towards the queue limits of getEventStats().",
+"return": "boolean status",
+"example": "
+// up to 16 events, wait at most 50ms
+Platform.setEventBatching(16, 50);
+
+function OnEvents(events) {
+    for (var i = 0; i < events.length; i++) {
+        OnEvent(events[i]);
+    }
+}
+"
+}
+*/
+static int set_event_batching(duk_context *ctx)
+{
+    uint max_events = duk_require_uint(ctx, 0);
+    uint max_latency = duk_require_uint(ctx, 1);
+    duk_push_boolean(ctx, duk_main_set_batching(max_events, max_latency));
+    return 1;
+}
+
 /* jsondoc
 {
 "name": "getBatteryMVolt",
@@ -486,7 +603,7 @@ static int wifi_connectivity_stop()
 
 static int ble_receive(const uint8_t *buf, const size_t len)
 {
-    duk_main_add_event(UI_MSG, INCOMING, (uint8_t *)buf, len);
+    duk_main_add_source_event(EVENT_SOURCE_BLE, UI_MSG, INCOMING, (uint8_t *)buf, len, 0, 0, 0);
     return 0;
 }
 
@@ -526,6 +643,9 @@ static int set_connectivity(duk_context *ctx)
         bootloader_random_disable();
     }
 
+    // the sender task must be done with the old transport before it is stopped
+    duk_main_set_send_func(NULL);
+
     if (newcon == NOT_CONNECTED)
     {
         if (connectivity == WIFI)
@@ -537,7 +657,6 @@ static int set_connectivity(duk_context *ctx)
             ble_server_stop();
         }
         bootloader_random_enable();
-        duk_main_set_send_func(NULL);
     }
     else if (newcon == WIFI)
     {
@@ -545,7 +664,6 @@ static int set_connectivity(duk_context *ctx)
         {
             ble_server_stop();
         }
-        duk_main_set_send_func(NULL);
     }
     else if (newcon == BLE)
     {
@@ -752,13 +870,22 @@ static int queue_udp_cb(const uint8_t *buf, const size_t len)
         return 0;
     }
 
-    uint8_t *data = malloc(len - 1);
-    memcpy(data, buf + 1, len - 1);
-
     // first byte in UDP packet selects the event
     uint8_t msg_type = buf[0] - 'A';
+    if (msg_type >= DISPATCH_STAT_ON_EVENTS)
+    {
+        return 0;
+    }
 
-    duk_main_add_full_event(msg_type, INCOMING, (uint8_t *)data, len - 1, 0, 0, time(NULL));
+    uint8_t *data = pool_alloc(len - 1);
+    if (data == NULL)
+    {
+        return 0;
+    }
+    memcpy(data, buf + 1, len - 1);
+
+    // blocks while the UDP source is over its limit
+    duk_main_add_source_event(EVENT_SOURCE_UDP, msg_type, INCOMING, (uint8_t *)data, len - 1, 0, 0, time(NULL));
     return 0;
 }
 #endif
@@ -814,6 +941,8 @@ static int wifi_configure(duk_context *ctx)
     ws_server_cfg->client_timeout = 60000;
     ws_server_cfg->callback_data = NULL;
     ws_server_cfg->callback = queue_cb;
+    ws_server_cfg->payload_alloc = pool_alloc;
+    ws_server_cfg->payload_free = pool_free;
     ws_server_cfg->log_printf = logprintf;
     ws_server_cfg->conninfo_callback = ui_conninfo;
 
@@ -837,8 +966,8 @@ static int wifi_configure(duk_context *ctx)
 {"name": "event_type", "vtype": "uint", "text": "1 = UI event (send to websocket or BLE)"},
 {"name": "data", "vtype": "plain buffer", "text": "data to send (see: https://wiki.duktape.org/howtobuffers2x)"}
 ],
-"text": "Send event to the connected UI client. Only UI event (1) is currently supported.",
-"return": "boolean status",
+"text": "Send event to the connected UI client. Only UI event (1) is currently supported. The data is copied and sent in the background, a failed send is reported as ui_send_failed (11) event. Fails if too many messages are waiting to be sent (see setEventLimit).",
+"return": "message id or false",
 "example": "
 var x = {
     test: 'test string',
@@ -854,12 +983,90 @@ static int send_event(duk_context *ctx)
     int event_type = duk_require_int(ctx, 0);
     duk_size_t buff_len = 0;
     void *buff_ptr = duk_require_buffer(ctx, 1, &buff_len);
+    // a zero length payload would be taken for a string
+    if (event_type != UI_MSG || buff_len == 0)
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     // duplicate buffer
-    uint8_t *buff = malloc(buff_len);
+    uint8_t *buff = pool_alloc(buff_len);
+    if (buff == NULL)
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
     memcpy(buff, (uint8_t *)buff_ptr, buff_len);
-    duk_main_add_event(event_type, OUTGOING, buff, buff_len);
+    unsigned long int id = duk_main_send(buff, buff_len);
+    if (id == 0)
+    {
+        duk_push_boolean(ctx, 0);
+        return 1;
+    }
+    duk_push_number(ctx, id);
+    return 1;
+}
 
-    duk_push_boolean(ctx, 1);
+/* jsondoc
+{
+"name": "setSendReports",
+"args": [{"name": "enable", "vtype": "boolean", "text": "report sent messages"}],
+"text": "Report every message that was sent by sendEvent() as ui_sent (10) event. Failed messages are always reported. Off by default and reset when the application is restarted.",
+"return": "nothing",
+"example": "
+Platform.setSendReports(true);
+"
+}
+*/
+static int set_send_reports(duk_context *ctx)
+{
+    duk_main_set_send_reports(duk_require_boolean(ctx, 0));
+    return 0;
+}
+
+/* jsondoc
+{
+"name": "setSendCoalescing",
+"args": [
+{"name": "windowMS", "vtype": "uint", "text": "how long to wait for more messages (max 1000), 0 = off"},
+{"name": "maxBytes", "vtype": "uint", "text": "maximum frame size (64-4096)"}
+],
+"text": "Pack messages sent with sendEvent() within `windowMS` into one websocket frame or BLE record of up to `maxBytes`. This saves a lot of overhead for applications that send many small messages. A packed frame starts with 0x1e followed by `<length>:<message>` for each message (length in bytes), single messages are sent as they are. See `unpackFrame()` in index.html for a decoder. Off by default and reset when the application is restarted.",
+"return": "boolean status",
+"example": "
+// send at most every 50ms
+Platform.setSendCoalescing(50, 1024);
+"
+}
+*/
+static int set_send_coalescing(duk_context *ctx)
+{
+    unsigned long int window = duk_require_uint(ctx, 0);
+    unsigned long int max = duk_require_uint(ctx, 1);
+    duk_push_boolean(ctx, duk_main_set_send_coalescing(window, max));
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getSendStats",
+"args": [],
+"return": "object",
+"text": "Returns statistics of sendEvent(). `Sent` and `Failed` count messages, `Frames` counts websocket frames / BLE records (less than messages if coalescing is on).",
+"example": "
+var ss = Platform.getSendStats();
+print('messages per frame: ' + (ss.Sent + ss.Failed) / ss.Frames + '\\n');
+"
+}
+*/
+static int get_send_stats(duk_context *ctx)
+{
+    duk_main_send_stats_t st;
+    duk_main_get_send_stats(&st);
+    duk_push_object(ctx);
+    ADD_NUMBER("Sent", st.sent);
+    ADD_NUMBER("Failed", st.failed);
+    ADD_NUMBER("Frames", st.frames);
     return 1;
 }
 
@@ -1013,6 +1220,358 @@ static int heap_internal_free(duk_context *ctx)
     return 1;
 }
 
+/* jsondoc
+{
+"name": "getPoolStats",
+"args": [],
+"return": "object",
+"text": "Returns statistics for the preallocated event and payload buffer pools. `Size` is the slot size in bytes, `Num` the number of slots, `Used` the slots in use, `HighWater` the maximum slots ever in use and `Failed` how often the pool was empty. `HeapFallback` counts allocations that had to use the heap.",
+"example": "
+var ps = Platform.getPoolStats();
+print('frame pool high water: ' + ps.Frame.HighWater + '/' + ps.Frame.Num + '\\n');
+"
+}
+*/
+static int pool_stats(duk_context *ctx)
+{
+    const char *names[POOL_CLASS_NUM] = {"Event", "Frame", "Large"};
+    duk_push_object(ctx);
+    for (int i = 0; i < POOL_CLASS_NUM; i++)
+    {
+        pool_stats_t st;
+        pool_get_stats(i, &st);
+        duk_push_object(ctx);
+        ADD_NUMBER("Size", st.size);
+        ADD_NUMBER("Num", st.num);
+        ADD_NUMBER("Used", st.used);
+        ADD_NUMBER("HighWater", st.high_water);
+        ADD_NUMBER("Failed", st.failed);
+        duk_put_prop_string(ctx, -2, names[i]);
+    }
+    ADD_NUMBER("HeapFallback", pool_get_heap_fallbacks());
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getTimerStats",
+"args": [],
+"return": "object",
+"text": "Returns statistics for setTimeout() and setInterval(). `Active` is the number of pending timers, `Fired` the number of callbacks called, `Skipped` the number of interval calls that were skipped because the application was busy and `MaxLate` the maximum time in milliseconds a callback was called after it was due.",
+"example": "
+var ts = Platform.getTimerStats();
+print('timers: ' + ts.Active + ' max late: ' + ts.MaxLate + 'ms\\n');
+"
+}
+*/
+static int timer_stats(duk_context *ctx)
+{
+    duk_main_timer_stats_t st;
+    duk_main_get_timer_stats(&st);
+    duk_push_object(ctx);
+    ADD_NUMBER("Active", st.active);
+    ADD_NUMBER("Fired", st.fired);
+    ADD_NUMBER("Skipped", st.skipped);
+    ADD_NUMBER("MaxLate", st.max_late);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "setExecBudget",
+"args": [{"name": "budget", "vtype": "uint", "text": "milliseconds, 0 = no limit"}],
+"text": "Limit how long a single call of OnEvent(), OnEvents(), OnTimer() or a timer callback may run. When the budget is used up a RangeError is thrown inside the handler. The error can be caught, the handler then gets another budget to clean up. The limit is off by default and reset when the application is restarted.",
+"return": "boolean status",
+"example": "
+Platform.setExecBudget(200);
+
+function OnEvent(event) {
+    try {
+        slowParse(event.EventData);
+    } catch (e) {
+        print('handler took too long: ' + e + '\\n');
+    }
+}
+"
+}
+*/
+static int set_exec_budget(duk_context *ctx)
+{
+    uint budget = duk_require_uint(ctx, 0);
+    duk_push_boolean(ctx, duk_main_set_exec_budget(budget));
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getExecBudget",
+"args": [],
+"return": "object",
+"text": "Returns the execution budget state. `Budget` is the limit in milliseconds (0 = no limit), `Overruns` how often a handler was aborted, `LastUS` and `MaxUS` the run time of the last and the longest handler call in microseconds. `RemainingUS` is the time left for the currently running handler.",
+"example": "
+var eb = Platform.getExecBudget();
+print('longest handler: ' + eb.MaxUS + 'us of ' + eb.Budget + 'ms\\n');
+"
+}
+*/
+static int get_exec_budget(duk_context *ctx)
+{
+    duk_main_exec_budget_t st;
+    duk_main_get_exec_budget(&st);
+    duk_push_object(ctx);
+    ADD_NUMBER("Budget", st.budget_ms);
+    ADD_NUMBER("Overruns", st.overruns);
+    ADD_NUMBER("LastUS", st.last_us);
+    ADD_NUMBER("MaxUS", st.max_us);
+    ADD_NUMBER("RemainingUS", st.remaining_us);
+    return 1;
+}
+
+static const char *dispatch_stat_names[DISPATCH_STAT_NUM] = {"LoRa", "UI", "UIConnected", "UIDisconnected", "Button", "USBConnected", "USBDisconnected", "BattCharging", "BattDraining", "Worker", "UISent", "UISendFailed", "LoRaTxDone", "LoRaTxFailed", "OnEvents", "OnTimer"};
+
+static void push_hist(duk_context *ctx, const duk_main_hist_t *h)
+{
+    duk_push_object(ctx);
+    ADD_NUMBER("Count", h->count);
+    ADD_NUMBER("P50", duk_main_hist_percentile(h, 50));
+    ADD_NUMBER("P99", duk_main_hist_percentile(h, 99));
+    ADD_NUMBER("Max", h->max_us);
+    duk_push_array(ctx);
+    for (int i = 0; i < DISPATCH_HIST_BUCKETS; i++)
+    {
+        duk_push_uint(ctx, h->buckets[i]);
+        duk_put_prop_index(ctx, -2, i);
+    }
+    duk_put_prop_string(ctx, -2, "Buckets");
+}
+
+/* jsondoc
+{
+"name": "getDispatchStats",
+"args": [{"name": "reset", "vtype": "boolean", "text": "optional, clear the statistics after reading them"}],
+"return": "object",
+"text": "Returns latency statistics of the event loop. There is one object per event type (`LoRa`, `UI`, `UIConnected`, `UIDisconnected`, `Button`, ...) plus `OnEvents` (batched delivery) and `OnTimer` (OnTimer() and timer callbacks). Types that were never seen are left out. Each has `Wait` (time from enqueue to dispatch, for timers from expire to dispatch) and `Run` (handler run time). Both have `Count`, `P50`, `P99` and `Max` in microseconds and `Buckets`, bucket n counts times between 2^(n-1) and 2^n microseconds. Percentiles are the upper bound of the bucket.",
+"example": "
+var ds = Platform.getDispatchStats();
+if (ds.LoRa) {
+    print('lora wait p99: ' + ds.LoRa.Wait.P99 + 'us run p99: ' + ds.LoRa.Run.P99 + 'us\\n');
+}
+"
+}
+*/
+static int dispatch_stats(duk_context *ctx)
+{
+    int reset = duk_get_boolean_default(ctx, 0, 0);
+    duk_push_object(ctx);
+    for (int i = 0; i < DISPATCH_STAT_NUM; i++)
+    {
+        duk_main_dispatch_stats_t st;
+        duk_main_get_dispatch_stats(i, &st);
+        if (st.wait.count == 0 && st.run.count == 0)
+        {
+            continue;
+        }
+        duk_push_object(ctx);
+        push_hist(ctx, &st.wait);
+        duk_put_prop_string(ctx, -2, "Wait");
+        push_hist(ctx, &st.run);
+        duk_put_prop_string(ctx, -2, "Run");
+        duk_put_prop_string(ctx, -2, dispatch_stat_names[i]);
+    }
+    if (reset)
+    {
+        duk_main_reset_dispatch_stats();
+    }
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getLoadStats",
+"args": [],
+"return": "object",
+"text": "Returns application load statistics. `StartUS` is the time in microseconds the last reset took until OnStart() returned. Scripts are compiled once and the bytecode is stored next to the script (e.g. `main.jsc`). `CacheHits` counts scripts loaded from bytecode, `CacheMisses` scripts that had to be compiled and `CacheWrites` bytecode files written. A bytecode file is used as long as the script and the firmware did not change. Bytecode files are not verified, do not upload them from untrusted sources. `ModuleLoads` counts modules evaluated by require() and `ModuleHits` require() calls answered from the module cache.",
+"example": "
+var ls = Platform.getLoadStats();
+print('started in ' + ls.StartUS / 1000 + 'ms, cache hits: ' + ls.CacheHits + '\\n');
+"
+}
+*/
+static int load_stats(duk_context *ctx)
+{
+    duk_util_cache_stats_t st;
+    duk_util_get_cache_stats(&st);
+    duk_push_object(ctx);
+    ADD_NUMBER("StartUS", duk_main_get_start_time());
+    ADD_NUMBER("CacheHits", st.hits);
+    ADD_NUMBER("CacheMisses", st.misses);
+    ADD_NUMBER("CacheWrites", st.writes);
+    duk_util_module_stats_t ms;
+    duk_util_get_module_stats(&ms);
+    ADD_NUMBER("ModuleLoads", ms.loads);
+    ADD_NUMBER("ModuleHits", ms.hits);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getArenaStats",
+"args": [],
+"return": "object",
+"text": "Returns statistics of the memory arena used by the JavaScript heap. The arena is a fixed block of `Size` bytes that is cleared when the application is restarted. `Top` is the highest byte used, `Live` the bytes currently allocated and `Peak` the maximum of `Live`. `Classes` is an array of small object size classes with `Size` and `Live` (number of allocations), `Large` is the number of larger allocations. `Allocs` counts all allocations. `Fallbacks` counts allocations that did not fit the arena and came from the system heap (`FallbackLive` bytes are still in use), `Failed` allocations that could not be served at all.",
+"example": "
+var as = Platform.getArenaStats();
+print('js heap: ' + as.Live + '/' + as.Size + ' peak: ' + as.Peak + '\\n');
+"
+}
+*/
+static int arena_stats(duk_context *ctx)
+{
+    duk_arena_stats_t st;
+    duk_main_get_arena_stats(&st);
+    duk_push_object(ctx);
+    ADD_NUMBER("Size", st.size);
+    ADD_NUMBER("Top", st.top);
+    ADD_NUMBER("Live", st.live);
+    ADD_NUMBER("Peak", st.peak);
+    duk_push_array(ctx);
+    for (int i = 0; i < DUK_ARENA_CLASS_NUM; i++)
+    {
+        duk_push_object(ctx);
+        ADD_NUMBER("Size", st.class_size[i]);
+        ADD_NUMBER("Live", st.class_live[i]);
+        duk_put_prop_index(ctx, -2, i);
+    }
+    duk_put_prop_string(ctx, -2, "Classes");
+    ADD_NUMBER("Large", st.large_live);
+    ADD_NUMBER("Allocs", st.allocs);
+    ADD_NUMBER("Fallbacks", st.fallbacks);
+    ADD_NUMBER("FallbackLive", st.fallback_live);
+    ADD_NUMBER("Failed", st.failed);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "getHeapStats",
+"args": [{"name": "collect", "vtype": "boolean", "text": "run a full garbage collection first (optional)"}],
+"return": "object",
+"text": "Returns JavaScript heap statistics. `Objects`, `Arrays`, `Functions`, `Strings` and `Buffers` each have `Count` and `Bytes` of the values reachable from the global object (values only reachable through closures are not counted, builtins in flash are not counted). `WalkUS` is the time it took to collect the numbers. `GCRuns` counts all mark-and-sweep runs since the application was started. `GCInBand` are runs Duktape started while JavaScript was running, `GCIdle` runs while the application was idle (see setIdleGC()) and `GCForced` runs requested with `collect`. `GCTimeUS` and `GCMaxUS` are the time spent in idle and forced runs. The same data is available from the web service at `/stats`.",
+"example": "
+var hs = Platform.getHeapStats();
+print('strings: ' + hs.Strings.Count + ' ' + hs.Strings.Bytes + ' bytes, gc runs: ' + hs.GCRuns + '\\n');
+"
+}
+*/
+static int heap_stats(duk_context *ctx)
+{
+    duk_main_update_heap_stats(ctx, duk_get_boolean_default(ctx, 0, 0));
+    duk_main_heap_stats_t hs;
+    duk_main_get_heap_stats(&hs);
+    duk_push_object(ctx);
+    for (int i = 0; i < DUK_UTIL_HEAP_TYPE_NUM; i++)
+    {
+        duk_push_object(ctx);
+        ADD_NUMBER("Count", hs.walk.count[i]);
+        ADD_NUMBER("Bytes", hs.walk.bytes[i]);
+        duk_put_prop_string(ctx, -2, duk_util_heap_type_name(i));
+    }
+    ADD_NUMBER("WalkUS", hs.walk_us);
+    ADD_NUMBER("GCRuns", hs.gc_runs);
+    ADD_NUMBER("GCInBand", hs.gc_inband);
+    ADD_NUMBER("GCIdle", hs.gc_idle);
+    ADD_NUMBER("GCForced", hs.gc_forced);
+    ADD_NUMBER("GCTimeUS", hs.gc_time_us);
+    ADD_NUMBER("GCMaxUS", hs.gc_max_us);
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "setIdleGC",
+"args": [
+{"name": "idle", "vtype": "uint", "text": "milliseconds, 0 = off"},
+{"name": "allocs", "vtype": "uint", "text": "minimum number of allocations since the last collection"}
+],
+"text": "Run garbage collection while the application is idle so it is less likely to happen inside OnEvent() or a timer. A collection runs when no event is queued, the next timer or batch is at least `idle` milliseconds away and at least `allocs` allocations happened since the last collection. The defaults are 100ms and 1000 allocations, they are restored when the application is restarted. See getHeapStats() for the number of idle and in-band collections.",
+"return": "boolean status",
+"example": "
+// only collect if there is a lot of idle time
+Platform.setIdleGC(500, 1000);
+"
+}
+*/
+static int set_idle_gc(duk_context *ctx)
+{
+    uint idle = duk_require_uint(ctx, 0);
+    uint allocs = duk_require_uint(ctx, 1);
+    duk_push_boolean(ctx, duk_main_set_idle_gc(idle, allocs));
+    return 1;
+}
+
+static const char *event_source_names[EVENT_SOURCE_NUM] = {"LoRa", "UI", "BLE", "UDP", "Button", "Worker", "Send", "Local"};
+
+/* jsondoc
+{
+"name": "getEventStats",
+"args": [],
+"return": "object",
+"text": "Returns event queue statistics. `QueueLen` is the number of events waiting to be delivered. There is one object per event source (`LoRa`, `UI` (websocket), `BLE`, `UDP`, `Button`, `Worker`, `Send` (outgoing UI messages), `Local`). `Limit` is the maximum number of queued events (0 = unlimited), `Depth` the number of queued events, `HighWater` the maximum queued events, `Drops` the number of dropped events and `Blocked` how often the producer had to wait.",
+"example": "
+var es = Platform.getEventStats();
+print('lora drops: ' + es.LoRa.Drops + ' queued: ' + es.LoRa.Depth + '\\n');
+"
+}
+*/
+static int event_stats(duk_context *ctx)
+{
+    duk_push_object(ctx);
+    ADD_NUMBER("QueueLen", duk_main_get_event_queue_len());
+    for (int i = 0; i < EVENT_SOURCE_NUM; i++)
+    {
+        event_source_stats_t st;
+        duk_main_get_event_stats(i, &st);
+        duk_push_object(ctx);
+        ADD_NUMBER("Limit", st.limit);
+        ADD_NUMBER("Depth", st.depth);
+        ADD_NUMBER("HighWater", st.high_water);
+        ADD_NUMBER("Drops", st.drops);
+        ADD_NUMBER("Blocked", st.blocked);
+        duk_put_prop_string(ctx, -2, event_source_names[i]);
+    }
+    return 1;
+}
+
+/* jsondoc
+{
+"name": "setEventLimit",
+"args": [
+{"name": "source", "vtype": "string", "text": "event source: LoRa, UI, BLE, UDP, Button, Worker, Send"},
+{"name": "limit", "vtype": "uint", "text": "maximum number of queued events, 0 = unlimited"}
+],
+"text": "Limit the number of queued events of a source. When the limit is reached the websocket (UI) and UDP receivers stop reading until the application caught up (and drop after 2 seconds), LoRa drops the oldest packets, BLE and button drop the new event. The worker waits like the websocket. When the Send queue is full sendEvent() fails. Limits are reset to the defaults when the application is restarted.",
+"return": "boolean status",
+"example": "
+Platform.setEventLimit('LoRa', 32);
+"
+}
+*/
+static int set_event_limit(duk_context *ctx)
+{
+    const char *name = duk_require_string(ctx, 0);
+    int limit = duk_require_int(ctx, 1);
+    for (int i = 0; i < EVENT_SOURCE_NUM; i++)
+    {
+        if (strcmp(name, event_source_names[i]) == 0)
+        {
+            duk_push_boolean(ctx, duk_main_set_event_limit(i, limit));
+            return 1;
+        }
+    }
+    duk_push_boolean(ctx, 0);
+    return 1;
+}
+
 /* jsondoc
 {
 "name": "gpioWrite",
@@ -1060,7 +1619,7 @@ static int gpio_input(duk_context *ctx)
 {
 "name": "loadLibrary",
 "args": [{"name": "filename", "vtype": "string", "text": "filename to load"}],
-"text": "Load JavaScript code into current application.",
+"text": "Load JavaScript code into current application. The file is evaluated in the global scope every time, see require() to load a file once.",
 "return": "boolean status",
 "example": "
 Platform.loadLibrary('/timer.js');
@@ -1082,6 +1641,19 @@ static int load_library(duk_context *ctx)
     return 1;
 }
 
+/* jsondoc
+{
+"name": "require",
+"args": [{"name": "id", "vtype": "string", "text": "module to load"}],
+"text": "Load a CommonJS style module and return its `module.exports`. This is a global function and not part of the Platform namespace. A module is evaluated once per application start, further calls return the cached exports. The module runs in its own scope and gets `exports`, `require`, `module`, `__filename` and `__dirname`. Ids starting with `./` or `../` are resolved relative to the requiring module, all other ids relative to the root directory. `.js` is appended if missing. Throws an Error if the module can't be loaded.",
+"return": "module exports",
+"example": "
+var util = require('util');
+print('crc: ' + util.crc16([1, 2, 3]) + '\\n');
+"
+}
+*/
+
 /* jsondoc
 {
 "name": "getBootime",
@@ -1101,6 +1673,17 @@ static int get_boottime(duk_context *ctx)
 static duk_function_list_entry platform_funcs[] = {
     {"getFreeHeap", heap_free, 0},
     {"getFreeInternalHeap", heap_internal_free, 0},
+    {"getPoolStats", pool_stats, 0},
+    {"getArenaStats", arena_stats, 0},
+    {"getHeapStats", heap_stats, 1},
+    {"setIdleGC", set_idle_gc, 2},
+    {"getEventStats", event_stats, 0},
+    {"setEventLimit", set_event_limit, 2},
+    {"getTimerStats", timer_stats, 0},
+    {"getDispatchStats", dispatch_stats, 1},
+    {"getLoadStats", load_stats, 0},
+    {"setExecBudget", set_exec_budget, 1},
+    {"getExecBudget", get_exec_budget, 0},
     {"gpioWrite", gpio_output, 2},
     {"gpioRead", gpio_input, 1},
     {"isButtonPressed", is_button_pressed, 0},
@@ -1130,7 +1713,11 @@ static duk_function_list_entry platform_funcs[] = {
     {"getBoottime", get_boottime, 0},
     {"setLoadFileName", set_load_file, 1},
     {"setTimer", set_timer, 1},
+    {"setEventBatching", set_event_batching, 2},
     {"sendEvent", send_event, 2},
+    {"setSendReports", set_send_reports, 1},
+    {"setSendCoalescing", set_send_coalescing, 2},
+    {"getSendStats", get_send_stats, 0},
     {"loadLibrary", load_library, 1},
     {NULL, NULL, 0},
 };
@@ -1152,6 +1739,12 @@ void platform_register(duk_context *ctx)
 
     duk_put_function_list(ctx, -1, platform_funcs);
     duk_put_prop_string(ctx, -2, "Platform");
+
+    // timers are globals
+    ADD_FUNCTION("setTimeout", set_timeout, 2);
+    ADD_FUNCTION("setInterval", set_interval, 2);
+    ADD_FUNCTION("clearTimeout", clear_timeout, 1);
+    ADD_FUNCTION("clearInterval", clear_timeout, 1);
     duk_pop(ctx);
 }
 
@@ -0,0 +1,214 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef POOL_TEST
+#include "freertos/FreeRTOS.h"
+#else
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL(mux)
+#endif
+
+#include "pool.h"
+
+//#define POOL_DEBUG 1
+
+struct pool_slot_t
+{
+    struct pool_slot_t *next;
+};
+
+struct pool_t
+{
+    uint8_t *mem;
+    size_t size;
+    int num;
+    struct pool_slot_t *free_list;
+    int used;
+    int high_water;
+    unsigned int failed;
+};
+
+static uint8_t event_mem[POOL_EVENT_SIZE * POOL_EVENT_NUM] __attribute__((aligned(8)));
+static uint8_t frame_mem[POOL_FRAME_SIZE * POOL_FRAME_NUM] __attribute__((aligned(8)));
+static uint8_t large_mem[POOL_LARGE_SIZE * POOL_LARGE_NUM] __attribute__((aligned(8)));
+
+static struct pool_t pools[POOL_CLASS_NUM] = {
+    {event_mem, POOL_EVENT_SIZE, POOL_EVENT_NUM},
+    {frame_mem, POOL_FRAME_SIZE, POOL_FRAME_NUM},
+    {large_mem, POOL_LARGE_SIZE, POOL_LARGE_NUM},
+};
+
+static unsigned int heap_fallbacks;
+#ifndef POOL_TEST
+static portMUX_TYPE pool_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+void pool_init()
+{
+    for (int c = 0; c < POOL_CLASS_NUM; c++)
+    {
+        struct pool_t *p = &pools[c];
+        p->free_list = NULL;
+        for (int i = p->num - 1; i >= 0; i--)
+        {
+            struct pool_slot_t *s = (struct pool_slot_t *)(p->mem + (i * p->size));
+            s->next = p->free_list;
+            p->free_list = s;
+        }
+        p->used = 0;
+        p->high_water = 0;
+        p->failed = 0;
+    }
+    heap_fallbacks = 0;
+}
+
+void *pool_alloc(const size_t size)
+{
+    struct pool_slot_t *s = NULL;
+
+    portENTER_CRITICAL(&pool_mux);
+    int first = 1;
+    for (int c = 0; c < POOL_CLASS_NUM; c++)
+    {
+        struct pool_t *p = &pools[c];
+        if (size > p->size)
+        {
+            continue;
+        }
+        if (p->free_list != NULL)
+        {
+            s = p->free_list;
+            p->free_list = s->next;
+            p->used++;
+            if (p->used > p->high_water)
+            {
+                p->high_water = p->used;
+            }
+            break;
+        }
+        // only count the class that should have served the request
+        if (first)
+        {
+            p->failed++;
+            first = 0;
+        }
+    }
+    if (s == NULL)
+    {
+        heap_fallbacks++;
+    }
+    portEXIT_CRITICAL(&pool_mux);
+
+    if (s == NULL)
+    {
+#ifdef POOL_DEBUG
+        printf("%s: no slot for %d bytes, using heap\n", __func__, size);
+#endif
+        return malloc(size);
+    }
+    return s;
+}
+
+void pool_free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    uint8_t *p8 = (uint8_t *)ptr;
+    for (int c = 0; c < POOL_CLASS_NUM; c++)
+    {
+        struct pool_t *p = &pools[c];
+        if (p8 >= p->mem && p8 < p->mem + (p->size * p->num))
+        {
+            struct pool_slot_t *s = (struct pool_slot_t *)(p->mem + (((p8 - p->mem) / p->size) * p->size));
+            portENTER_CRITICAL(&pool_mux);
+            s->next = p->free_list;
+            p->free_list = s;
+            p->used--;
+            portEXIT_CRITICAL(&pool_mux);
+            return;
+        }
+    }
+    free(ptr);
+}
+
+void pool_get_stats(const pool_class_t cls, pool_stats_t *stats)
+{
+    struct pool_t *p = &pools[cls];
+    stats->size = p->size;
+    stats->num = p->num;
+    stats->used = p->used;
+    stats->high_water = p->high_water;
+    stats->failed = p->failed;
+}
+
+unsigned int pool_get_heap_fallbacks()
+{
+    return heap_fallbacks;
+}
+
+#ifdef POOL_TEST
+
+#include <assert.h>
+
+int main()
+{
+    pool_stats_t st;
+    void *slots[POOL_FRAME_NUM + 1];
+
+    pool_init();
+
+    // smallest class that fits
+    void *e = pool_alloc(40);
+    assert(e >= (void *)event_mem && e < (void *)(event_mem + sizeof(event_mem)));
+    void *f = pool_alloc(POOL_FRAME_SIZE);
+    assert(f >= (void *)frame_mem && f < (void *)(frame_mem + sizeof(frame_mem)));
+    void *l = pool_alloc(POOL_FRAME_SIZE + 1);
+    assert(l >= (void *)large_mem && l < (void *)(large_mem + sizeof(large_mem)));
+    pool_free(e);
+    pool_free(f);
+    pool_free(l);
+
+    // exhaust the frame class, spill into the large class
+    for (int i = 0; i < POOL_FRAME_NUM; i++)
+    {
+        slots[i] = pool_alloc(100);
+    }
+    pool_get_stats(POOL_FRAME, &st);
+    assert(st.used == POOL_FRAME_NUM);
+    assert(st.high_water == POOL_FRAME_NUM);
+    assert(st.failed == 0);
+    slots[POOL_FRAME_NUM] = pool_alloc(100);
+    assert(slots[POOL_FRAME_NUM] >= (void *)large_mem && slots[POOL_FRAME_NUM] < (void *)(large_mem + sizeof(large_mem)));
+    pool_get_stats(POOL_FRAME, &st);
+    assert(st.failed == 1);
+    for (int i = 0; i <= POOL_FRAME_NUM; i++)
+    {
+        pool_free(slots[i]);
+    }
+    pool_get_stats(POOL_FRAME, &st);
+    assert(st.used == 0);
+    assert(st.high_water == POOL_FRAME_NUM);
+    pool_get_stats(POOL_LARGE, &st);
+    assert(st.used == 0);
+
+    // too big for any class
+    void *h = pool_alloc(POOL_LARGE_SIZE + 1);
+    assert(h != NULL);
+    assert(pool_get_heap_fallbacks() == 1);
+    memset(h, 0, POOL_LARGE_SIZE + 1);
+    pool_free(h);
+
+    return 0;
+}
+#endif
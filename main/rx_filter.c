@@ -0,0 +1,244 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "rx_filter.h"
+
+// LoRaWAN MAC header + FHDR (DevAddr, FCtrl, FCnt) + MIC
+#define LORAWAN_DATA_MIN_LEN 12
+
+void rx_filter_init(rx_filter_t *f)
+{
+    memset(f, 0, sizeof(rx_filter_t));
+}
+
+void rx_filter_free(rx_filter_t *f)
+{
+    free(f->addrs);
+    free(f->used);
+    rx_filter_init(f);
+}
+
+void rx_filter_set_rssi(rx_filter_t *f, const int min_rssi)
+{
+    f->min_rssi = min_rssi;
+    f->active |= 1 << RX_FILTER_RSSI;
+}
+
+void rx_filter_set_snr(rx_filter_t *f, const int min_snr)
+{
+    f->min_snr = min_snr;
+    f->active |= 1 << RX_FILTER_SNR;
+}
+
+void rx_filter_set_length(rx_filter_t *f, const size_t min_len, const size_t max_len)
+{
+    f->min_len = min_len;
+    f->max_len = max_len;
+    f->active |= 1 << RX_FILTER_LENGTH;
+}
+
+void rx_filter_set_mtypes(rx_filter_t *f, const uint8_t mtypes)
+{
+    f->mtypes = mtypes;
+    f->active |= 1 << RX_FILTER_MTYPE;
+}
+
+static size_t devaddr_hash(const uint32_t addr, const size_t slots)
+{
+    // multiplicative hashing, slots is a power of 2
+    return (size_t)((uint32_t)(addr * 2654435761u) >> 16) & (slots - 1);
+}
+
+int rx_filter_devaddr_init(rx_filter_t *f, const size_t num)
+{
+    // at most half full
+    size_t slots = 8;
+    while (slots < num * 2)
+    {
+        slots <<= 1;
+    }
+    free(f->addrs);
+    free(f->used);
+    f->addrs = malloc(slots * sizeof(uint32_t));
+    f->used = calloc(slots, 1);
+    if (f->addrs == NULL || f->used == NULL)
+    {
+        free(f->addrs);
+        free(f->used);
+        f->addrs = NULL;
+        f->used = NULL;
+        return 0;
+    }
+    f->slots = slots;
+    f->num = 0;
+    f->active |= 1 << RX_FILTER_DEVADDR;
+    return 1;
+}
+
+int rx_filter_devaddr_add(rx_filter_t *f, const uint32_t addr)
+{
+    if (f->slots == 0 || f->num * 2 >= f->slots)
+    {
+        return 0;
+    }
+    size_t i = devaddr_hash(addr, f->slots);
+    while (f->used[i])
+    {
+        if (f->addrs[i] == addr)
+        {
+            return 1;
+        }
+        i = (i + 1) & (f->slots - 1);
+    }
+    f->addrs[i] = addr;
+    f->used[i] = 1;
+    f->num++;
+    return 1;
+}
+
+int rx_filter_devaddr_contains(const rx_filter_t *f, const uint32_t addr)
+{
+    if (f->slots == 0)
+    {
+        return 0;
+    }
+    size_t i = devaddr_hash(addr, f->slots);
+    while (f->used[i])
+    {
+        if (f->addrs[i] == addr)
+        {
+            return 1;
+        }
+        i = (i + 1) & (f->slots - 1);
+    }
+    return 0;
+}
+
+static int check(const rx_filter_t *f, const uint8_t *frame, const size_t len, const int rssi, const int snr)
+{
+    if (RX_FILTER_ACTIVE(f, RX_FILTER_RSSI) && rssi < f->min_rssi)
+    {
+        return RX_FILTER_RSSI;
+    }
+    if (RX_FILTER_ACTIVE(f, RX_FILTER_SNR) && snr < f->min_snr)
+    {
+        return RX_FILTER_SNR;
+    }
+    if (RX_FILTER_ACTIVE(f, RX_FILTER_LENGTH) && (len < f->min_len || len > f->max_len))
+    {
+        return RX_FILTER_LENGTH;
+    }
+    int mtype = len > 0 ? frame[0] >> 5 : -1;
+    if (RX_FILTER_ACTIVE(f, RX_FILTER_MTYPE) && (mtype < 0 || (f->mtypes & (1 << mtype)) == 0))
+    {
+        return RX_FILTER_MTYPE;
+    }
+    if (RX_FILTER_ACTIVE(f, RX_FILTER_DEVADDR) && mtype >= 2 && mtype <= 5)
+    {
+        if (len < LORAWAN_DATA_MIN_LEN)
+        {
+            return RX_FILTER_DEVADDR;
+        }
+        uint32_t addr = frame[1] | (frame[2] << 8) | (frame[3] << 16) | ((uint32_t)frame[4] << 24);
+        if (!rx_filter_devaddr_contains(f, addr))
+        {
+            return RX_FILTER_DEVADDR;
+        }
+    }
+    return -1;
+}
+
+int rx_filter_check(rx_filter_t *f, const uint8_t *frame, const size_t len, const int rssi, const int snr)
+{
+    int res = check(f, frame, len, rssi, snr);
+    if (res >= 0)
+    {
+        f->hits[res]++;
+        return 0;
+    }
+    f->passed++;
+    return 1;
+}
+
+#ifdef RX_FILTER_TEST
+
+#include <assert.h>
+
+int main()
+{
+    rx_filter_t f;
+    rx_filter_init(&f);
+
+    // unconfirmed down for 260CA79F
+    uint8_t down[16] = {0x60, 0x9f, 0xa7, 0x0c, 0x26, 0x00, 0x01, 0x00};
+    // join request, no DevAddr
+    uint8_t join[23] = {0x00};
+
+    // nothing configured
+    assert(rx_filter_check(&f, down, sizeof(down), -120, -20));
+    assert(rx_filter_check(&f, down, 0, -120, -20));
+
+    rx_filter_set_rssi(&f, -100);
+    rx_filter_set_snr(&f, -5);
+    assert(!rx_filter_check(&f, down, sizeof(down), -101, 0));
+    assert(!rx_filter_check(&f, down, sizeof(down), -90, -6));
+    assert(rx_filter_check(&f, down, sizeof(down), -100, -5));
+    assert(f.hits[RX_FILTER_RSSI] == 1 && f.hits[RX_FILTER_SNR] == 1 && f.passed == 3);
+
+    rx_filter_set_length(&f, 12, 20);
+    assert(!rx_filter_check(&f, down, 11, 0, 0));
+    assert(!rx_filter_check(&f, join, sizeof(join), 0, 0));
+    assert(f.hits[RX_FILTER_LENGTH] == 2);
+    rx_filter_set_length(&f, 0, 255);
+
+    // unconfirmed / confirmed down
+    rx_filter_set_mtypes(&f, (1 << 3) | (1 << 5));
+    assert(rx_filter_check(&f, down, sizeof(down), 0, 0));
+    assert(!rx_filter_check(&f, join, sizeof(join), 0, 0));
+    assert(!rx_filter_check(&f, down, 0, 0, 0));
+    assert(f.hits[RX_FILTER_MTYPE] == 2);
+
+    // allow list
+    assert(rx_filter_devaddr_init(&f, 100));
+    assert(f.slots == 256);
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        assert(rx_filter_devaddr_add(&f, 0x26000000 + i * 0x100));
+    }
+    assert(rx_filter_devaddr_add(&f, 0x26000000));
+    assert(f.num == 100);
+    assert(!rx_filter_check(&f, down, sizeof(down), 0, 0));
+    assert(rx_filter_devaddr_add(&f, 0x260CA79F));
+    assert(rx_filter_check(&f, down, sizeof(down), 0, 0));
+    assert(!rx_filter_check(&f, down, 11, 0, 0));
+    assert(f.hits[RX_FILTER_DEVADDR] == 2);
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        assert(rx_filter_devaddr_contains(&f, 0x26000000 + i * 0x100));
+        assert(!rx_filter_devaddr_contains(&f, 0x26000001 + i * 0x100));
+    }
+    // join requests have no DevAddr
+    rx_filter_set_mtypes(&f, 0xff);
+    assert(rx_filter_check(&f, join, sizeof(join), 0, 0));
+
+    // full
+    assert(rx_filter_devaddr_init(&f, 2));
+    assert(f.slots == 8);
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        assert(rx_filter_devaddr_add(&f, i));
+    }
+    assert(!rx_filter_devaddr_add(&f, 4));
+    assert(rx_filter_devaddr_contains(&f, 0));
+
+    rx_filter_free(&f);
+    assert(f.active == 0);
+    return 0;
+}
+#endif
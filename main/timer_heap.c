@@ -0,0 +1,401 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "timer_heap.h"
+
+//#define TIMER_HEAP_DEBUG 1
+
+#define TIMER_HEAP_INIT_SLOTS 16
+
+void timer_heap_init(timer_heap_t *th)
+{
+    memset(th, 0, sizeof(timer_heap_t));
+    th->free_slot = -1;
+}
+
+void timer_heap_free(timer_heap_t *th)
+{
+    free(th->timers);
+    free(th->heap);
+    timer_heap_init(th);
+}
+
+void timer_heap_clear(timer_heap_t *th)
+{
+    th->num = 0;
+    th->free_slot = -1;
+    for (int i = th->size - 1; i >= 0; i--)
+    {
+        th->timers[i].id = 0;
+        th->timers[i].pos = th->free_slot;
+        th->free_slot = i;
+    }
+}
+
+static int timer_heap_grow(timer_heap_t *th)
+{
+    int size = th->size == 0 ? TIMER_HEAP_INIT_SLOTS : th->size * 2;
+    if (size > TIMER_HEAP_MAX_SLOTS)
+    {
+        return 0;
+    }
+    timer_heap_timer_t *timers = realloc(th->timers, sizeof(timer_heap_timer_t) * size);
+    if (timers == NULL)
+    {
+        return 0;
+    }
+    th->timers = timers;
+    int *heap = realloc(th->heap, sizeof(int) * size);
+    if (heap == NULL)
+    {
+        return 0;
+    }
+    th->heap = heap;
+    for (int i = size - 1; i >= th->size; i--)
+    {
+        th->timers[i].id = 0;
+        th->timers[i].pos = th->free_slot;
+        th->free_slot = i;
+    }
+    th->size = size;
+    return 1;
+}
+
+static inline void timer_heap_set(timer_heap_t *th, const int pos, const int slot)
+{
+    th->heap[pos] = slot;
+    th->timers[slot].pos = pos;
+}
+
+static void timer_heap_up(timer_heap_t *th, int pos)
+{
+    int slot = th->heap[pos];
+    uint64_t expire = th->timers[slot].expire;
+    while (pos > 0)
+    {
+        int parent = (pos - 1) / 2;
+        if (th->timers[th->heap[parent]].expire <= expire)
+        {
+            break;
+        }
+        timer_heap_set(th, pos, th->heap[parent]);
+        pos = parent;
+    }
+    timer_heap_set(th, pos, slot);
+}
+
+static void timer_heap_down(timer_heap_t *th, int pos)
+{
+    int slot = th->heap[pos];
+    uint64_t expire = th->timers[slot].expire;
+    for (;;)
+    {
+        int child = pos * 2 + 1;
+        if (child >= th->num)
+        {
+            break;
+        }
+        if (child + 1 < th->num && th->timers[th->heap[child + 1]].expire < th->timers[th->heap[child]].expire)
+        {
+            child++;
+        }
+        if (expire <= th->timers[th->heap[child]].expire)
+        {
+            break;
+        }
+        timer_heap_set(th, pos, th->heap[child]);
+        pos = child;
+    }
+    timer_heap_set(th, pos, slot);
+}
+
+static void timer_heap_remove(timer_heap_t *th, const int slot)
+{
+    int pos = th->timers[slot].pos;
+    th->num--;
+    if (pos != th->num)
+    {
+        // move the last timer into the hole, it can go either way
+        int last = th->heap[th->num];
+        timer_heap_set(th, pos, last);
+        timer_heap_down(th, pos);
+        timer_heap_up(th, th->timers[last].pos);
+    }
+    th->timers[slot].id = 0;
+    th->timers[slot].pos = th->free_slot;
+    th->free_slot = slot;
+}
+
+uint32_t timer_heap_add(timer_heap_t *th, const uint64_t now, const uint32_t delay, const uint32_t interval)
+{
+    if (th->free_slot == -1 && !timer_heap_grow(th))
+    {
+#ifdef TIMER_HEAP_DEBUG
+        printf("%s: no free slot\n", __func__);
+#endif
+        return 0;
+    }
+    int slot = th->free_slot;
+    timer_heap_timer_t *t = &th->timers[slot];
+    th->free_slot = t->pos;
+
+    th->serial++;
+    if (th->serial == 0)
+    {
+        th->serial = 1;
+    }
+    t->id = ((uint32_t)th->serial << 16) | slot;
+    t->expire = now + delay;
+    t->interval = interval;
+    th->heap[th->num] = slot;
+    t->pos = th->num;
+    th->num++;
+    timer_heap_up(th, t->pos);
+    return t->id;
+}
+
+int timer_heap_cancel(timer_heap_t *th, const uint32_t id)
+{
+    int slot = TIMER_HEAP_SLOT(id);
+    if (id == 0 || slot >= th->size || th->timers[slot].id != id)
+    {
+        return 0;
+    }
+    timer_heap_remove(th, slot);
+    return 1;
+}
+
+int64_t timer_heap_next(timer_heap_t *th, const uint64_t now)
+{
+    if (th->num == 0)
+    {
+        return -1;
+    }
+    uint64_t expire = th->timers[th->heap[0]].expire;
+    return expire > now ? (int64_t)(expire - now) : 0;
+}
+
+uint32_t timer_heap_expired(timer_heap_t *th, const uint64_t now, int *periodic)
+{
+    if (th->num == 0)
+    {
+        return 0;
+    }
+    int slot = th->heap[0];
+    timer_heap_timer_t *t = &th->timers[slot];
+    if (t->expire > now)
+    {
+        return 0;
+    }
+
+    uint32_t id = t->id;
+    unsigned int late = now - t->expire;
+    th->last_late = late;
+    if (late > th->max_late)
+    {
+        th->max_late = late;
+    }
+    th->fired++;
+
+    *periodic = t->interval != 0;
+    if (t->interval)
+    {
+        // next period is based on the expire time not on now so
+        // being serviced late does not add up
+        t->expire += t->interval;
+        if (t->expire <= now)
+        {
+            uint64_t skip = (now - t->expire) / t->interval + 1;
+            t->expire += skip * t->interval;
+            th->skipped += skip;
+        }
+        timer_heap_down(th, 0);
+    }
+    else
+    {
+        timer_heap_remove(th, slot);
+    }
+    return id;
+}
+
+#ifdef TIMER_HEAP_TEST
+
+#include <assert.h>
+#include <time.h>
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+#define TICK_MS 10
+#define BENCH_MS (60 * 1000)
+
+// simulate duktape_task: wake up on the tick after the next timer expired
+static void bench(const int num)
+{
+    timer_heap_t th;
+    timer_heap_init(&th);
+    uint32_t *ids = malloc(sizeof(uint32_t) * num);
+    uint32_t *intervals = malloc(sizeof(uint32_t) * num);
+    unsigned int *count = calloc(num, sizeof(unsigned int));
+    uint64_t now = 0;
+    int periodic;
+
+    srand(num);
+    double t = now_us();
+    for (int i = 0; i < num; i++)
+    {
+        intervals[i] = 10 + rand() % 990;
+        ids[i] = timer_heap_add(&th, now, intervals[i], intervals[i]);
+    }
+    double add_us = now_us() - t;
+
+    uint64_t late_sum = 0;
+    t = now_us();
+    for (;;)
+    {
+        int64_t next = timer_heap_next(&th, now);
+        // round up to the tick, like ulTaskNotifyTake() would
+        now += ((next + TICK_MS - 1) / TICK_MS) * TICK_MS;
+        if (now > BENCH_MS)
+        {
+            break;
+        }
+        uint32_t id;
+        while ((id = timer_heap_expired(&th, now, &periodic)) != 0)
+        {
+            // fresh heap, slots are handed out in order
+            int i = TIMER_HEAP_SLOT(id);
+            assert(ids[i] == id);
+            count[i]++;
+            late_sum += now - (uint64_t)count[i] * intervals[i];
+        }
+    }
+    double fire_us = now_us() - t;
+
+    // no drift: number of calls matches the interval
+    for (int i = 0; i < num; i++)
+    {
+        assert(count[i] + th.skipped >= BENCH_MS / intervals[i] - 1);
+        assert(count[i] <= BENCH_MS / intervals[i]);
+    }
+    assert(th.max_late < TICK_MS);
+
+    t = now_us();
+    for (int i = 0; i < num; i++)
+    {
+        assert(timer_heap_cancel(&th, ids[i]));
+    }
+    double cancel_us = now_us() - t;
+    assert(th.num == 0);
+
+    printf("%4d timers | fired %7u | late avg %5.2f ms max %2u ms | skipped %u | add %6.3f us | fire %6.3f us | cancel %6.3f us\n",
+           num, th.fired, (double)late_sum / th.fired, th.max_late, th.skipped,
+           add_us / num, fire_us / th.fired, cancel_us / num);
+
+    free(ids);
+    free(intervals);
+    free(count);
+    timer_heap_free(&th);
+}
+
+int main()
+{
+    timer_heap_t th;
+    int periodic;
+
+    timer_heap_init(&th);
+    assert(timer_heap_next(&th, 0) == -1);
+
+    // ordering
+    uint32_t a = timer_heap_add(&th, 0, 30, 0);
+    uint32_t b = timer_heap_add(&th, 0, 10, 0);
+    uint32_t c = timer_heap_add(&th, 0, 20, 0);
+    assert(timer_heap_next(&th, 0) == 10);
+    assert(timer_heap_expired(&th, 9, &periodic) == 0);
+    assert(timer_heap_expired(&th, 100, &periodic) == b);
+    assert(periodic == 0);
+    assert(timer_heap_expired(&th, 100, &periodic) == c);
+    assert(timer_heap_expired(&th, 100, &periodic) == a);
+    assert(timer_heap_expired(&th, 100, &periodic) == 0);
+    assert(th.max_late == 90);
+
+    // cancel, stale ids
+    a = timer_heap_add(&th, 0, 30, 0);
+    b = timer_heap_add(&th, 0, 10, 0);
+    c = timer_heap_add(&th, 0, 20, 0);
+    assert(timer_heap_cancel(&th, b));
+    assert(!timer_heap_cancel(&th, b));
+    uint32_t d = timer_heap_add(&th, 0, 5, 0);
+    assert(TIMER_HEAP_SLOT(d) == TIMER_HEAP_SLOT(b));
+    assert(d != b);
+    assert(!timer_heap_cancel(&th, b));
+    assert(timer_heap_expired(&th, 100, &periodic) == d);
+    assert(timer_heap_expired(&th, 100, &periodic) == c);
+    assert(timer_heap_cancel(&th, a));
+    assert(th.num == 0);
+
+    // interval timer serviced late does not drift
+    a = timer_heap_add(&th, 0, 100, 100);
+    for (int i = 1; i <= 10; i++)
+    {
+        assert(timer_heap_expired(&th, i * 100 + 7, &periodic) == a);
+        assert(periodic == 1);
+        assert(timer_heap_next(&th, i * 100 + 7) == 93);
+    }
+    // missed periods are skipped
+    assert(timer_heap_expired(&th, 1350, &periodic) == a);
+    assert(th.skipped == 2);
+    assert(timer_heap_next(&th, 1350) == 50);
+    assert(timer_heap_cancel(&th, a));
+
+    // grow
+    uint32_t ids[100];
+    for (int i = 0; i < 100; i++)
+    {
+        ids[i] = timer_heap_add(&th, 0, 100 - i, 0);
+    }
+    for (int i = 99; i >= 0; i--)
+    {
+        assert(timer_heap_expired(&th, 1000, &periodic) == ids[i]);
+    }
+    // random add and cancel keep the heap ordered
+    for (int i = 0; i < 100; i++)
+    {
+        ids[i] = timer_heap_add(&th, 0, rand() % 1000, 0);
+    }
+    for (int i = 0; i < 100; i += 3)
+    {
+        assert(timer_heap_cancel(&th, ids[i]));
+    }
+    int64_t last = 0;
+    for (int i = 0; i < 66; i++)
+    {
+        int64_t next = timer_heap_next(&th, 0);
+        assert(next >= last);
+        last = next;
+        assert(timer_heap_expired(&th, 1000, &periodic) != 0);
+    }
+    assert(th.num == 0);
+
+    timer_heap_clear(&th);
+    assert(timer_heap_add(&th, 0, 1, 0) != 0);
+    timer_heap_free(&th);
+
+    int sizes[] = {1, 10, 100, 500};
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        bench(sizes[i]);
+    }
+    return 0;
+}
+#endif
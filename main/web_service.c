@@ -65,6 +65,11 @@ Commands:
 - **reboot** (reboot the board, same as Platform.reboot())
 - **deletefile=\\<filename\\>** (delete \\<filename\\>, same as FileSystem.unlink(filename))
 
+### URL: /stats
+
+- GET returns JavaScript heap and garbage collection statistics as JSON (the fields of Platform.getHeapStats(), the arena and the free system heap).
+  Works without the application's help and is available in read only mode.
+
 Example:
 ```
 
@@ -90,6 +95,8 @@ OK
 #define BUF_SIZE 1024
 #define FILE_URI "/file"
 #define CONTROL_URI "/control"
+#define STATS_URI "/stats"
+#define STATS_BUF_SIZE 1024
 #define PROTECTED_FILE '_'
 
 struct control_name_t
@@ -115,6 +122,13 @@ void webserver_set_control_func(webserver_control_function_t *func)
     control_func = func;
 }
 
+static webserver_stats_function_t *stats_func = NULL;
+
+void webserver_set_stats_func(webserver_stats_function_t *func)
+{
+    stats_func = func;
+}
+
 static esp_err_t post_handler(httpd_req_t *req)
 {
     size_t url_len = httpd_req_get_url_query_len(req);
@@ -326,6 +340,26 @@ static esp_err_t control_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+static esp_err_t stats_handler(httpd_req_t *req)
+{
+    char *buf = malloc(STATS_BUF_SIZE);
+    int len = -1;
+    if (buf != NULL && stats_func != NULL)
+    {
+        len = stats_func(buf, STATS_BUF_SIZE);
+    }
+    if (len < 0)
+    {
+        free(buf);
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, buf, len);
+    free(buf);
+    return ESP_OK;
+}
+
 static esp_err_t get_index_handler(httpd_req_t *req)
 {
     return get_file_by_name(req, "index.html");
@@ -349,6 +383,12 @@ static const httpd_uri_t index_file = {
     .handler = get_index_handler,
 };
 
+static const httpd_uri_t stats = {
+    .uri = STATS_URI,
+    .method = HTTP_GET,
+    .handler = stats_handler,
+};
+
 static const httpd_uri_t control_file = {
     .uri = CONTROL_URI,
     .method = HTTP_GET,
@@ -381,6 +421,7 @@ int webserver_start(int read_only)
         }
         httpd_register_uri_handler(server, &get_file);
         httpd_register_uri_handler(server, &index_file);
+        httpd_register_uri_handler(server, &stats);
         running = 1;
         return 1;
     }
@@ -32,6 +32,8 @@ function OnStart() {
             return;
         }
 
+        // only downlinks for our device reach OnEvent
+        LoRa.setRxFilter({ MType: [3, 5], DevAddr: [parseInt(DeviceAddrHex, 16)] });
         startScan();
         packetCallback = processLora;
     }
@@ -61,6 +63,7 @@ function OnStart() {
             answers: [],
         };
         packetCallback = processDownlink;
+        LoRa.setRxFilter({ MType: [3, 5], DevAddr: [parseInt(DeviceAddrHex, 16)] });
         listenRX2();
     }
 }
@@ -112,25 +115,31 @@ function sendUp(pkt, channel) {
     var chans = loraWanUpDownChannel915(channel);
     print("sending on: " + chans.upFreq + "\n");
     LoRa.loraIdle();
-    if (!LoRa.setFrequency(chans.upFreq)) {
+    if (!LoRa.setConfig({
+            Frequency: chans.upFreq,
+            BW: chans.bw,
+            SF: chans.sf,
+            TxPower: 17,
+            PreambleLen: 8,
+            IQInvert: false,
+            SyncWord: 0x34,
+            CRC: true
+        })) {
         print("send freq error\n");
     }
+    scanState.downFreq = chans.downFreq;
+    scanState.txId = LoRa.sendPacket(Uint8Array.plainOf(pkt));
+    if (scanState.txId === false) {
+        print("send error\n");
+        listenDown();
+    }
+}
 
-    LoRa.setBW(chans.bw);
-    LoRa.setSF(chans.sf);
-    LoRa.setTxPower(17);
-    LoRa.setPreambleLen(8);
-    LoRa.setIQMode(false);
-    LoRa.setSyncWord(0x34);
-    LoRa.setCRC(true);
-    LoRa.loraReceive();
-    LoRa.sendPacket(Uint8Array.plainOf(pkt));
-
+// the modem can be reconfigured once the uplink is sent
+function listenDown() {
     LoRa.loraIdle();
-    LoRa.setBW(500E3);
-    LoRa.setIQMode(true);
-    print("listening on: " + chans.downFreq + "\n");
-    if (!LoRa.setFrequency(chans.downFreq)) {
+    print("listening on: " + scanState.downFreq + "\n");
+    if (!LoRa.setConfig({ Frequency: scanState.downFreq, BW: 500E3, IQInvert: true })) {
         print("recv freq error\n");
     }
     LoRa.loraReceive();
@@ -152,15 +161,16 @@ function listenRX2() {
     var chans = loraWanUpDownChannel915(0);
     LoRa.loraIdle();
 
-    LoRa.setSF(8);
-    LoRa.setTxPower(1);
-    LoRa.setPreambleLen(8);
-    LoRa.setSyncWord(0x34);
-    LoRa.setCRC(true);
-    LoRa.setBW(500E3);
-    LoRa.setIQMode(true);
     print("Rx2 listening on: " + chans.down2Freq + "\n");
-    if (!LoRa.setFrequency(chans.down2Freq)) {
+    if (!LoRa.setConfig({
+            Frequency: chans.down2Freq,
+            SF: 8,
+            PreambleLen: 8,
+            SyncWord: 0x34,
+            CRC: true,
+            BW: 500E3,
+            IQInvert: true
+        })) {
         print("recv freq error\n");
     }
     LoRa.loraReceive();
@@ -186,4 +196,8 @@ function OnEvent(event) {
     if (event.EventType == 0) {
         packetCallback(event.EventData);
     }
+    // lora_tx_done, lora_tx_failed
+    if ((event.EventType == 12 || event.EventType == 13) && event.MsgId == scanState.txId) {
+        listenDown();
+    }
 }
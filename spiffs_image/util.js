@@ -3,6 +3,9 @@
 "class": "Util",
 "longtext":"
 A simple utility library.
+
+Can be loaded into the global scope with `Platform.loadLibrary('/util.js')`
+or as a module with `var util = require('util');`.
 "
 }
 */
@@ -232,3 +235,17 @@ function copyIndexLen(src, sidx, dst, didx, len) {
         dst[didx+i] = src[sidx+i];
     }
 }
+
+if (typeof module !== 'undefined') {
+    module.exports = {
+        crc16: crc16,
+        fromTwosComplement: fromTwosComplement,
+        arrayEqual: arrayEqual,
+        hexToBin: hexToBin,
+        binToHex: binToHex,
+        reverse: reverse,
+        htons: htons,
+        htonl: htonl,
+        copyIndexLen: copyIndexLen
+    };
+}
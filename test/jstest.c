@@ -1,16 +1,192 @@
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include <duktape.h>
 
 #include "duk_util.h"
+#include "duk_helpers.h"
+#include "duk_arena.h"
 
 duk_context *ctx;
 
+// --- START - dispatch micro benchmark (./jstest -bench)
+
+#define BENCH_ROUNDS 100000
+
+static const char *bench_app =
+    "var events = 0, timers = 0;"
+    "function OnStart() {}"
+    "function OnEvent(event) { events += event.EventType; }"
+    "function OnTimer() { timers++; }";
+
+static const char *key_names[] = {"EventType", "EventData", "LoRaRSSI", "LoRaSNR", "TimeStamp"};
+static void *keys[5];
+static uint8_t payload[32];
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// previous dispatch: global lookup and property names interned per event
+static void legacy_event()
+{
+    duk_push_global_object(ctx);
+    duk_get_prop_string(ctx, -1, "OnEvent");
+    duk_push_object(ctx);
+    duk_push_number(ctx, 0);
+    duk_put_prop_string(ctx, -2, "EventType");
+    uint8_t *buf = (uint8_t *)duk_push_fixed_buffer(ctx, sizeof(payload));
+    memcpy(buf, payload, sizeof(payload));
+    duk_put_prop_string(ctx, -2, "EventData");
+    duk_push_number(ctx, -80);
+    duk_put_prop_string(ctx, -2, "LoRaRSSI");
+    duk_push_number(ctx, 7);
+    duk_put_prop_string(ctx, -2, "LoRaSNR");
+    duk_push_number(ctx, 1600000000);
+    duk_put_prop_string(ctx, -2, "TimeStamp");
+    duk_pcall(ctx, 1);
+    duk_pop_2(ctx);
+}
+
+// stashed handler and interned keys
+static void stash_event(void *handlers)
+{
+    duk_util_push_handler(ctx, handlers, DUK_UTIL_ON_EVENT);
+    duk_push_object(ctx);
+    ADD_KEY_NUMBER(keys[0], 0);
+    duk_push_heapptr(ctx, keys[1]);
+    uint8_t *buf = (uint8_t *)duk_push_fixed_buffer(ctx, sizeof(payload));
+    memcpy(buf, payload, sizeof(payload));
+    duk_put_prop(ctx, -3);
+    ADD_KEY_NUMBER(keys[2], -80);
+    ADD_KEY_NUMBER(keys[3], 7);
+    ADD_KEY_NUMBER(keys[4], 1600000000);
+    duk_pcall(ctx, 1);
+    duk_pop(ctx);
+}
+
+static void bench()
+{
+    void *handlers = duk_util_handlers_install(ctx);
+    duk_util_intern_keys(ctx, "bench_keys", key_names, keys, 5);
+    duk_util_run(ctx, bench_app);
+    duk_util_handlers_install(ctx);
+
+    double t = now_us();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+    {
+        duk_util_run(ctx, "OnTimer();");
+    }
+    double legacy_timer = now_us() - t;
+
+    t = now_us();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+    {
+        duk_util_call_handler(ctx, handlers, DUK_UTIL_ON_TIMER);
+    }
+    double stash_timer = now_us() - t;
+
+    t = now_us();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+    {
+        legacy_event();
+    }
+    double legacy_ev = now_us() - t;
+
+    t = now_us();
+    for (int i = 0; i < BENCH_ROUNDS; i++)
+    {
+        stash_event(handlers);
+    }
+    double stash_ev = now_us() - t;
+
+    // reassigning a handler from JavaScript is picked up
+    duk_util_run(ctx, "OnTimer = function() { timers += 1000; };");
+    duk_util_call_handler(ctx, handlers, DUK_UTIL_ON_TIMER);
+    duk_peval_string(ctx, "timers");
+    printf("timers: %d (expect %d)\n", duk_get_int(ctx, -1), 2 * BENCH_ROUNDS + 1000);
+    duk_pop(ctx);
+
+    printf("OnTimer | eval %8.3f us | stash %8.3f us | speedup %5.1fx\n",
+           legacy_timer / BENCH_ROUNDS, stash_timer / BENCH_ROUNDS, legacy_timer / stash_timer);
+    printf("OnEvent | eval %8.3f us | stash %8.3f us | speedup %5.1fx\n",
+           legacy_ev / BENCH_ROUNDS, stash_ev / BENCH_ROUNDS, legacy_ev / stash_ev);
+}
+// --- END - dispatch micro benchmark
+
+// --- START - heap allocator benchmark (./jstest -arena)
+
+#define ARENA_SIZE (256 * 1024)
+#define ARENA_ROUNDS 20
+
+// objects, strings and buffers, roughly what an app does per LoRa frame
+static const char *arena_app =
+    "var keep = [];"
+    "function work() {"
+    "  for (var i = 0; i < 2000; i++) {"
+    "    var o = { id: i, name: 'node' + i, rssi: -i, data: new Uint8Array(16 + i % 64) };"
+    "    keep[i % 200] = o;"
+    "    JSON.stringify(o);"
+    "  }"
+    "}";
+
+static double heap_bench(duk_context *bctx)
+{
+    duk_util_run(bctx, arena_app);
+    double t = now_us();
+    for (int i = 0; i < ARENA_ROUNDS; i++)
+    {
+        duk_util_run(bctx, "work();");
+    }
+    return (now_us() - t) / ARENA_ROUNDS;
+}
+
+static void arena_bench()
+{
+    duk_context *dctx = duk_create_heap_default();
+    double sys_us = heap_bench(dctx);
+    duk_destroy_heap(dctx);
+
+    static uint8_t mem[ARENA_SIZE];
+    duk_arena_t arena;
+    duk_arena_stats_t st;
+    duk_arena_init(&arena, mem, sizeof(mem));
+    double arena_us = 0;
+    // same arena over several heaps, like resets on the device
+    for (int i = 0; i < 3; i++)
+    {
+        duk_context *actx = duk_create_heap(duk_arena_alloc_func, duk_arena_realloc_func, duk_arena_free_func, &arena, NULL);
+        arena_us = heap_bench(actx);
+        duk_destroy_heap(actx);
+        duk_arena_get_stats(&arena, &st);
+        printf("heap %d: live after destroy %u, peak %u, top %u, fallbacks %u, failed %u\n",
+               i, (unsigned int)st.live, (unsigned int)st.peak, (unsigned int)st.top, st.fallbacks, st.failed);
+        duk_arena_reset(&arena);
+    }
+    printf("work() | system heap %8.1f us | arena %8.1f us | allocs %u\n", sys_us, arena_us, st.allocs);
+}
+// --- END - heap allocator benchmark
+
 int main(int argc, char **argv)
 {
 
     ctx = duk_create_heap_default();
     duk_util_register(ctx);
 
+    if (argc > 1 && strcmp(argv[1], "-bench") == 0)
+    {
+        bench();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "-arena") == 0)
+    {
+        arena_bench();
+        return 0;
+    }
+
     duk_util_load_and_run(ctx, argv[1], "OnStart();");
 }
@@ -0,0 +1,1110 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+
+#include "lora_sim.h"
+#include "lora.h"
+
+// not in lora.h
+int lora_read_reg(int reg);
+void lora_write_reg(int reg, int val);
+
+// SX127x LoRa registers (see lora.c)
+#define REG_FIFO 0x00
+#define REG_OP_MODE 0x01
+#define REG_FRF_MSB 0x06
+#define REG_FRF_MID 0x07
+#define REG_FRF_LSB 0x08
+#define REG_PA_CONFIG 0x09
+#define REG_LNA 0x0c
+#define REG_FIFO_ADDR_PTR 0x0d
+#define REG_FIFO_TX_BASE_ADDR 0x0e
+#define REG_FIFO_RX_BASE_ADDR 0x0f
+#define REG_FIFO_RX_CURRENT_ADDR 0x10
+#define REG_IRQ_FLAGS 0x12
+#define REG_RX_NB_BYTES 0x13
+#define REG_PKT_SNR_VALUE 0x19
+#define REG_PKT_RSSI_VALUE 0x1a
+#define REG_HOP_CHANNEL 0x1c
+#define REG_MODEM_CONFIG_1 0x1d
+#define REG_MODEM_CONFIG_2 0x1e
+#define REG_PREAMBLE_MSB 0x20
+#define REG_PREAMBLE_LSB 0x21
+#define REG_PAYLOAD_LENGTH 0x22
+#define REG_HOP_PERIOD 0x24
+#define REG_MODEM_CONFIG_3 0x26
+#define REG_DETECTION_OPTIMIZE 0x31
+#define REG_DETECTION_THRESHOLD 0x37
+#define REG_SYNC_WORD 0x39
+#define REG_DIO_MAPPING_1 0x40
+#define REG_VERSION 0x42
+
+#define MODE_LONG_RANGE_MODE 0x80
+#define MODE_SLEEP 0x00
+#define MODE_STDBY 0x01
+#define MODE_TX 0x03
+#define MODE_RX_CONTINUOUS 0x05
+#define MODE_RX_SINGLE 0x06
+#define MODE_CAD 0x07
+
+#define IRQ_CAD_DETECT_MASK 0x01
+#define IRQ_FHSS_CHANGE_CHANNEL 0x02
+#define IRQ_CAD_DONE_MASK 0x04
+#define IRQ_TX_DONE_MASK 0x08
+#define IRQ_VALID_HDR_MASK 0x10
+#define IRQ_PAYLOAD_CRC_ERROR_MASK 0x20
+#define IRQ_RX_DONE_MASK 0x40
+
+#define GPIO_NUM 40
+#define SIM_QUEUE_MAX 64
+#define SPI_HZ 9000000.0
+
+static struct
+{
+    uint8_t regs[0x80];
+    uint8_t fifo[256];
+    // where the next received frame goes
+    uint8_t rx_addr;
+
+    uint8_t tx[SIM_TX_MAX][256];
+    int tx_len[SIM_TX_MAX];
+    int tx_num;
+    // TX stays on air until sim_tx_finish()
+    int tx_hold;
+    // CADs left that detect activity
+    int cad_busy;
+    uint32_t random;
+
+    gpio_isr_t isr[GPIO_NUM];
+    void *isr_arg[GPIO_NUM];
+    int isr_enabled[GPIO_NUM];
+
+    int address_bits;
+    int queue_size;
+    spi_transaction_t *queue[SIM_QUEUE_MAX];
+    int queue_len;
+    int lock_held;
+
+    sim_stats_t stats;
+} sim;
+
+// -- SX127x model
+
+static int fifo_ok()
+{
+    if ((sim.regs[REG_OP_MODE] & MODE_LONG_RANGE_MODE) == 0 || (sim.regs[REG_OP_MODE] & 0x07) == MODE_SLEEP)
+    {
+        // FIFO is only accessible in LoRa mode and not in sleep
+        sim.stats.violations++;
+        return 0;
+    }
+    return 1;
+}
+
+static void dio(const int gpio)
+{
+    if (sim.isr[gpio] != NULL && sim.isr_enabled[gpio])
+    {
+        if (gpio == SIM_GPIO_DIO0)
+        {
+            sim.stats.dio0++;
+        }
+        else
+        {
+            sim.stats.dio2++;
+        }
+        sim.isr[gpio](sim.isr_arg[gpio]);
+    }
+}
+
+static void set_mode(const uint8_t val)
+{
+    int old = sim.regs[REG_OP_MODE] & 0x07;
+    int mode = val & 0x07;
+    sim.regs[REG_OP_MODE] = val;
+    if (mode == MODE_SLEEP)
+    {
+        // FIFO content is lost in sleep
+        memset(sim.fifo, 0, sizeof(sim.fifo));
+    }
+    if ((mode == MODE_RX_CONTINUOUS || mode == MODE_RX_SINGLE) && old != MODE_RX_CONTINUOUS && old != MODE_RX_SINGLE)
+    {
+        sim.rx_addr = sim.regs[REG_FIFO_RX_BASE_ADDR];
+    }
+    if (mode == MODE_TX && old != MODE_TX)
+    {
+        int len = sim.regs[REG_PAYLOAD_LENGTH];
+        if (sim.tx_num < SIM_TX_MAX)
+        {
+            for (int i = 0; i < len; i++)
+            {
+                sim.tx[sim.tx_num][i] = sim.fifo[(uint8_t)(sim.regs[REG_FIFO_TX_BASE_ADDR] + i)];
+            }
+            sim.tx_len[sim.tx_num] = len;
+            sim.tx_num++;
+        }
+        if (!sim.tx_hold)
+        {
+            sim_tx_finish();
+        }
+    }
+    if (mode == MODE_CAD && old != MODE_CAD)
+    {
+        // CAD is done right away, the modem goes back to standby
+        sim.stats.cad++;
+        sim.regs[REG_IRQ_FLAGS] |= IRQ_CAD_DONE_MASK;
+        if (sim.cad_busy > 0)
+        {
+            sim.cad_busy--;
+            sim.regs[REG_IRQ_FLAGS] |= IRQ_CAD_DETECT_MASK;
+        }
+        sim.regs[REG_OP_MODE] = (sim.regs[REG_OP_MODE] & 0xf8) | MODE_STDBY;
+        if ((sim.regs[REG_DIO_MAPPING_1] >> 6) == 2)
+        {
+            dio(SIM_GPIO_DIO0);
+        }
+    }
+}
+
+void sim_set_cad_busy(const int num)
+{
+    sim.cad_busy = num;
+}
+
+int sim_tx_finish(void)
+{
+    if (sim_mode() != MODE_TX)
+    {
+        return 0;
+    }
+    // the modem goes back to standby after sending
+    sim.regs[REG_IRQ_FLAGS] |= IRQ_TX_DONE_MASK;
+    sim.regs[REG_OP_MODE] = (sim.regs[REG_OP_MODE] & 0xf8) | MODE_STDBY;
+    if ((sim.regs[REG_DIO_MAPPING_1] >> 6) == 1)
+    {
+        dio(SIM_GPIO_DIO0);
+    }
+    return 1;
+}
+
+void sim_set_tx_hold(const int hold)
+{
+    sim.tx_hold = hold;
+}
+
+static void reg_write(const int reg, const uint8_t val)
+{
+    switch (reg)
+    {
+    case REG_FIFO:
+        if (fifo_ok())
+        {
+            sim.fifo[sim.regs[REG_FIFO_ADDR_PTR]++] = val;
+        }
+        break;
+    case REG_OP_MODE:
+        set_mode(val);
+        break;
+    case REG_IRQ_FLAGS:
+        // write 1 to clear
+        sim.regs[REG_IRQ_FLAGS] &= ~val;
+        break;
+    case REG_FIFO_RX_CURRENT_ADDR:
+    case REG_RX_NB_BYTES:
+    case REG_PKT_SNR_VALUE:
+    case REG_PKT_RSSI_VALUE:
+    case REG_HOP_CHANNEL:
+    case REG_VERSION:
+        // read only
+        break;
+    default:
+        sim.regs[reg] = val;
+        break;
+    }
+}
+
+static uint8_t reg_read(const int reg)
+{
+    if (reg == REG_FIFO)
+    {
+        return fifo_ok() ? sim.fifo[sim.regs[REG_FIFO_ADDR_PTR]++] : 0;
+    }
+    return sim.regs[reg];
+}
+
+static void spi_exec(spi_transaction_t *t)
+{
+    // first byte is the address: bit 7 = write, the address increments except for the FIFO
+    assert(sim.address_bits == 8);
+    int reg = t->addr & 0x7f;
+    int write = (t->addr & 0x80) != 0;
+    int len = t->length / 8;
+    const uint8_t *tx = (t->flags & SPI_TRANS_USE_TXDATA) ? t->tx_data : t->tx_buffer;
+    uint8_t *rx = (t->flags & SPI_TRANS_USE_RXDATA) ? t->rx_data : t->rx_buffer;
+    assert(len > 0);
+    assert(!((t->flags & SPI_TRANS_USE_TXDATA) && len > 4));
+    assert(!((t->flags & SPI_TRANS_USE_RXDATA) && len > 4));
+
+    for (int i = 0; i < len; i++)
+    {
+        if (write)
+        {
+            assert(tx != NULL);
+            reg_write(reg, tx[i]);
+        }
+        else
+        {
+            uint8_t val = reg_read(reg);
+            if (rx != NULL)
+            {
+                rx[i] = val;
+            }
+        }
+        if (reg != REG_FIFO)
+        {
+            reg = (reg + 1) & 0x7f;
+        }
+    }
+    sim.stats.transactions++;
+    sim.stats.bytes += len + 1;
+}
+
+void sim_reset(void)
+{
+    memset(&sim, 0, sizeof(sim));
+    // FSK standby after power on
+    sim.regs[REG_OP_MODE] = 0x09;
+    sim.regs[REG_VERSION] = 0x12;
+    sim.regs[REG_LNA] = 0x20;
+    sim.regs[REG_MODEM_CONFIG_1] = 0x72;
+    sim.regs[REG_MODEM_CONFIG_2] = 0x70;
+    sim.regs[REG_FIFO_TX_BASE_ADDR] = 0x80;
+    sim.regs[REG_PAYLOAD_LENGTH] = 0x01;
+    sim.regs[REG_SYNC_WORD] = 0x12;
+}
+
+void sim_get_stats(sim_stats_t *stats)
+{
+    memcpy(stats, &sim.stats, sizeof(sim_stats_t));
+}
+
+uint8_t sim_get_reg(const int reg)
+{
+    return sim.regs[reg & 0x7f];
+}
+
+void sim_set_reg(const int reg, const uint8_t val)
+{
+    sim.regs[reg & 0x7f] = val;
+}
+
+int sim_mode(void)
+{
+    return sim.regs[REG_OP_MODE] & 0x07;
+}
+
+uint32_t sim_frf(void)
+{
+    return (sim.regs[REG_FRF_MSB] << 16) | (sim.regs[REG_FRF_MID] << 8) | sim.regs[REG_FRF_LSB];
+}
+
+int sim_rx(const uint8_t *frame, const int len, const int pkt_rssi, const int pkt_snr, const int crc_ok)
+{
+    int mode = sim_mode();
+    if ((sim.regs[REG_OP_MODE] & MODE_LONG_RANGE_MODE) == 0 || (mode != MODE_RX_CONTINUOUS && mode != MODE_RX_SINGLE))
+    {
+        return 0;
+    }
+    sim.regs[REG_FIFO_RX_CURRENT_ADDR] = sim.rx_addr;
+    for (int i = 0; i < len; i++)
+    {
+        sim.fifo[sim.rx_addr++] = frame[i];
+    }
+    sim.regs[REG_RX_NB_BYTES] = len;
+    // HF port above 779 MHz (61.035 Hz per FRF step)
+    double mhz = sim_frf() * 61.03515625 / 1e6;
+    sim.regs[REG_PKT_RSSI_VALUE] = pkt_rssi + (mhz > 779 ? 157 : 164);
+    sim.regs[REG_PKT_SNR_VALUE] = (uint8_t)(int8_t)(pkt_snr * 4);
+    sim.regs[REG_IRQ_FLAGS] |= IRQ_RX_DONE_MASK | IRQ_VALID_HDR_MASK | (crc_ok ? 0 : IRQ_PAYLOAD_CRC_ERROR_MASK);
+    if (mode == MODE_RX_SINGLE)
+    {
+        sim.regs[REG_OP_MODE] = (sim.regs[REG_OP_MODE] & 0xf8) | MODE_STDBY;
+    }
+    if ((sim.regs[REG_DIO_MAPPING_1] >> 6) == 0)
+    {
+        dio(SIM_GPIO_DIO0);
+    }
+    return 1;
+}
+
+int sim_hop(const int channel)
+{
+    if (sim.regs[REG_HOP_PERIOD] == 0)
+    {
+        return 0;
+    }
+    sim.regs[REG_HOP_CHANNEL] = (sim.regs[REG_HOP_CHANNEL] & 0xc0) | (channel & 0x3f);
+    sim.regs[REG_IRQ_FLAGS] |= IRQ_FHSS_CHANGE_CHANNEL;
+    if (((sim.regs[REG_DIO_MAPPING_1] >> 4) & 0x03) == 0)
+    {
+        dio(SIM_GPIO_DIO2);
+    }
+    return 1;
+}
+
+int sim_tx_get(uint8_t *buf, const int size)
+{
+    if (sim.tx_num == 0)
+    {
+        return -1;
+    }
+    int len = sim.tx_len[0] < size ? sim.tx_len[0] : size;
+    memcpy(buf, sim.tx[0], len);
+    sim.tx_num--;
+    memmove(sim.tx[0], sim.tx[1], sizeof(sim.tx[0]) * sim.tx_num);
+    memmove(&sim.tx_len[0], &sim.tx_len[1], sizeof(int) * sim.tx_num);
+    return len;
+}
+
+int sim_tx_num(void)
+{
+    return sim.tx_num;
+}
+
+// -- ESP-IDF / FreeRTOS
+
+void vTaskDelay(const TickType_t ticks)
+{
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return &sim;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return &sim.lock_held;
+}
+
+int xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks)
+{
+    // single threaded, taking it twice would dead lock on the device
+    assert(sim.lock_held == 0);
+    sim.lock_held = 1;
+    return 1;
+}
+
+int xSemaphoreGive(SemaphoreHandle_t s)
+{
+    sim.lock_held = 0;
+    return 1;
+}
+
+uint32_t esp_random(void)
+{
+    // fixed sequence (xorshift32)
+    if (sim.random == 0)
+    {
+        sim.random = 2463534242u;
+    }
+    sim.random ^= sim.random << 13;
+    sim.random ^= sim.random >> 17;
+    sim.random ^= sim.random << 5;
+    return sim.random;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void gpio_pad_select_gpio(const int gpio)
+{
+}
+
+esp_err_t gpio_set_direction(const int gpio, const gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(const int gpio, const int level)
+{
+    // CS belongs to the SPI peripheral
+    if (gpio == SIM_GPIO_CS)
+    {
+        sim.stats.violations++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(const int gpio, const gpio_int_type_t type)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(const int gpio)
+{
+    sim.isr_enabled[gpio] = 1;
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(const int gpio)
+{
+    sim.isr_enabled[gpio] = 0;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(const int gpio, gpio_isr_t handler, void *arg)
+{
+    sim.isr[gpio] = handler;
+    sim.isr_arg[gpio] = arg;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(const int gpio)
+{
+    sim.isr[gpio] = NULL;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_initialize(const spi_host_device_t host, const spi_bus_config_t *bus, const int dma_chan)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(const spi_host_device_t host, const spi_device_interface_config_t *dev, spi_device_handle_t *handle)
+{
+    assert(dev->spics_io_num == SIM_GPIO_CS);
+    sim.address_bits = dev->address_bits;
+    sim.queue_size = dev->queue_size;
+    *handle = (spi_device_handle_t)&sim;
+    return ESP_OK;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *t)
+{
+    // not allowed while queued transactions are pending
+    if (sim.queue_len > 0)
+    {
+        sim.stats.violations++;
+        return ESP_FAIL;
+    }
+    spi_exec(t);
+    return ESP_OK;
+}
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *t)
+{
+    return spi_device_polling_transmit(handle, t);
+}
+
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *t, const TickType_t ticks)
+{
+    if (sim.queue_len >= sim.queue_size)
+    {
+        sim.stats.violations++;
+        return ESP_FAIL;
+    }
+    spi_exec(t);
+    sim.queue[sim.queue_len++] = t;
+    return ESP_OK;
+}
+
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **t, const TickType_t ticks)
+{
+    if (sim.queue_len == 0)
+    {
+        sim.stats.violations++;
+        return ESP_FAIL;
+    }
+    *t = sim.queue[0];
+    sim.queue_len--;
+    memmove(&sim.queue[0], &sim.queue[1], sizeof(spi_transaction_t *) * sim.queue_len);
+    return ESP_OK;
+}
+
+// -- tests
+
+static int isr_recv;
+static int isr_fhss;
+
+static void isr_recv_handler(void *arg)
+{
+    isr_recv++;
+}
+
+static void isr_fhss_handler(void *arg)
+{
+    isr_fhss++;
+}
+
+static void setup()
+{
+    sim_reset();
+    lora_config(SIM_GPIO_CS, SIM_GPIO_RST, SIM_GPIO_MISO, SIM_GPIO_MOSI, SIM_GPIO_SCK);
+    lora_config_dio(SIM_GPIO_DIO0, SIM_GPIO_DIO1, SIM_GPIO_DIO2);
+    assert(lora_init());
+    // driver state survives sim_reset(), the modem starts in explicit header mode
+    lora_explicit_header_mode();
+}
+
+static void check_clean()
+{
+    sim_stats_t st;
+    sim_get_stats(&st);
+    assert(st.violations == 0);
+    assert(sim.queue_len == 0);
+    assert(sim.lock_held == 0);
+}
+
+static void test_config()
+{
+    setup();
+    assert(sim_mode() == MODE_SLEEP);
+    assert(sim_get_reg(REG_OP_MODE) & MODE_LONG_RANGE_MODE);
+    assert(sim_get_reg(REG_FIFO_TX_BASE_ADDR) == 0);
+    assert(sim_get_reg(REG_FIFO_RX_BASE_ADDR) == 0);
+    assert(sim_get_reg(REG_LNA) == 0x23);
+    assert(sim_get_reg(REG_MODEM_CONFIG_3) == 0x04);
+    assert(sim_get_reg(REG_PA_CONFIG) == 0x80);
+
+    // 61.035 Hz per step, the driver rounds a little differently
+    lora_set_frequency(902.3);
+    double ideal = 902.3e6 / 61.03515625;
+    assert(abs((int)sim_frf() - (int)ideal) < 64);
+    lora_set_frequency(433.175);
+    ideal = 433.175e6 / 61.03515625;
+    assert(abs((int)sim_frf() - (int)ideal) < 64);
+
+    lora_set_spreading_factor(6);
+    assert(sim_get_reg(REG_DETECTION_OPTIMIZE) == 0xc5);
+    assert(sim_get_reg(REG_DETECTION_THRESHOLD) == 0x0c);
+    assert((sim_get_reg(REG_MODEM_CONFIG_2) >> 4) == 6);
+    lora_set_spreading_factor(10);
+    assert(sim_get_reg(REG_DETECTION_OPTIMIZE) == 0xc3);
+    assert(sim_get_reg(REG_DETECTION_THRESHOLD) == 0x0a);
+    assert((sim_get_reg(REG_MODEM_CONFIG_2) >> 4) == 10);
+
+    lora_set_bandwidth(125000);
+    lora_set_coding_rate(5);
+    int bw, cr, sf;
+    lora_get_settings(&bw, &cr, &sf);
+    assert(bw == 7 && cr == 1 && sf == 10);
+
+    lora_set_preamble_length(0x1234);
+    assert(sim_get_reg(REG_PREAMBLE_MSB) == 0x12);
+    assert(sim_get_reg(REG_PREAMBLE_LSB) == 0x34);
+    lora_set_sync_word(0x34);
+    assert(sim_get_reg(REG_SYNC_WORD) == 0x34);
+    lora_enable_crc();
+    assert(sim_get_reg(REG_MODEM_CONFIG_2) & 0x04);
+    lora_disable_crc();
+    assert((sim_get_reg(REG_MODEM_CONFIG_2) & 0x04) == 0);
+    check_clean();
+}
+
+static void test_tx()
+{
+    setup();
+    uint8_t buf[LORA_MSG_MAX_SIZE];
+    uint8_t out[256];
+    for (int i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = i * 7;
+    }
+    lora_send_packet(buf, sizeof(buf));
+    lora_send_packet(buf + 10, 5);
+    assert(sim_tx_num() == 2);
+    assert(sim_tx_get(out, sizeof(out)) == sizeof(buf));
+    assert(memcmp(out, buf, sizeof(buf)) == 0);
+    assert(sim_tx_get(out, sizeof(out)) == 5);
+    assert(memcmp(out, buf + 10, 5) == 0);
+    // TX done was acknowledged
+    assert((sim_get_reg(REG_IRQ_FLAGS) & IRQ_TX_DONE_MASK) == 0);
+    assert(sim_mode() == MODE_STDBY);
+    check_clean();
+}
+
+static void test_rx()
+{
+    setup();
+    lora_set_frequency(902.3);
+    lora_install_irq_recv(isr_recv_handler);
+    lora_enable_irq_recv(LORA_IRQ_ENABLE);
+    isr_recv = 0;
+
+    uint8_t frame[200];
+    uint8_t buf[LORA_MSG_MAX_SIZE + 1];
+    for (int i = 0; i < sizeof(frame); i++)
+    {
+        frame[i] = 0xff - i;
+    }
+    // not receiving
+    assert(!sim_rx(frame, 10, -80, 5, 1));
+    assert(lora_receive_packet(buf, sizeof(buf)) == 0);
+
+    lora_receive();
+    assert(sim_rx(frame, 10, -80, 5, 1));
+    assert(isr_recv == 1);
+    assert(lora_receive_packet(buf, sizeof(buf)) == 10);
+    assert(memcmp(buf, frame, 10) == 0);
+    assert(lora_packet_rssi() == -80);
+    assert(lora_packet_snr() == 5.0);
+
+    // two frames before reading, the second lands after the first, the driver follows the current address
+    lora_receive();
+    assert(sim_rx(frame, 10, -80, 5, 1));
+    assert(sim_rx(frame + 10, 100, -100, -3, 1));
+    assert(sim_get_reg(REG_FIFO_RX_CURRENT_ADDR) == 10);
+    assert(lora_receive_packet(buf, sizeof(buf)) == 100);
+    assert(memcmp(buf, frame + 10, 100) == 0);
+    assert(lora_packet_rssi() == -100);
+    assert(lora_packet_snr() == -3.0);
+
+    // CRC error is dropped, flags are cleared
+    struct lora_rx_stats_t rs;
+    lora_get_rx_stats(&rs);
+    assert(rs.packets == 2 && rs.crc_errors == 0);
+    lora_receive();
+    assert(sim_rx(frame, 20, -90, 0, 0));
+    assert(lora_receive_packet(buf, sizeof(buf)) == 0);
+    assert(sim_get_reg(REG_IRQ_FLAGS) == 0);
+    lora_get_rx_stats(&rs);
+    assert(rs.packets == 2 && rs.crc_errors == 1);
+
+    // no valid header
+    lora_receive();
+    assert(sim_rx(frame, 20, -90, 0, 1));
+    sim_set_reg(REG_IRQ_FLAGS, sim_get_reg(REG_IRQ_FLAGS) & ~IRQ_VALID_HDR_MASK);
+    assert(lora_receive_packet(buf, sizeof(buf)) == 0);
+    lora_get_rx_stats(&rs);
+    assert(rs.packets == 2 && rs.header_errors == 1);
+
+    // no buffer, the frame is dropped and the flags are cleared
+    lora_receive();
+    assert(sim_rx(frame, 20, -90, 0, 1));
+    assert(lora_receive_packet(NULL, 0) == 0);
+    assert(sim_get_reg(REG_IRQ_FLAGS) == 0);
+
+    // buffer smaller than the frame
+    lora_receive();
+    assert(sim_rx(frame, 200, -90, 0, 1));
+    assert(lora_receive_packet(buf, 50) == 50);
+    assert(memcmp(buf, frame, 50) == 0);
+
+    // implicit header uses the configured length
+    lora_implicit_header_mode(16);
+    lora_receive();
+    assert(sim_rx(frame, 16, -90, 0, 1));
+    assert(lora_receive_packet(buf, sizeof(buf)) == 16);
+    lora_explicit_header_mode();
+
+    // interrupt disabled
+    int n = isr_recv;
+    lora_enable_irq_recv(LORA_IRQ_DISABLE);
+    lora_receive();
+    assert(sim_rx(frame, 10, -80, 5, 1));
+    assert(isr_recv == n);
+    assert(lora_received());
+    lora_uninstall_irq_recv();
+
+    // low band
+    lora_set_frequency(433.175);
+    lora_receive();
+    assert(sim_rx(frame, 10, -120, -10, 1));
+    assert(lora_receive_packet(buf, sizeof(buf)) == 10);
+    assert(lora_packet_rssi() == -120);
+    check_clean();
+}
+
+static void test_fhss()
+{
+    setup();
+    double table[] = {902.3, 902.5, 902.7, 902.9};
+    lora_install_irq_fhss(isr_fhss_handler);
+    lora_enable_irq_fhss(LORA_IRQ_ENABLE);
+    isr_fhss = 0;
+
+    assert(!sim_hop(1));
+    lora_fhss_sethops(5);
+    lora_receive();
+    assert(lora_fhss_handle(table, 4) == 0);
+
+    for (int ch = 0; ch < 8; ch++)
+    {
+        assert(sim_hop(ch));
+        assert(isr_fhss == ch + 1);
+        assert(lora_fhss_handle(table, 4) == 1);
+        double ideal = table[ch % 4] * 1e6 / 61.03515625;
+        assert(abs((int)sim_frf() - (int)ideal) < 64);
+        assert((sim_get_reg(REG_IRQ_FLAGS) & IRQ_FHSS_CHANGE_CHANNEL) == 0);
+    }
+
+    // precomputed registers: same frequency as lora_fhss_handle()
+    struct lora_frf_t frf[4];
+    lora_frf_table(table, frf, 4);
+    for (int ch = 0; ch < 8; ch++)
+    {
+        assert(sim_hop(ch));
+        assert(lora_fhss_handle(table, 4) == 1);
+        uint32_t expect = sim_frf();
+        lora_set_frequency(868.1);
+        assert(sim_hop(ch));
+        sim_stats_t st;
+        sim_get_stats(&st);
+        unsigned int t = st.transactions;
+        assert(lora_fhss_handle_frf(frf, 4) == 1);
+        sim_get_stats(&st);
+        // IRQ flags, hop channel, FRF burst, IRQ clear
+        assert(st.transactions - t == 4);
+        assert(sim_frf() == expect);
+        assert((sim_get_reg(REG_IRQ_FLAGS) & IRQ_FHSS_CHANGE_CHANNEL) == 0);
+    }
+    assert(lora_fhss_handle_frf(frf, 4) == 0);
+    lora_uninstall_irq_fhss();
+    check_clean();
+}
+
+static void test_sleep()
+{
+    setup();
+    uint8_t buf[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    lora_sleep();
+    // the driver leaves sleep before touching the FIFO
+    lora_send_packet(buf, sizeof(buf));
+    assert(sim_tx_num() == 1);
+    check_clean();
+}
+
+static void test_tx_async()
+{
+    setup();
+    uint8_t buf[32];
+    uint8_t out[256];
+    memset(buf, 0xaa, sizeof(buf));
+    lora_install_irq_recv(isr_recv_handler);
+    lora_enable_irq_recv(LORA_IRQ_ENABLE);
+    isr_recv = 0;
+
+    sim_set_tx_hold(1);
+    lora_send_packet_start(buf, sizeof(buf));
+    assert(sim_mode() == MODE_TX);
+    // DIO0 signals TX done while sending
+    assert((sim_get_reg(REG_DIO_MAPPING_1) >> 6) == 1);
+    assert(!lora_send_packet_done());
+    assert(isr_recv == 0);
+    assert(sim_tx_finish());
+    assert(isr_recv == 1);
+    assert(lora_send_packet_done());
+    assert(sim_mode() == MODE_STDBY);
+    assert(sim_get_reg(REG_IRQ_FLAGS) == 0);
+    assert((sim_get_reg(REG_DIO_MAPPING_1) >> 6) == 0);
+    assert(sim_tx_get(out, sizeof(out)) == sizeof(buf));
+    assert(memcmp(out, buf, sizeof(buf)) == 0);
+
+    // no TX done: abort restores standby and RxDone
+    lora_send_packet_start(buf, sizeof(buf));
+    assert((sim_get_reg(REG_DIO_MAPPING_1) >> 6) == 1);
+    lora_send_packet_abort();
+    assert(sim_mode() == MODE_STDBY);
+    assert((sim_get_reg(REG_DIO_MAPPING_1) >> 6) == 0);
+    assert(sim_get_reg(REG_IRQ_FLAGS) == 0);
+    assert(sim_tx_get(out, sizeof(out)) == sizeof(buf));
+    sim_set_tx_hold(0);
+
+    // back to receiving, DIO0 is RxDone again
+    lora_receive();
+    assert(sim_rx(buf, 10, -80, 5, 1));
+    assert(isr_recv == 2);
+    assert(lora_receive_packet(out, sizeof(out)) == 10);
+    lora_uninstall_irq_recv();
+    check_clean();
+}
+
+static void test_airtime()
+{
+    setup();
+    // SF7, 125kHz, 4/5, 8 symbol preamble, explicit header, CRC: 41.216ms for 10 bytes
+    lora_set_spreading_factor(7);
+    lora_set_bandwidth(125000);
+    lora_set_coding_rate(5);
+    lora_set_preamble_length(8);
+    lora_enable_crc();
+    assert(lora_time_on_air_us(10) == 41216);
+    // SF12 with low data rate optimization: 9019.392ms for 255 bytes
+    lora_set_spreading_factor(12);
+    lora_write_reg(REG_MODEM_CONFIG_3, 0x0c);
+    assert(lora_time_on_air_us(255) == 9019392);
+    // SF7, 500kHz, 4/8, implicit header, no CRC
+    lora_write_reg(REG_MODEM_CONFIG_3, 0x04);
+    lora_set_spreading_factor(7);
+    lora_set_bandwidth(500000);
+    lora_set_coding_rate(8);
+    lora_disable_crc();
+    lora_implicit_header_mode(20);
+    assert(lora_time_on_air_us(20) == 15424);
+    check_clean();
+}
+
+static void test_lbt()
+{
+    uint8_t buf[16];
+    uint8_t out[256];
+    struct lora_lbt_stats_t st;
+    memset(buf, 0x55, sizeof(buf));
+    setup();
+    lora_install_irq_recv(isr_recv_handler);
+    lora_enable_irq_recv(LORA_IRQ_ENABLE);
+    isr_recv = 0;
+
+    // CAD with DIO0 = CadDone, modem in standby after it
+    lora_receive();
+    lora_cad_start();
+    assert(isr_recv == 1);
+    assert(sim_mode() == MODE_STDBY);
+    assert(lora_cad_done() == LORA_CAD_FREE);
+    assert(sim_get_reg(REG_IRQ_FLAGS) == 0);
+    assert((sim_get_reg(REG_DIO_MAPPING_1) >> 6) == 0);
+    assert(lora_cad_done() == LORA_CAD_PENDING);
+    sim_set_cad_busy(1);
+    assert(lora_cad() == LORA_CAD_BUSY);
+    assert(lora_cad() == LORA_CAD_FREE);
+
+    // no CAD done: abort restores standby and RxDone
+    lora_receive();
+    lora_cad_start();
+    sim_set_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
+    sim_set_reg(REG_IRQ_FLAGS, IRQ_CAD_DETECT_MASK);
+    lora_cad_abort();
+    assert(sim_mode() == MODE_STDBY);
+    assert((sim_get_reg(REG_DIO_MAPPING_1) >> 6) == 0);
+    assert(sim_get_reg(REG_IRQ_FLAGS) == 0);
+
+    // off: sent without CAD
+    sim_stats_t sst;
+    sim_get_stats(&sst);
+    unsigned int cad = sst.cad;
+    sim_set_cad_busy(1);
+    assert(lora_send_packet_lbt(buf, sizeof(buf)));
+    sim_get_stats(&sst);
+    assert(sst.cad == cad);
+    assert(sim_tx_get(out, sizeof(out)) == sizeof(buf));
+    sim_set_cad_busy(0);
+
+    // busy twice, sent on the third CAD
+    lora_set_lbt(1, 3, 10);
+    sim_set_cad_busy(2);
+    assert(lora_send_packet_lbt(buf, sizeof(buf)));
+    assert(sim_tx_get(out, sizeof(out)) == sizeof(buf));
+    lora_get_lbt_stats(&st);
+    assert(st.cad_runs == 6);
+    assert(st.busy == 3);
+    assert(st.retries == 2);
+    assert(st.dropped == 0);
+
+    // busy for longer than the retries
+    sim_set_cad_busy(10);
+    assert(!lora_send_packet_lbt(buf, sizeof(buf)));
+    assert(sim_tx_num() == 0);
+    lora_get_lbt_stats(&st);
+    assert(st.cad_runs == 10);
+    assert(st.retries == 5);
+    assert(st.dropped == 1);
+    sim_set_cad_busy(0);
+
+    // backoff window doubles per retry, capped
+    for (int i = 0; i < 100; i++)
+    {
+        int b = lora_lbt_backoff_ms(1);
+        assert(b >= 1 && b <= 10);
+        b = lora_lbt_backoff_ms(3);
+        assert(b >= 1 && b <= 40);
+    }
+    lora_set_lbt(1, 100, 10);
+    for (int i = 0; i < 100; i++)
+    {
+        int b = lora_lbt_backoff_ms(50);
+        assert(b >= 1 && b <= 160);
+    }
+    lora_set_lbt(0, 0, 0);
+
+    lora_uninstall_irq_recv();
+    check_clean();
+}
+
+static unsigned int transactions()
+{
+    sim_stats_t st;
+    sim_get_stats(&st);
+    return st.transactions;
+}
+
+static void test_shadow()
+{
+    setup();
+    struct lora_spi_stats_t ls;
+
+    // read-modify-write only costs the write
+    unsigned int t = transactions();
+    lora_set_bandwidth(250000);
+    assert(transactions() == t + 1);
+    assert((sim_get_reg(REG_MODEM_CONFIG_1) >> 4) == 8);
+    // unchanged values are not written again
+    t = transactions();
+    lora_set_bandwidth(250000);
+    lora_set_spreading_factor(7);
+    lora_set_spreading_factor(7);
+    lora_set_frequency(902.3);
+    lora_set_frequency(902.3);
+    assert(transactions() == t + 3);
+    lora_get_spi_stats(&ls);
+    assert(ls.writes_saved >= 4);
+    assert(ls.reads_saved > 0);
+
+    // batch: nothing is written until the commit, then only the changed registers
+    lora_config_begin();
+    t = transactions();
+    lora_set_frequency(903.9);
+    lora_set_bandwidth(125000);
+    lora_set_spreading_factor(10);
+    lora_set_spreading_factor(7);
+    lora_set_coding_rate(5);
+    lora_set_preamble_length(8);
+    lora_set_sync_word(0x34);
+    lora_enable_crc();
+    assert(transactions() == t);
+    assert((sim_get_reg(REG_MODEM_CONFIG_1) >> 4) == 8);
+    // FRF_MID/LSB (same MSB), MODEM_CONFIG_1, MODEM_CONFIG_2 (SF7 again but CRC), PREAMBLE_LSB, SYNC_WORD
+    assert(lora_config_commit() == 6);
+    // FRF_MID/LSB and MODEM_CONFIG_1/2 are bursts
+    assert(transactions() == t + 4);
+    double ideal = 903.9e6 / 61.03515625;
+    assert(abs((int)sim_frf() - (int)ideal) < 64);
+    assert(sim_get_reg(REG_MODEM_CONFIG_1) == 0x72);
+    assert(sim_get_reg(REG_MODEM_CONFIG_2) == 0x74);
+    assert(sim_get_reg(REG_PREAMBLE_LSB) == 8);
+    assert(sim_get_reg(REG_SYNC_WORD) == 0x34);
+    assert(sim_get_reg(REG_DETECTION_OPTIMIZE) == 0xc3);
+    assert(lora_config_commit() == 0);
+
+    // deferred writes reach the modem, they are not saved
+    lora_get_spi_stats(&ls);
+    unsigned int saved = ls.writes_saved;
+    lora_config_begin();
+    lora_set_sync_word(0x12);
+    assert(lora_config_commit() == 1);
+    lora_get_spi_stats(&ls);
+    assert(ls.writes_saved == saved);
+
+    // the shadow matches the modem
+    for (int reg = REG_FRF_MSB; reg <= REG_DIO_MAPPING_1; reg++)
+    {
+        if (reg != REG_FIFO_ADDR_PTR && reg != REG_IRQ_FLAGS)
+        {
+            int v = lora_read_reg(reg);
+            assert(v == sim_get_reg(reg));
+        }
+    }
+    check_clean();
+}
+
+// -- benchmark
+
+static void bench_print(const char *name, sim_stats_t *before)
+{
+    sim_stats_t st;
+    sim_get_stats(&st);
+    unsigned int t = st.transactions - before->transactions;
+    unsigned int b = st.bytes - before->bytes;
+    // bus time only, every transaction adds driver and CS overhead on top
+    printf("%-34s %5u transactions %6u bytes %8.1f us @ 9MHz\n", name, t, b, b * 8 / SPI_HZ * 1e6);
+    memcpy(before, &st, sizeof(sim_stats_t));
+}
+
+static void bench()
+{
+    sim_stats_t st;
+    uint8_t buf[LORA_MSG_MAX_SIZE + 1];
+    double table[] = {902.3, 902.5};
+    memset(buf, 0x55, sizeof(buf));
+
+    sim_reset();
+    memset(&st, 0, sizeof(st));
+    lora_config(SIM_GPIO_CS, SIM_GPIO_RST, SIM_GPIO_MISO, SIM_GPIO_MOSI, SIM_GPIO_SCK);
+    lora_config_dio(SIM_GPIO_DIO0, SIM_GPIO_DIO1, SIM_GPIO_DIO2);
+    lora_init();
+    lora_explicit_header_mode();
+    bench_print("lora_init", &st);
+    lora_set_frequency(902.3);
+    bench_print("lora_set_frequency", &st);
+    lora_set_spreading_factor(7);
+    bench_print("lora_set_spreading_factor", &st);
+    // 125kHz is the default and would not be written
+    lora_set_bandwidth(250000);
+    bench_print("lora_set_bandwidth", &st);
+    lora_set_preamble_length(8);
+    bench_print("lora_set_preamble_length", &st);
+    lora_send_packet(buf, LORA_MSG_MAX_SIZE);
+    bench_print("lora_send_packet (255 bytes)", &st);
+    lora_send_packet(buf, 16);
+    bench_print("lora_send_packet (16 bytes)", &st);
+    lora_receive();
+    bench_print("lora_receive", &st);
+    sim_rx(buf, LORA_MSG_MAX_SIZE, -80, 5, 1);
+    assert(lora_receive_packet(buf, sizeof(buf)) == LORA_MSG_MAX_SIZE);
+    bench_print("lora_receive_packet (255 bytes)", &st);
+    lora_packet_rssi();
+    lora_packet_snr();
+    bench_print("lora_packet_rssi + lora_packet_snr", &st);
+    lora_fhss_sethops(5);
+    sim_hop(1);
+    sim_get_stats(&st);
+    lora_fhss_handle(table, 2);
+    bench_print("lora_fhss_handle", &st);
+    struct lora_frf_t frf[2];
+    lora_frf_table(table, frf, 2);
+    sim_hop(0);
+    sim_get_stats(&st);
+    lora_fhss_handle_frf(frf, 2);
+    bench_print("lora_fhss_handle_frf", &st);
+    lora_idle();
+    sim_get_stats(&st);
+    lora_set_frequency(903.9);
+    lora_set_bandwidth(500000);
+    lora_set_spreading_factor(8);
+    lora_enable_invert_iq();
+    bench_print("channel switch", &st);
+    lora_config_begin();
+    lora_set_frequency(902.3);
+    lora_set_bandwidth(125000);
+    lora_set_spreading_factor(7);
+    lora_disable_invert_iq();
+    lora_config_commit();
+    bench_print("channel switch (batch)", &st);
+}
+
+int main(int argc, char **argv)
+{
+    test_config();
+    test_tx();
+    test_rx();
+    test_fhss();
+    test_sleep();
+    test_shadow();
+    test_tx_async();
+    test_airtime();
+    test_lbt();
+    printf("tests ok\n");
+    bench();
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright: Collin Mulliner <collin AT mulliner.org>
+ */
+
+#ifndef _LORA_SIM_H_
+#define _LORA_SIM_H_
+
+/*
+ * Host build of components/lora/lora.c (-DLORA_SIM).
+ *
+ * Provides the parts of the ESP-IDF SPI master, GPIO and FreeRTOS API
+ * the driver uses. SPI transactions go to a model of the SX127x register
+ * file (FIFO pointers, IRQ flags, op modes, FHSS, DIO0/DIO2 interrupts).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// -- ESP-IDF / FreeRTOS
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+typedef unsigned int TickType_t;
+#define portMAX_DELAY 0xffffffff
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms) / 10)
+void vTaskDelay(const TickType_t ticks);
+typedef void *TaskHandle_t;
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+typedef void *SemaphoreHandle_t;
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+int xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks);
+int xSemaphoreGive(SemaphoreHandle_t s);
+
+int64_t esp_timer_get_time(void);
+uint32_t esp_random(void);
+
+typedef enum
+{
+    GPIO_MODE_INPUT = 1,
+    GPIO_MODE_OUTPUT = 2,
+} gpio_mode_t;
+
+typedef enum
+{
+    GPIO_INTR_POSEDGE = 1,
+} gpio_int_type_t;
+
+typedef void (*gpio_isr_t)(void *);
+
+void gpio_pad_select_gpio(const int gpio);
+esp_err_t gpio_set_direction(const int gpio, const gpio_mode_t mode);
+esp_err_t gpio_set_level(const int gpio, const int level);
+esp_err_t gpio_set_intr_type(const int gpio, const gpio_int_type_t type);
+esp_err_t gpio_intr_enable(const int gpio);
+esp_err_t gpio_intr_disable(const int gpio);
+esp_err_t gpio_isr_handler_add(const int gpio, gpio_isr_t handler, void *arg);
+esp_err_t gpio_isr_handler_remove(const int gpio);
+
+typedef enum
+{
+    HSPI_HOST = 1,
+    VSPI_HOST = 2,
+} spi_host_device_t;
+
+#define SPI_TRANS_USE_RXDATA (1 << 2)
+#define SPI_TRANS_USE_TXDATA (1 << 3)
+
+typedef struct
+{
+    int miso_io_num;
+    int mosi_io_num;
+    int sclk_io_num;
+    int quadwp_io_num;
+    int quadhd_io_num;
+    int max_transfer_sz;
+} spi_bus_config_t;
+
+typedef struct
+{
+    uint8_t address_bits;
+    uint8_t mode;
+    int clock_speed_hz;
+    int spics_io_num;
+    uint32_t flags;
+    int queue_size;
+    void (*pre_cb)(void *trans);
+} spi_device_interface_config_t;
+
+typedef struct
+{
+    uint32_t flags;
+    uint64_t addr;
+    size_t length;
+    size_t rxlength;
+    union
+    {
+        const void *tx_buffer;
+        uint8_t tx_data[4];
+    };
+    union
+    {
+        void *rx_buffer;
+        uint8_t rx_data[4];
+    };
+} spi_transaction_t;
+
+typedef struct spi_device_t *spi_device_handle_t;
+
+esp_err_t spi_bus_initialize(const spi_host_device_t host, const spi_bus_config_t *bus, const int dma_chan);
+esp_err_t spi_bus_add_device(const spi_host_device_t host, const spi_device_interface_config_t *dev, spi_device_handle_t *handle);
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *t);
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t *t);
+esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *t, const TickType_t ticks);
+esp_err_t spi_device_get_trans_result(spi_device_handle_t handle, spi_transaction_t **t, const TickType_t ticks);
+
+// -- simulator
+
+// pins the tests pass to lora_config() / lora_config_dio()
+#define SIM_GPIO_CS 18
+#define SIM_GPIO_RST 14
+#define SIM_GPIO_MISO 19
+#define SIM_GPIO_MOSI 27
+#define SIM_GPIO_SCK 5
+#define SIM_GPIO_DIO0 26
+#define SIM_GPIO_DIO1 33
+#define SIM_GPIO_DIO2 32
+
+#define SIM_TX_MAX 16
+
+typedef struct
+{
+    // SPI transactions and bytes on the bus (address byte included)
+    unsigned int transactions;
+    unsigned int bytes;
+    // FIFO accessed in sleep mode, transaction queue overflow, ...
+    unsigned int violations;
+    // DIO interrupts delivered
+    unsigned int dio0;
+    unsigned int dio2;
+    // channel activity detections
+    unsigned int cad;
+} sim_stats_t;
+
+void sim_reset(void);
+void sim_get_stats(sim_stats_t *stats);
+uint8_t sim_get_reg(const int reg);
+void sim_set_reg(const int reg, const uint8_t val);
+// current op mode (lower 3 bits of REG_OP_MODE)
+int sim_mode(void);
+// frequency register value (FRF MSB/MID/LSB)
+uint32_t sim_frf(void);
+// receive a frame, returns 0 if the modem is not receiving
+int sim_rx(const uint8_t *frame, const int len, const int pkt_rssi, const int pkt_snr, const int crc_ok);
+// FHSS channel change, returns 0 if hopping is off
+int sim_hop(const int channel);
+// frames sent, returns length or -1 (oldest first, removes the frame)
+int sim_tx_get(uint8_t *buf, const int size);
+int sim_tx_num(void);
+// keep TX on air until sim_tx_finish() (default: sent right away)
+void sim_set_tx_hold(const int hold);
+// finish TX (TX done, DIO0), returns 0 if the modem is not sending
+int sim_tx_finish(void);
+// the next num channel activity detections find a busy channel
+void sim_set_cad_busy(const int num);
+
+#endif
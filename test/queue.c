@@ -2,28 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
-
-// --- START - mock mutex and semaphore functions
-int xSemaphoreCreateMutex()
-{
-    return 0;
-}
-
-int xSemaphoreGive(int arg)
-{
-    return 0;
-}
-
-int xSemaphoreTake(int arg1, int arg2)
-{
-    return 0;
-}
-
-#define portMAX_DELAY 0
-#define SemaphoreHandle_t int
-#define xSemaphoreCreateBinary xSemaphoreCreateMutex
-
-// --- END - mock mutex and semaphore functions
+#include <pthread.h>
 
 #include "queue.h"
 
@@ -36,16 +15,87 @@ struct lm_lora_msg_t
     int data;
 };
 
+#define PRODUCERS 4
+#define PER_PRODUCER 100000
+
+static work_queue_t mt_queue;
+
+static void *producer(void *arg)
+{
+    int id = (int)(long)arg;
+    for (int i = 0; i < PER_PRODUCER; i++)
+    {
+        lm_lora_msg_ptr_t n = malloc(sizeof(lm_lora_msg_t));
+        n->prev = NULL;
+        n->data = (id << 24) | i;
+        WORK_QUEUE_RECV_ADD((&mt_queue), n);
+    }
+    return NULL;
+}
+
+// multiple producers, one consumer: nothing lost and per producer FIFO order
+static void test_mpsc()
+{
+    work_queue_t *q = &mt_queue;
+    pthread_t th[PRODUCERS];
+    int expect[PRODUCERS] = {0};
+    int total = 0;
+
+    WORK_QUEUE_INIT(q);
+    for (long i = 0; i < PRODUCERS; i++)
+    {
+        pthread_create(&th[i], NULL, producer, (void *)i);
+    }
+
+    while (total < PRODUCERS * PER_PRODUCER)
+    {
+        lm_lora_msg_ptr_t m = NULL;
+        if (total & 1)
+        {
+            WORK_QUEUE_RECV_GET(q, m);
+            if (m == NULL)
+                continue;
+        }
+        else
+        {
+            WORK_QUEUE_RECV_TAKE_HEAD(q, m);
+        }
+        while (m != NULL)
+        {
+            lm_lora_msg_ptr_t next = m->next;
+            int id = m->data >> 24;
+            assert((m->data & 0xffffff) == expect[id]);
+            expect[id]++;
+            total++;
+            free(m);
+            m = next;
+        }
+        // producers count before publishing, never below what was taken
+        int len;
+        WORK_QUEUE_RECV_LEN(q, len, m);
+        assert(len >= 0);
+    }
+
+    for (int i = 0; i < PRODUCERS; i++)
+    {
+        pthread_join(th[i], NULL);
+    }
+
+    int q_len;
+    WORK_QUEUE_RECV_LEN(q, q_len, fn);
+    assert(q_len == 0);
+}
+
 int main()
 {
     work_queue_t queue;
     work_queue_t *q = &queue;
 
-    lm_lora_msg_ptr_t fn;
     int q_len;
 
     WORK_QUEUE_INIT(q);
-    assert(q->recv_queue == NULL);
+    WORK_QUEUE_RECV_LEN(q, q_len, fn);
+    assert(q_len == 0);
 
     lm_lora_msg_ptr_t n = malloc(sizeof(lm_lora_msg_t));
     n->next = NULL;
@@ -53,7 +103,6 @@ int main()
 
     // add
     WORK_QUEUE_RECV_ADD(q, n);
-    assert(q->recv_queue != NULL);
 
     WORK_QUEUE_RECV_LEN(q, q_len, fn);
     assert(q_len == 1);
@@ -61,33 +110,71 @@ int main()
     // take head
     lm_lora_msg_ptr_t head;
     WORK_QUEUE_RECV_TAKE_HEAD(q, head);
-    assert(q->recv_queue == NULL);
-    assert(head != NULL);
+    assert(head == n);
+    assert(head->next == NULL);
 
     WORK_QUEUE_RECV_LEN(q, q_len, fn);
     assert(q_len == 0);
 
     WORK_QUEUE_RECV_INSERT_HEAD(q, head);
-    assert(q->recv_queue == head);
 
     WORK_QUEUE_RECV_LEN(q, q_len, fn);
     assert(q_len == 1);
 
     // take head, add node, re-insert head
     WORK_QUEUE_RECV_TAKE_HEAD(q, head);
-    assert(q->recv_queue == NULL);
-    assert(head != NULL);
+    assert(head == n);
 
     lm_lora_msg_ptr_t n1 = malloc(sizeof(lm_lora_msg_t));
     n1->next = NULL;
     n1->prev = NULL;
 
     WORK_QUEUE_RECV_ADD(q, n1);
-    assert(q->recv_queue == n1);
 
     WORK_QUEUE_RECV_INSERT_HEAD(q, head);
-    assert(q->recv_queue == head);
 
     WORK_QUEUE_RECV_LEN(q, q_len, fn);
     assert(q_len == 2);
-}
\ No newline at end of file
+
+    // order is: head, n1
+    lm_lora_msg_ptr_t m;
+    WORK_QUEUE_RECV_GET(q, m);
+    assert(m == head);
+    WORK_QUEUE_RECV_GET(q, m);
+    assert(m == n1);
+    WORK_QUEUE_RECV_GET(q, m);
+    assert(m == NULL);
+
+    WORK_QUEUE_RECV_LEN(q, q_len, fn);
+    assert(q_len == 0);
+
+    // FIFO order across adds and gets
+    for (int i = 0; i < 10; i++)
+    {
+        m = malloc(sizeof(lm_lora_msg_t));
+        m->data = i;
+        WORK_QUEUE_SEND_ADD(q, m);
+        if (i == 4)
+        {
+            WORK_QUEUE_SEND_GET(q, m);
+            assert(m->data == 0);
+            free(m);
+        }
+    }
+    WORK_QUEUE_SEND_LEN(q, q_len, fn);
+    assert(q_len == 9);
+    for (int i = 1; i < 10; i++)
+    {
+        WORK_QUEUE_SEND_GET(q, m);
+        assert(m->data == i);
+        free(m);
+    }
+    WORK_QUEUE_SEND_GET(q, m);
+    assert(m == NULL);
+
+    free(n);
+    free(n1);
+
+    test_mpsc();
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// --- START - mock mutex functions (the old queue locks on every call)
+static int sem_ops = 0;
+
+int xSemaphoreGive(int arg)
+{
+    sem_ops++;
+    return 0;
+}
+
+int xSemaphoreTake(int arg1, int arg2)
+{
+    sem_ops++;
+    return 0;
+}
+
+#define portMAX_DELAY 0
+// --- END - mock mutex functions
+
+#include "queue.h"
+
+// --- START - previous linked list queue (walks the list on every append)
+typedef struct
+{
+    void *recv_queue;
+    int recv_queue_mutex;
+} legacy_queue_t;
+
+#define LEGACY_DL_APPEND(head, entry)   \
+    do                                  \
+    {                                   \
+        if (head)                       \
+        {                               \
+            typeof(entry) _tmp = head;  \
+            while (_tmp->next != NULL)  \
+            {                           \
+                _tmp = _tmp->next;      \
+            }                           \
+            entry->prev = _tmp;         \
+            _tmp->next = entry;         \
+        }                               \
+        else                            \
+        {                               \
+            head = (typeof(head))entry; \
+        }                               \
+    } while (0)
+
+#define LEGACY_RECV_ADD(q, node)                            \
+    do                                                      \
+    {                                                       \
+        xSemaphoreTake(q->recv_queue_mutex, portMAX_DELAY); \
+        LEGACY_DL_APPEND(q->recv_queue, node);              \
+        xSemaphoreGive(q->recv_queue_mutex);                \
+    } while (0)
+
+#define LEGACY_RECV_LEN(q, q_length, entry)      \
+    do                                           \
+    {                                            \
+        q_length = 0;                            \
+        typeof(entry) _q_l_head = q->recv_queue; \
+        while (_q_l_head != NULL)                \
+        {                                        \
+            q_length++;                          \
+            _q_l_head = _q_l_head->next;         \
+        }                                        \
+    } while (0)
+
+#define LEGACY_RECV_GET(q, item)                            \
+    do                                                      \
+    {                                                       \
+        xSemaphoreTake(q->recv_queue_mutex, portMAX_DELAY); \
+        item = (typeof(item))q->recv_queue;                 \
+        if (item != NULL)                                   \
+        {                                                   \
+            q->recv_queue = (void *)item->next;             \
+        }                                                   \
+        xSemaphoreGive(q->recv_queue_mutex);                \
+    } while (0)
+// --- END - previous linked list queue
+
+typedef struct bench_msg_t bench_msg_t;
+typedef bench_msg_t *bench_msg_ptr_t;
+struct bench_msg_t
+{
+    bench_msg_ptr_t next;
+    bench_msg_ptr_t prev;
+    int data;
+};
+
+#define ROUNDS 200
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// enqueue num events, reading the length after every add like a
+// producer checking the backlog would, then drain them
+static void bench(const int num, bench_msg_ptr_t msgs)
+{
+    double legacy_add = 0, legacy_get = 0;
+    double mpsc_add = 0, mpsc_get = 0;
+    int len;
+    bench_msg_ptr_t m;
+
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        legacy_queue_t lq = {NULL, 0};
+        legacy_queue_t *l = &lq;
+        double t = now_us();
+        for (int i = 0; i < num; i++)
+        {
+            msgs[i].next = NULL;
+            msgs[i].prev = NULL;
+            LEGACY_RECV_ADD(l, (&msgs[i]));
+            LEGACY_RECV_LEN(l, len, m);
+        }
+        legacy_add += now_us() - t;
+        t = now_us();
+        for (;;)
+        {
+            LEGACY_RECV_GET(l, m);
+            if (m == NULL)
+                break;
+        }
+        legacy_get += now_us() - t;
+
+        work_queue_t wq;
+        work_queue_t *q = &wq;
+        WORK_QUEUE_INIT(q);
+        t = now_us();
+        for (int i = 0; i < num; i++)
+        {
+            WORK_QUEUE_RECV_ADD(q, (&msgs[i]));
+            WORK_QUEUE_RECV_LEN(q, len, m);
+        }
+        mpsc_add += now_us() - t;
+        t = now_us();
+        for (;;)
+        {
+            WORK_QUEUE_RECV_GET(q, m);
+            if (m == NULL)
+                break;
+        }
+        mpsc_get += now_us() - t;
+    }
+    (void)len;
+
+    printf("%5d events | legacy add %8.2f us get %6.2f us | mpsc add %6.2f us get %6.2f us | add speedup %6.1fx\n",
+           num,
+           legacy_add / ROUNDS, legacy_get / ROUNDS,
+           mpsc_add / ROUNDS, mpsc_get / ROUNDS,
+           legacy_add / mpsc_add);
+}
+
+int main()
+{
+    int sizes[] = {10, 100, 1000};
+    bench_msg_ptr_t msgs = malloc(sizeof(bench_msg_t) * 1000);
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        bench(sizes[i], msgs);
+    }
+    free(msgs);
+    return 0;
+}